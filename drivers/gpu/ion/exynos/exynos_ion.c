@@ -391,11 +391,13 @@ static struct ion_heap *ion_exynos_heap_create(struct ion_platform_heap *unused)
 		return ERR_PTR(-ENOMEM);
 	heap->ops = &vmheap_ops;
 	heap->type = ION_HEAP_TYPE_EXYNOS;
+	heap->flags = ION_HEAP_FLAG_DEFER_FREE;
 	return heap;
 }
 
 static void ion_exynos_heap_destroy(struct ion_heap *heap)
 {
+	ion_heap_exit_deferred_free(heap);
 	kfree(heap);
 }
 
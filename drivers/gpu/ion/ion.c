@@ -19,6 +19,7 @@
 #include <linux/fs.h>
 #include <linux/anon_inodes.h>
 #include <linux/ion.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/memblock.h>
 #include <linux/miscdevice.h>
@@ -43,6 +44,9 @@
 
 #include "ion_priv.h"
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/ion.h>
+
 /**
  * struct ion_device - the metadata of the ion device node
  * @dev:		the actual misc device
@@ -168,6 +172,8 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	struct ion_buffer *buffer;
 	struct sg_table *table;
 	struct scatterlist *sg;
+	ktime_t start;
+	s64 us;
 	int i, ret;
 
 	buffer = kzalloc(sizeof(struct ion_buffer), GFP_KERNEL);
@@ -180,7 +186,11 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	buffer->flags = flags;
 	kref_init(&buffer->ref);
 
+	start = ktime_get();
 	ret = heap->ops->allocate(heap, buffer, len, align, flags);
+	us = ktime_us_delta(ktime_get(), start);
+	ion_heap_alloc_stats_add(heap, len, us, ret);
+	trace_ion_alloc_buffer(heap, ret ? NULL : buffer, len, flags, us, ret);
 	if (ret) {
 		pr_err("%s: failed to allocate buffer from heap '%s'\n",
 				__func__, heap->name ? heap->name : "");
@@ -257,11 +267,12 @@ err:
 
 static void ion_buffer_kmap_put(struct ion_buffer *buffer);
 
-static void ion_buffer_destroy(struct kref *kref)
+void ion_buffer_destroy(struct ion_buffer *buffer)
 {
-	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
 	struct ion_device *dev = buffer->dev;
 
+	trace_ion_free_buffer(buffer->heap, buffer, buffer->size);
+
 	if (ion_buffer_preserve_kmap(buffer) &&
 			(buffer->size < __KVA_PRESERVE_LIMIT))
 		ion_buffer_kmap_put(buffer);
@@ -274,15 +285,28 @@ static void ion_buffer_destroy(struct kref *kref)
 
 	buffer->heap->ops->unmap_dma(buffer->heap, buffer);
 	buffer->heap->ops->free(buffer);
-	mutex_lock(&dev->buffer_lock);
-	rb_erase(&buffer->node, &dev->buffers);
-	mutex_unlock(&dev->buffer_lock);
 
 	if (buffer->flags & ION_FLAG_CACHED)
 		kfree(buffer->dirty);
 	kfree(buffer);
 }
 
+static void _ion_buffer_destroy(struct kref *kref)
+{
+	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
+	struct ion_heap *heap = buffer->heap;
+	struct ion_device *dev = buffer->dev;
+
+	mutex_lock(&dev->buffer_lock);
+	rb_erase(&buffer->node, &dev->buffers);
+	mutex_unlock(&dev->buffer_lock);
+
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_freelist_add(heap, buffer);
+	else
+		ion_buffer_destroy(buffer);
+}
+
 static void ion_buffer_get(struct ion_buffer *buffer)
 {
 	kref_get(&buffer->ref);
@@ -290,7 +314,7 @@ static void ion_buffer_get(struct ion_buffer *buffer)
 
 static int ion_buffer_put(struct ion_buffer *buffer)
 {
-	return kref_put(&buffer->ref, ion_buffer_destroy);
+	return kref_put(&buffer->ref, _ion_buffer_destroy);
 }
 
 static void ion_buffer_add_to_handle(struct ion_buffer *buffer)
@@ -492,6 +516,10 @@ struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 		if (!((1 << heap->id) & heap_mask))
 			continue;
 		buffer = ion_buffer_create(heap, dev, len, align, flags);
+		/* memory may still be waiting on the heap's free list */
+		if (IS_ERR(buffer) && (heap->flags & ION_HEAP_FLAG_DEFER_FREE) &&
+		    ion_heap_freelist_drain(heap))
+			buffer = ion_buffer_create(heap, dev, len, align, flags);
 		if (!IS_ERR_OR_NULL(buffer))
 			break;
 	}
@@ -591,6 +619,7 @@ static void *ion_buffer_kmap_get(struct ion_buffer *buffer)
 	vaddr = buffer->heap->ops->map_kernel(buffer->heap, buffer);
 	if (IS_ERR_OR_NULL(vaddr))
 		return vaddr;
+	trace_ion_map_kernel(buffer->heap, buffer, buffer->size);
 	buffer->vaddr = vaddr;
 	buffer->kmap_cnt++;
 	return vaddr;
@@ -849,6 +878,7 @@ static struct sg_table *ion_map_dma_buf(struct dma_buf_attachment *attachment,
 	}
 
 	ion_buffer_sync_for_device(buffer, attachment->dev, direction);
+	trace_ion_map_dma(buffer->heap, buffer, buffer->size);
 	return buffer->sg_table;
 }
 
@@ -1061,6 +1091,7 @@ static int ion_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
 		vma->vm_private_data = buffer;
 		vma->vm_ops = &ion_vma_ops;
 		ion_vm_open(vma);
+		trace_ion_map_user(buffer->heap, buffer, buffer->size);
 		return 0;
 	}
 
@@ -1075,6 +1106,8 @@ static int ion_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
 	if (ret)
 		pr_err("%s: failure mapping buffer to userspace\n",
 		       __func__);
+	else
+		trace_ion_map_user(buffer->heap, buffer, buffer->size);
 
 	return ret;
 }
@@ -1435,6 +1468,11 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 	seq_printf(s, "%16.s %16u\n", "total ", total_size);
 	seq_printf(s, "----------------------------------------------------\n");
 
+	ion_heap_alloc_stats_debug_show(heap, s);
+
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_freelist_debug_show(heap, s);
+
 	if (heap->debug_show)
 		heap->debug_show(heap, s, unused);
 
@@ -1464,6 +1502,9 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 		pr_err("%s: can not add heap with invalid ops struct.\n",
 		       __func__);
 
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_init_deferred_free(heap);
+
 	heap->dev = dev;
 	down_write(&dev->lock);
 	while (*p) {
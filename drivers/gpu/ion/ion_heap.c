@@ -15,7 +15,13 @@
  */
 
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/ion.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 #include "ion_priv.h"
 
 struct ion_heap *ion_heap_create(struct ion_platform_heap *heap_data)
@@ -55,6 +61,9 @@ void ion_heap_destroy(struct ion_heap *heap)
 	if (!heap)
 		return;
 
+	if (heap->flags & ION_HEAP_FLAG_DEFER_FREE)
+		ion_heap_exit_deferred_free(heap);
+
 	switch (heap->type) {
 	case ION_HEAP_TYPE_SYSTEM_CONTIG:
 		ion_system_contig_heap_destroy(heap);
@@ -70,3 +79,216 @@ void ion_heap_destroy(struct ion_heap *heap)
 		       heap->type);
 	}
 }
+
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer)
+{
+	struct ion_heap_free_stats *stats = &heap->free_stats;
+
+	spin_lock(&heap->free_lock);
+	if (list_empty(&heap->free_list))
+		stats->oldest = ktime_get();
+	list_add_tail(&buffer->list, &heap->free_list);
+	heap->free_list_size += buffer->size;
+	stats->queued++;
+	stats->max_queued = max(stats->max_queued, stats->queued);
+	stats->max_size = max(stats->max_size, heap->free_list_size);
+	spin_unlock(&heap->free_lock);
+	wake_up(&heap->waitqueue);
+}
+
+size_t ion_heap_freelist_size(struct ion_heap *heap)
+{
+	size_t size;
+
+	spin_lock(&heap->free_lock);
+	size = heap->free_list_size;
+	spin_unlock(&heap->free_lock);
+
+	return size;
+}
+
+/*
+ * Takes everything queued so far off the free list and frees it as one
+ * batch. Returns the size of the buffers freed.
+ */
+static size_t ion_heap_freelist_drain_batch(struct ion_heap *heap)
+{
+	struct ion_heap_free_stats *stats = &heap->free_stats;
+	struct ion_buffer *buffer, *tmp;
+	LIST_HEAD(batch);
+	unsigned int count;
+	ktime_t oldest;
+	size_t size;
+	s64 latency;
+
+	spin_lock(&heap->free_lock);
+	list_splice_init(&heap->free_list, &batch);
+	size = heap->free_list_size;
+	count = stats->queued;
+	oldest = stats->oldest;
+	heap->free_list_size = 0;
+	stats->queued = 0;
+	spin_unlock(&heap->free_lock);
+
+	if (!count)
+		return 0;
+
+	list_for_each_entry_safe(buffer, tmp, &batch, list) {
+		list_del(&buffer->list);
+		ion_buffer_destroy(buffer);
+	}
+
+	latency = ktime_us_delta(ktime_get(), oldest);
+
+	spin_lock(&heap->free_lock);
+	stats->drained += count;
+	stats->batches++;
+	stats->max_latency_us = max_t(unsigned long, stats->max_latency_us,
+				      latency);
+	stats->total_latency_us += latency;
+	spin_unlock(&heap->free_lock);
+
+	return size;
+}
+
+/**
+ * ion_heap_freelist_drain - frees the buffers on the heap's free list now
+ * @heap:		the heap
+ *
+ * returns the size of the buffers freed, which does not include buffers
+ * the deferred free thread is freeing at the same time
+ */
+size_t ion_heap_freelist_drain(struct ion_heap *heap)
+{
+	size_t total = 0;
+	size_t size;
+
+	while ((size = ion_heap_freelist_drain_batch(heap)))
+		total += size;
+
+	return total;
+}
+
+void ion_heap_freelist_debug_show(struct ion_heap *heap, struct seq_file *s)
+{
+	struct ion_heap_free_stats stats;
+	size_t size;
+
+	spin_lock(&heap->free_lock);
+	stats = heap->free_stats;
+	size = heap->free_list_size;
+	spin_unlock(&heap->free_lock);
+
+	seq_printf(s, "deferred free:\n");
+	seq_printf(s, "%16s %16u %16zu\n", "queued", stats.queued, size);
+	seq_printf(s, "%16s %16u %16zu\n", "max queued", stats.max_queued,
+		   stats.max_size);
+	seq_printf(s, "%16s %16lu %16lu\n", "drained", stats.drained,
+		   stats.batches);
+	seq_printf(s, "%16s %16lu %16llu\n", "latency us",
+		   stats.max_latency_us, stats.batches ?
+		   div_u64(stats.total_latency_us, stats.batches) : 0);
+	seq_printf(s, "----------------------------------------------------\n");
+}
+
+void ion_heap_alloc_stats_add(struct ion_heap *heap, unsigned long len,
+			      s64 us, int ret)
+{
+	struct ion_heap_alloc_stats *stats = &heap->alloc_stats;
+	int order = min_t(int, get_order(len), ION_HEAP_SIZE_CLASSES - 1);
+	int i = 0;
+
+	if (ret) {
+		atomic_inc(&stats->failed);
+		return;
+	}
+
+	if (us > 0)
+		i = min(fls64(us), ION_HEAP_LATENCY_BUCKETS - 1);
+	else
+		us = 0;
+	atomic_inc(&stats->latency[order][i]);
+	atomic64_add(us, &stats->total_us[order]);
+}
+
+void ion_heap_alloc_stats_debug_show(struct ion_heap *heap,
+				     struct seq_file *s)
+{
+	struct ion_heap_alloc_stats *stats = &heap->alloc_stats;
+	int counts[ION_HEAP_LATENCY_BUCKETS];
+	unsigned long count;
+	int order, i;
+
+	seq_printf(s, "allocation latency: failed %d\n",
+		   atomic_read(&stats->failed));
+	for (order = 0; order < ION_HEAP_SIZE_CLASSES; order++) {
+		count = 0;
+		for (i = 0; i < ION_HEAP_LATENCY_BUCKETS; i++) {
+			counts[i] = atomic_read(&stats->latency[order][i]);
+			count += counts[i];
+		}
+		if (!count)
+			continue;
+
+		seq_printf(s, "order %s%d: count %lu avg %llu us:",
+			   order == ION_HEAP_SIZE_CLASSES - 1 ? ">=" : "",
+			   order, count,
+			   div64_u64(atomic64_read(&stats->total_us[order]),
+				     count));
+		for (i = 0; i < ION_HEAP_LATENCY_BUCKETS - 1; i++) {
+			if (counts[i])
+				seq_printf(s, " <%lu:%d", 1UL << i, counts[i]);
+		}
+		if (counts[i])
+			seq_printf(s, " >=%lu:%d", 1UL << (i - 1), counts[i]);
+		seq_printf(s, "\n");
+	}
+	seq_printf(s, "----------------------------------------------------\n");
+}
+
+static int ion_heap_deferred_free(void *data)
+{
+	struct ion_heap *heap = data;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(heap->waitqueue,
+				     ion_heap_freelist_size(heap) > 0 ||
+				     kthread_should_stop());
+		ion_heap_freelist_drain(heap);
+	}
+
+	return 0;
+}
+
+int ion_heap_init_deferred_free(struct ion_heap *heap)
+{
+	INIT_LIST_HEAD(&heap->free_list);
+	heap->free_list_size = 0;
+	spin_lock_init(&heap->free_lock);
+	init_waitqueue_head(&heap->waitqueue);
+	memset(&heap->free_stats, 0, sizeof(heap->free_stats));
+
+	heap->task = kthread_run(ion_heap_deferred_free, heap,
+				 "ion_%s", heap->name);
+	if (IS_ERR(heap->task)) {
+		pr_err("%s: creating thread for deferred free failed\n",
+		       __func__);
+		heap->task = NULL;
+		heap->flags &= ~ION_HEAP_FLAG_DEFER_FREE;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void ion_heap_exit_deferred_free(struct ion_heap *heap)
+{
+	if (!heap->task)
+		return;
+
+	kthread_stop(heap->task);
+	heap->task = NULL;
+	ion_heap_freelist_drain(heap);
+}
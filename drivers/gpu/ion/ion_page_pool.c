@@ -17,43 +17,123 @@
 #include <linux/debugfs.h>
 #include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/freezer.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/jiffies.h>
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/shrinker.h>
+#include <linux/wait.h>
+#include <asm/sizes.h>
+#ifdef CONFIG_ARM
+#include <asm/cacheflush.h>
+#include <asm/outercache.h>
+#endif
 #include "ion_priv.h"
 
+/*
+ * Freed pages are zeroed up to ION_PAGE_POOL_BATCH_SIZE at a time and only
+ * flushed for dma once the whole batch is zeroed. Past
+ * ION_PAGE_POOL_FLUSH_ALL_SIZE, flushing the whole of the caches once is
+ * cheaper than cleaning the batch page by page.
+ */
+#define ION_PAGE_POOL_BATCH_SIZE	SZ_4M
+#define ION_PAGE_POOL_FLUSH_ALL_SIZE	SZ_1M
+
 /* #define DEBUG_PAGE_POOL_SHRINKER */
 
 static struct plist_head pools = PLIST_HEAD_INIT(pools);
 static struct shrinker shrinker;
 
+/*
+ * Each pool is refilled in the background once it holds less than
+ * low_mark_kb of zeroed pages, up to high_mark_kb. Refilling is held off
+ * for a second after the shrinker last took pages from the pools.
+ */
+static unsigned int low_mark_kb = 2048;
+module_param(low_mark_kb, uint, S_IRUGO | S_IWUSR);
+static unsigned int high_mark_kb = 8192;
+module_param(high_mark_kb, uint, S_IRUGO | S_IWUSR);
+
+static struct task_struct *ion_page_pool_task;
+static DECLARE_WAIT_QUEUE_HEAD(ion_page_pool_wait);
+static unsigned long ion_page_pool_shrunk;
+
 struct ion_page_pool_item {
 	struct page *page;
 	struct list_head list;
 };
 
-static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool)
+/* flush a zeroed page for dma */
+static void ion_page_pool_flush(struct ion_page_pool *pool, struct page *page)
 {
-	struct page *page = alloc_pages(pool->gfp_mask, pool->order);
-
-	if (!page)
-		return NULL;
 	/* this is only being used to flush the page for dma,
 	   this api is not really suitable for calling from a driver
 	   but no better way to flush a page for dma exist at this time */
 	__dma_page_cpu_to_dev(page, 0, PAGE_SIZE << pool->order,
 			      DMA_BIDIRECTIONAL);
+}
+
+static void *ion_page_pool_alloc_pages(struct ion_page_pool *pool,
+				       gfp_t gfp_mask)
+{
+	struct page *page = alloc_pages(gfp_mask, pool->order);
+
+	if (!page)
+		return NULL;
+	ion_page_pool_flush(pool, page);
 	return page;
 }
 
+static void ion_page_pool_clear(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(page + i);
+}
+
+/* zero a page freed to the pool and flush it for dma */
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	ion_page_pool_clear(pool, page);
+	ion_page_pool_flush(pool, page);
+}
+
 static void ion_page_pool_free_pages(struct ion_page_pool *pool,
 				     struct page *page)
 {
 	__free_pages(page, pool->order);
 }
 
+/* in pages of the pool's order */
+static int ion_page_pool_mark(struct ion_page_pool *pool, unsigned int kb)
+{
+	return kb >> (PAGE_SHIFT - 10 + pool->order);
+}
+
+static bool ion_page_pool_below_low_mark(struct ion_page_pool *pool)
+{
+	return pool->high_count + pool->low_count <
+		ion_page_pool_mark(pool, low_mark_kb);
+}
+
+/* caller must hold pool->mutex */
+static void ion_page_pool_add_item(struct ion_page_pool *pool,
+				   struct ion_page_pool_item *item)
+{
+	if (PageHighMem(item->page)) {
+		list_add_tail(&item->list, &pool->high_items);
+		pool->high_count++;
+	} else {
+		list_add_tail(&item->list, &pool->low_items);
+		pool->low_count++;
+	}
+}
+
 static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 {
 	struct ion_page_pool_item *item;
@@ -64,17 +144,42 @@ static int ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
 
 	mutex_lock(&pool->mutex);
 	item->page = page;
-	if (PageHighMem(page)) {
-		list_add_tail(&item->list, &pool->high_items);
-		pool->high_count++;
-	} else {
-		list_add_tail(&item->list, &pool->low_items);
-		pool->low_count++;
-	}
+	ion_page_pool_add_item(pool, item);
 	mutex_unlock(&pool->mutex);
 	return 0;
 }
 
+static int ion_page_pool_add_dirty(struct ion_page_pool *pool,
+				   struct page *page)
+{
+	struct ion_page_pool_item *item;
+
+	item = kmalloc(sizeof(struct ion_page_pool_item), GFP_KERNEL);
+	if (!item)
+		return -ENOMEM;
+
+	mutex_lock(&pool->mutex);
+	item->page = page;
+	list_add_tail(&item->list, &pool->dirty_items);
+	pool->dirty_count++;
+	mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+/* caller must hold pool->mutex */
+static struct ion_page_pool_item *
+ion_page_pool_remove_dirty(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_item *item;
+
+	BUG_ON(!pool->dirty_count);
+	item = list_first_entry(&pool->dirty_items, struct ion_page_pool_item,
+				list);
+	list_del(&item->list);
+	pool->dirty_count--;
+	return item;
+}
+
 static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 {
 	struct ion_page_pool_item *item;
@@ -98,9 +203,16 @@ static struct page *ion_page_pool_remove(struct ion_page_pool *pool, bool high)
 	return page;
 }
 
+/*
+ * ion_page_pool_alloc - returns a zeroed page ready for dma. Zeroed pages
+ * are taken from the pool; a freed page is only zeroed here if no zeroed
+ * one is left, and the allocator is only called if the pool is empty.
+ */
 void *ion_page_pool_alloc(struct ion_page_pool *pool)
 {
+	struct ion_page_pool_item *item = NULL;
 	struct page *page = NULL;
+	bool refill;
 
 	BUG_ON(!pool);
 
@@ -109,21 +221,219 @@ void *ion_page_pool_alloc(struct ion_page_pool *pool)
 		page = ion_page_pool_remove(pool, true);
 	else if (pool->low_count)
 		page = ion_page_pool_remove(pool, false);
+	else if (pool->dirty_count)
+		item = ion_page_pool_remove_dirty(pool);
+	if (page)
+		pool->hits++;
+	else if (item)
+		pool->dirty_hits++;
+	else
+		pool->misses++;
+	refill = ion_page_pool_below_low_mark(pool);
 	mutex_unlock(&pool->mutex);
 
+	if (refill)
+		wake_up(&ion_page_pool_wait);
+
+	if (item) {
+		page = item->page;
+		kfree(item);
+		ion_page_pool_zero(pool, page);
+	}
+
 	if (!page)
-		page = ion_page_pool_alloc_pages(pool);
+		page = ion_page_pool_alloc_pages(pool, pool->gfp_mask);
 
 	return page;
 }
 
+/*
+ * ion_page_pool_free - gives a page back to the pool. It is zeroed later,
+ * by the background thread or by the allocation that needs it.
+ */
 void ion_page_pool_free(struct ion_page_pool *pool, struct page* page)
 {
 	int ret;
 
-	ret = ion_page_pool_add(pool, page);
-	if (ret)
+	ret = ion_page_pool_add_dirty(pool, page);
+	if (ret) {
 		ion_page_pool_free_pages(pool, page);
+		return;
+	}
+
+	wake_up(&ion_page_pool_wait);
+}
+
+/*
+ * ion_page_pool_free_list - gives the pages on 'pages', linked through
+ * page->lru, back to the pool under a single lock and wakeup.
+ */
+void ion_page_pool_free_list(struct ion_page_pool *pool,
+			     struct list_head *pages)
+{
+	struct ion_page_pool_item *item;
+	struct page *page, *tmp;
+	LIST_HEAD(items);
+	int count = 0;
+
+	list_for_each_entry_safe(page, tmp, pages, lru) {
+		list_del(&page->lru);
+		item = kmalloc(sizeof(struct ion_page_pool_item), GFP_KERNEL);
+		if (!item) {
+			ion_page_pool_free_pages(pool, page);
+			continue;
+		}
+		item->page = page;
+		list_add_tail(&item->list, &items);
+		count++;
+	}
+
+	if (!count)
+		return;
+
+	mutex_lock(&pool->mutex);
+	list_splice_tail(&items, &pool->dirty_items);
+	pool->dirty_count += count;
+	mutex_unlock(&pool->mutex);
+
+	wake_up(&ion_page_pool_wait);
+}
+
+/* flush a batch of zeroed items for dma */
+static void ion_page_pool_flush_batch(struct ion_page_pool *pool,
+				      struct list_head *batch, size_t size)
+{
+	struct ion_page_pool_item *item;
+
+#ifdef CONFIG_ARM
+	if (size >= ION_PAGE_POOL_FLUSH_ALL_SIZE) {
+		flush_all_cpu_caches();
+		outer_flush_all();
+		return;
+	}
+#endif
+	list_for_each_entry(item, batch, list)
+		ion_page_pool_flush(pool, item->page);
+}
+
+/*
+ * ion_page_pool_zero_batch - zeroes a batch of the pages freed to 'pool'
+ * and moves them to the zeroed lists. Returns false if there were none.
+ */
+static bool ion_page_pool_zero_batch(struct ion_page_pool *pool)
+{
+	struct ion_page_pool_item *item, *tmp;
+	LIST_HEAD(batch);
+	size_t size = 0;
+
+	mutex_lock(&pool->mutex);
+	while (pool->dirty_count && size < ION_PAGE_POOL_BATCH_SIZE) {
+		item = ion_page_pool_remove_dirty(pool);
+		list_add_tail(&item->list, &batch);
+		size += PAGE_SIZE << pool->order;
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (!size)
+		return false;
+
+	list_for_each_entry(item, &batch, list) {
+		ion_page_pool_clear(pool, item->page);
+		cond_resched();
+	}
+	ion_page_pool_flush_batch(pool, &batch, size);
+
+	mutex_lock(&pool->mutex);
+	list_for_each_entry_safe(item, tmp, &batch, list) {
+		list_del(&item->list);
+		ion_page_pool_add_item(pool, item);
+	}
+	mutex_unlock(&pool->mutex);
+	return true;
+}
+
+/*
+ * ion_page_pool_refill - zeroes the pages freed to 'pool' and, unless the
+ * shrinker ran recently, refills it up to its high watermark. Returns
+ * false if 'pool' could not be refilled.
+ */
+static bool ion_page_pool_refill(struct ion_page_pool *pool)
+{
+	struct page *page;
+	int count;
+
+	while (ion_page_pool_zero_batch(pool))
+		cond_resched();
+
+	if (time_before(jiffies, ion_page_pool_shrunk + HZ))
+		return true;
+
+	for (;;) {
+		mutex_lock(&pool->mutex);
+		count = pool->high_count + pool->low_count;
+		mutex_unlock(&pool->mutex);
+		if (count >= ion_page_pool_mark(pool, max(high_mark_kb,
+							  low_mark_kb)))
+			break;
+
+		page = ion_page_pool_alloc_pages(pool, pool->gfp_mask |
+						 __GFP_NORETRY | __GFP_NOWARN);
+		if (!page)
+			return false;
+		if (ion_page_pool_add(pool, page)) {
+			ion_page_pool_free_pages(pool, page);
+			return false;
+		}
+		cond_resched();
+	}
+
+	return true;
+}
+
+/* is there anything for the background thread to do? */
+static bool ion_page_pool_needs_refill(void)
+{
+	struct ion_page_pool *pool;
+
+	plist_for_each_entry(pool, &pools, list) {
+		if (pool->dirty_count)
+			return true;
+		if (ion_page_pool_below_low_mark(pool) &&
+		    !time_before(jiffies, ion_page_pool_shrunk + HZ))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * ion_page_pool_thread - zeroes freed pages and keeps the pools filled, at
+ * the lowest priority, so that allocations only have to take pages off a
+ * list.
+ */
+static int ion_page_pool_thread(void *data)
+{
+	struct ion_page_pool *pool;
+	bool failed;
+
+	set_user_nice(current, 19);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(ion_page_pool_wait,
+				     ion_page_pool_needs_refill() ||
+				     kthread_should_stop());
+
+		failed = false;
+		plist_for_each_entry(pool, &pools, list)
+			if (!ion_page_pool_refill(pool))
+				failed = true;
+
+		/* out of memory: back off rather than spin on the allocator */
+		if (failed)
+			schedule_timeout_interruptible(HZ);
+	}
+
+	return 0;
 }
 
 #ifdef DEBUG_PAGE_POOL_SHRINKER
@@ -169,9 +479,9 @@ static int debug_grow_pools_set(void *data, u64 val)
 	plist_for_each_entry(pool, &pools, list) {
 		if (val != pool->list.prio)
 			continue;
-		page = ion_page_pool_alloc_pages(pool);
-		if (page)
-			ion_page_pool_add(pool, page);
+		page = ion_page_pool_alloc_pages(pool, pool->gfp_mask);
+		if (page && ion_page_pool_add(pool, page))
+			ion_page_pool_free_pages(pool, page);
 	}
 
 	return 0;
@@ -190,31 +500,40 @@ static int ion_page_pool_total(bool high)
 		total += high ? (pool->high_count + pool->low_count) *
 			(1 << pool->order) :
 			pool->low_count * (1 << pool->order);
+		total += pool->dirty_count * (1 << pool->order);
 	}
 	return total;
 }
 
+/*
+ * Pages waiting to be zeroed go first, then zeroed ones. The background
+ * thread is kept from refilling the pools for a while afterwards.
+ */
 static int ion_page_pool_shrink(struct shrinker *shrinker,
 				 struct shrink_control *sc)
 {
 	struct ion_page_pool *pool;
+	struct ion_page_pool_item *item;
 	int nr_freed = 0;
 	int i;
-	bool high;
+	bool high = !!(sc->gfp_mask & __GFP_HIGHMEM);
 	int nr_to_scan = sc->nr_to_scan;
 
-	if (sc->gfp_mask & __GFP_HIGHMEM)
-		high = true;
-
 	if (nr_to_scan == 0)
 		return ion_page_pool_total(high);
 
+	ion_page_pool_shrunk = jiffies;
+
 	plist_for_each_entry(pool, &pools, list) {
 		for (i = 0; i < nr_to_scan; i++) {
 			struct page *page;
 
 			mutex_lock(&pool->mutex);
-			if (high && pool->high_count) {
+			if (pool->dirty_count) {
+				item = ion_page_pool_remove_dirty(pool);
+				page = item->page;
+				kfree(item);
+			} else if (high && pool->high_count) {
 				page = ion_page_pool_remove(pool, true);
 			} else if (pool->low_count) {
 				page = ion_page_pool_remove(pool, false);
@@ -240,8 +559,13 @@ struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
 		return NULL;
 	pool->high_count = 0;
 	pool->low_count = 0;
+	pool->dirty_count = 0;
+	pool->hits = 0;
+	pool->dirty_hits = 0;
+	pool->misses = 0;
 	INIT_LIST_HEAD(&pool->low_items);
 	INIT_LIST_HEAD(&pool->high_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
 	pool->gfp_mask = gfp_mask;
 	pool->order = order;
 	mutex_init(&pool->mutex);
@@ -263,6 +587,12 @@ static int __init ion_page_pool_init(void)
 	shrinker.seeks = DEFAULT_SEEKS;
 	shrinker.batch = 0;
 	register_shrinker(&shrinker);
+	ion_page_pool_task = kthread_run(ion_page_pool_thread, NULL,
+					 "ion_page_pool");
+	if (IS_ERR(ion_page_pool_task)) {
+		pr_err("%s: failed to start the page pool thread\n", __func__);
+		ion_page_pool_task = NULL;
+	}
 #ifdef DEBUG_PAGE_POOL_SHRINKER
 	debugfs_create_file("ion_pools_shrink", 0644, NULL, NULL,
 			    &debug_drop_pools_fops);
@@ -274,6 +604,8 @@ static int __init ion_page_pool_init(void)
 
 static void __exit ion_page_pool_exit(void)
 {
+	if (ion_page_pool_task)
+		kthread_stop(ion_page_pool_task);
 	unregister_shrinker(&shrinker);
 }
 
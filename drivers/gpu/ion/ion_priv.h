@@ -17,14 +17,18 @@
 #ifndef _ION_PRIV_H
 #define _ION_PRIV_H
 
+#include <linux/atomic.h>
 #include <linux/ion.h>
 #include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
 #include <linux/shrinker.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/wait.h>
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
 
@@ -55,6 +59,8 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * @pid:		pid of last client to reference this buffer in a
  *			handle, used for debugging
  * @dma_address:	dma address of this buffer for ion_device.special_dev
+ * @list:		element in the heap's free list, once the buffer has
+ *			been released to a heap that frees in the background
 */
 struct ion_buffer {
 	struct kref ref;
@@ -79,6 +85,7 @@ struct ion_buffer {
 	char task_comm[TASK_COMM_LEN];
 	pid_t pid;
 	dma_addr_t dma_address;
+	struct list_head list;
 };
 
 /**
@@ -109,6 +116,48 @@ struct ion_heap_ops {
 			 struct vm_area_struct *vma);
 };
 
+/**
+ * struct ion_heap_free_stats - deferred free statistics of a heap
+ * @queued:		number of buffers on the free list
+ * @max_queued:		largest number of buffers seen on the free list
+ * @max_size:		largest size of the free list
+ * @oldest:		when the oldest buffer on the free list was queued
+ * @drained:		number of buffers freed by the deferred free thread
+ * @batches:		number of times the free list was drained
+ * @max_latency_us:	longest time from queueing a buffer to freeing it
+ * @total_latency_us:	sum, over the batches, of the time from queueing the
+ *			oldest buffer of the batch to freeing the batch
+ */
+struct ion_heap_free_stats {
+	unsigned int queued;
+	unsigned int max_queued;
+	size_t max_size;
+	ktime_t oldest;
+	unsigned long drained;
+	unsigned long batches;
+	unsigned long max_latency_us;
+	u64 total_latency_us;
+};
+
+#define ION_HEAP_SIZE_CLASSES		11
+#define ION_HEAP_LATENCY_BUCKETS	16
+
+/**
+ * struct ion_heap_alloc_stats - allocation latency of a heap
+ * @latency:		log2 histograms of microseconds spent in the heap's
+ *			allocate op, one per allocation order; bucket 0
+ *			counts allocations below 1us, bucket i those in
+ *			[2^(i-1), 2^i), the last one everything above. The
+ *			last order counts all larger allocations
+ * @total_us:		sum of the samples of each histogram
+ * @failed:		number of allocations the heap failed
+ */
+struct ion_heap_alloc_stats {
+	atomic_t latency[ION_HEAP_SIZE_CLASSES][ION_HEAP_LATENCY_BUCKETS];
+	atomic64_t total_us[ION_HEAP_SIZE_CLASSES];
+	atomic_t failed;
+};
+
 /**
  * struct ion_heap - represents a heap in the system
  * @node:		rb node to put the heap on the device's tree of heaps
@@ -121,6 +170,15 @@ struct ion_heap_ops {
  * @name:		used for debugging
  * @debug_show:		called when heap debug file is read to add any
  *			heap specific debug info to output
+ * @flags:		ION_HEAP_FLAG_* flags for this heap
+ * @free_list:		buffers released to the heap and waiting to be freed
+ *			by its deferred free thread
+ * @free_list_size:	size of the buffers on free_list
+ * @free_lock:		protects free_list, free_list_size and free_stats
+ * @waitqueue:		the deferred free thread waits here for buffers
+ * @task:		the deferred free thread
+ * @free_stats:		free list depth and drain latency, for debugfs
+ * @alloc_stats:	allocation latency, for debugfs
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -136,8 +194,23 @@ struct ion_heap {
 	const char *name;
 	int (*debug_show)(struct ion_heap *heap, struct seq_file *, void *);
 	void (*showmem)(struct ion_heap *heap);
+	unsigned long flags;
+	struct list_head free_list;
+	size_t free_list_size;
+	spinlock_t free_lock;
+	wait_queue_head_t waitqueue;
+	struct task_struct *task;
+	struct ion_heap_free_stats free_stats;
+	struct ion_heap_alloc_stats alloc_stats;
 };
 
+/*
+ * Buffers released to a heap with this flag are freed by a thread of the
+ * heap in batches, instead of in the ioctl or close that dropped the last
+ * reference to them.
+ */
+#define ION_HEAP_FLAG_DEFER_FREE	(1 << 0)
+
 /**
  * ion_buffer_cached - this ion buffer is cached
  * @buffer:		buffer
@@ -155,6 +228,15 @@ bool ion_buffer_cached(struct ion_buffer *buffer);
  */
 bool ion_buffer_fault_user_mappings(struct ion_buffer *buffer);
 
+/**
+ * ion_buffer_destroy - unmaps and frees a buffer nobody references anymore
+ * @buffer:		buffer
+ *
+ * called when the last reference is dropped, or from the heap's deferred
+ * free thread if the heap has ION_HEAP_FLAG_DEFER_FREE
+ */
+void ion_buffer_destroy(struct ion_buffer *buffer);
+
 /**
  * ion_device_create - allocates and returns an ion device
  * @custom_ioctl:	arch specific ioctl function if applicable
@@ -188,6 +270,31 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap);
 struct ion_heap *ion_heap_create(struct ion_platform_heap *);
 void ion_heap_destroy(struct ion_heap *);
 
+/**
+ * functions for heaps with ION_HEAP_FLAG_DEFER_FREE.  The deferred free
+ * thread is started when the heap is added to the device and must be
+ * stopped by the heap's destroy function.
+ */
+int ion_heap_init_deferred_free(struct ion_heap *heap);
+void ion_heap_exit_deferred_free(struct ion_heap *heap);
+void ion_heap_freelist_add(struct ion_heap *heap, struct ion_buffer *buffer);
+size_t ion_heap_freelist_drain(struct ion_heap *heap);
+size_t ion_heap_freelist_size(struct ion_heap *heap);
+void ion_heap_freelist_debug_show(struct ion_heap *heap, struct seq_file *s);
+
+/**
+ * ion_heap_alloc_stats_add - accounts an allocation to the heap's latency
+ * histograms
+ * @heap:		the heap
+ * @len:		size of the allocation
+ * @us:			time spent in the heap's allocate op
+ * @ret:		what the allocate op returned
+ */
+void ion_heap_alloc_stats_add(struct ion_heap *heap, unsigned long len,
+			      s64 us, int ret);
+void ion_heap_alloc_stats_debug_show(struct ion_heap *heap,
+				     struct seq_file *s);
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *);
 void ion_system_heap_destroy(struct ion_heap *);
 
@@ -221,8 +328,13 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * struct ion_page_pool - pagepool struct
  * @high_count:		number of highmem items in the pool
  * @low_count:		number of lowmem items in the pool
+ * @dirty_count:	number of items waiting to be zeroed
  * @high_items:		list of highmem items
  * @low_items:		list of lowmem items
+ * @dirty_items:	list of freed items, not zeroed yet
+ * @hits:		allocations served with a zeroed page from the pool
+ * @dirty_hits:		allocations that had to zero a freed page first
+ * @misses:		allocations that went to the page allocator
  * @shrinker:		a shrinker for the items
  * @mutex:		lock protecting this struct and especially the count
  *			item list
@@ -238,12 +350,21 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  * Keeping a pool of pages that is ready for dma, ie any cached mapping have
  * been invalidated from the cache, provides a significant peformance benefit
  * on many systems
+ *
+ * Pages in the high and low lists are zeroed and ready for dma. Pages freed
+ * to the pool go on the dirty list and are zeroed by a background thread,
+ * which also keeps each pool filled between its watermarks.
  */
 struct ion_page_pool {
 	int high_count;
 	int low_count;
+	int dirty_count;
 	struct list_head high_items;
 	struct list_head low_items;
+	struct list_head dirty_items;
+	unsigned long hits;
+	unsigned long dirty_hits;
+	unsigned long misses;
 	struct mutex mutex;
 	void *(*alloc)(struct ion_page_pool *pool);
 	void (*free)(struct ion_page_pool *pool, struct page *page);
@@ -256,5 +377,6 @@ struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
 void ion_page_pool_destroy(struct ion_page_pool *);
 void *ion_page_pool_alloc(struct ion_page_pool *);
 void ion_page_pool_free(struct ion_page_pool *, struct page *);
+void ion_page_pool_free_list(struct ion_page_pool *, struct list_head *);
 
 #endif /* _ION_PRIV_H */
@@ -51,6 +51,8 @@ static unsigned int order_to_size(int order)
 struct ion_system_heap {
 	struct ion_heap heap;
 	struct ion_page_pool **pools;
+	/* times an order could not be had and a smaller one was tried */
+	atomic_t fallbacks[ARRAY_SIZE(orders)];
 };
 
 struct page_info {
@@ -63,25 +65,15 @@ static struct page *alloc_buffer_page(struct ion_system_heap *heap,
 				      struct ion_buffer *buffer,
 				      unsigned long order)
 {
-	bool cached = ion_buffer_cached(buffer);
 	bool split_pages = ion_buffer_fault_user_mappings(buffer);
 	struct ion_page_pool *pool = heap->pools[order_to_index(order)];
 	struct page *page;
 
-	if (!cached) {
-		page = ion_page_pool_alloc(pool);
-	} else {
-		gfp_t gfp_flags = low_order_gfp_flags;
-
-		if (order > 1)
-			gfp_flags = high_order_gfp_flags;
-		page = alloc_pages(gfp_flags, order);
-		if (!page)
-			return 0;
-		if (split_pages)
-			__dma_page_cpu_to_dev(page, 0, PAGE_SIZE << order,
-					      DMA_BIDIRECTIONAL);
-	}
+	/*
+	 * Pool pages are zeroed and flushed for dma, so they do for cached
+	 * buffers as well as for uncached ones.
+	 */
+	page = ion_page_pool_alloc(pool);
 	if (!page)
 		return 0;
 
@@ -94,35 +86,20 @@ static void free_buffer_page(struct ion_system_heap *heap,
 			     struct ion_buffer *buffer, struct page *page,
 			     unsigned int order)
 {
-	bool cached = ion_buffer_cached(buffer);
 	bool split_pages = ion_buffer_fault_user_mappings(buffer);
 	int i;
 
-	if (!cached) {
-		struct ion_page_pool *pool = heap->pools[order_to_index(order)];
-		int num_pages = (1 << order);
-		/* zero the pages before returning them to the pool for
-		   security.  This uses vmap as we want to set the pgprot so
-		   the writes to occur to noncached mappings, as the pool's
-		   purpose is to keep the pages out of the cache */
-		if (!PageHighMem(page)) {
-			void *addr = page_address(page);
-			memset(addr, 0, PAGE_SIZE * num_pages);
-			__cpuc_flush_dcache_area(addr, PAGE_SIZE * num_pages);
-		} else  {
-			for (i = 0; i < num_pages; i++) {
-				void *addr = kmap_atomic(&page[i]);
-				clear_page(addr);
-				__cpuc_flush_dcache_area(addr, PAGE_SIZE);
-				kunmap_atomic(addr);
-			}
-		}
-		ion_page_pool_free(pool, page);
-	} else if (split_pages) {
+	/*
+	 * The pool zeroes the pages for security before handing them out
+	 * again, in its background thread rather than here.
+	 */
+	if (split_pages) {
 		for (i = 0; i < (1 << order); i++)
 			__free_page(page + i);
 	} else {
-		__free_pages(page, order);
+		struct ion_page_pool *pool = heap->pools[order_to_index(order)];
+
+		ion_page_pool_free(pool, page);
 	}
 }
 
@@ -143,8 +120,11 @@ static struct page_info *alloc_largest_available(struct ion_system_heap *heap,
 			continue;
 
 		page = alloc_buffer_page(heap, buffer, orders[i]);
-		if (!page)
+		if (!page) {
+			if (i < num_orders - 1)
+				atomic_inc(&heap->fallbacks[i]);
 			continue;
+		}
 
 		info = kmalloc(sizeof(struct page_info), GFP_KERNEL);
 		info->page = page;
@@ -233,11 +213,25 @@ void ion_system_heap_free(struct ion_buffer *buffer)
 							heap);
 	struct sg_table *table = buffer->priv_virt;
 	struct scatterlist *sg;
-	LIST_HEAD(pages);
+	bool split_pages = ion_buffer_fault_user_mappings(buffer);
+	struct list_head pages[ARRAY_SIZE(orders)];
 	int i;
 
-	for_each_sg(table->sgl, sg, table->nents, i)
-		free_buffer_page(sys_heap, buffer, sg_page(sg), get_order(sg_dma_len(sg)));
+	for (i = 0; i < num_orders; i++)
+		INIT_LIST_HEAD(&pages[i]);
+
+	/* pages go back to each pool as one list, rather than one by one */
+	for_each_sg(table->sgl, sg, table->nents, i) {
+		struct page *page = sg_page(sg);
+		unsigned int order = get_order(sg_dma_len(sg));
+
+		if (split_pages)
+			free_buffer_page(sys_heap, buffer, page, order);
+		else
+			list_add_tail(&page->lru, &pages[order_to_index(order)]);
+	}
+	for (i = 0; i < num_orders; i++)
+		ion_page_pool_free_list(sys_heap->pools[i], &pages[i]);
 	sg_free_table(table);
 	kfree(table);
 }
@@ -350,6 +344,9 @@ static void ion_system_heap_showmem(struct ion_heap *heap)
 		pr_info("%d order %u lowmem pages in pool = %lu total\n",
 			   pool->low_count, pool->order,
 			   (1 << pool->order) * PAGE_SIZE * pool->low_count);
+		pr_info("%d order %u pages to be zeroed in pool = %lu total\n",
+			   pool->dirty_count, pool->order,
+			   (1 << pool->order) * PAGE_SIZE * pool->dirty_count);
 	}
 }
 
@@ -369,6 +366,16 @@ static int ion_system_heap_debug_show(struct ion_heap *heap, struct seq_file *s,
 		seq_printf(s, "%d order %u lowmem pages in pool = %lu total\n",
 			   pool->low_count, pool->order,
 			   (1 << pool->order) * PAGE_SIZE * pool->low_count);
+		seq_printf(s, "%d order %u pages to be zeroed in pool = %lu total\n",
+			   pool->dirty_count, pool->order,
+			   (1 << pool->order) * PAGE_SIZE * pool->dirty_count);
+		seq_printf(s, "order %u pool hits %lu zeroed on alloc %lu "
+			   "misses %lu\n", pool->order, pool->hits,
+			   pool->dirty_hits, pool->misses);
+		if (i < num_orders - 1)
+			seq_printf(s, "order %u fell back to a smaller order "
+				   "%d times\n", orders[i],
+				   atomic_read(&sys_heap->fallbacks[i]));
 	}
 	return 0;
 }
@@ -400,6 +407,7 @@ struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 	}
 	heap->heap.debug_show = ion_system_heap_debug_show;
 	heap->heap.showmem = ion_system_heap_showmem;
+	heap->heap.flags = ION_HEAP_FLAG_DEFER_FREE;
 	return &heap->heap;
 err_create_pool:
 	for (i = 0; i < num_orders; i++)
@@ -20,11 +20,16 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/lz4.h>
 #include <linux/miscdevice.h>
+#include <linux/pagemap.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
+#include <linux/workqueue.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,22 +38,66 @@
 static unsigned int enabled = 1;
 module_param(enabled, uint, S_IWUSR | S_IRUGO);
 
+#define LOGGER_ENTRY_MAX_LEN \
+	(sizeof(struct logger_entry) + LOGGER_ENTRY_MAX_PAYLOAD)
+
+/*
+ * Each log is split into up to one ring per cpu, none smaller than this.
+ * A ring has to hold several maximum-sized entries so that a single large
+ * write does not wipe out the whole history of its cpu.
+ */
+#define LOGGER_RING_MIN_SIZE	(16 * 1024)
+
+/*
+ * struct logger_ring - one writer's slice of a log
+ *
+ * Writers pick the ring of the cpu they run on and fill it with preemption
+ * disabled, so a ring normally has a single writer at a time and its lock is
+ * never contended. The lock only matters when there are more cpus than
+ * rings. Readers never take it: they copy an entry out and then check that
+ * 'head' has not moved past it, see logger_ring_copy().
+ *
+ * 'head' and 'w_off' are free-running positions; the byte offset in the
+ * ring is the position modulo the ring size. Writers advance 'head' before
+ * they overwrite anything and publish 'w_off' only once an entry is
+ * complete.
+ */
+struct logger_ring {
+	spinlock_t		lock;	/* serializes writers of this ring */
+	unsigned char		*buffer;/* this ring's part of log->buffer */
+	unsigned long		head;	/* oldest entry still in the ring */
+	unsigned long		w_off;	/* end of the newest complete entry */
+} ____cacheline_aligned_in_smp;
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. Writers only touch 'rings'; the
+ * mutex 'mutex' protects the list of readers and their state.
  */
 struct logger_log {
-	unsigned char		*buffer;/* the ring buffer itself */
+	unsigned char		*buffer;/* the ring buffers themselves */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
-	size_t			head;	/* new readers start here */
+	struct mutex		mutex;	/* mutex protecting readers */
+	struct logger_ring	*rings;	/* per-cpu rings */
+	unsigned int		nr_rings; /* number of rings */
+	size_t			ring_size; /* size of each ring */
 	size_t			size;	/* size of the log */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	struct mutex		archive_lock; /* protects the archive */
+	struct work_struct	archive_work; /* compresses old entries */
+	unsigned char		*archive; /* compressed chunks */
+	size_t			archive_size; /* size of the archive */
+	size_t			a_head;	/* offset of the oldest chunk */
+	size_t			a_tail;	/* offset after the newest chunk */
+	size_t			a_used;	/* bytes used in the archive */
+	unsigned long		a_first; /* number of the oldest chunk */
+	unsigned long		a_next;	/* number of the next chunk */
+	unsigned long		*a_end;	/* per-ring end of archived entries */
+#endif
 };
 
 /*
@@ -60,17 +109,31 @@ struct logger_log {
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	unsigned long		*r_off;	/* current read position per ring */
+	unsigned char		*entry;	/* entry being copied to the user */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+	bool			r_archive; /* reader is in the archive */
+	size_t			a_off;	/* offset of the current chunk */
+	unsigned long		a_seq;	/* number of the current chunk */
+	unsigned char		*chunk;	/* current chunk, decompressed */
+	size_t			chunk_len; /* length of 'chunk' */
+	size_t			chunk_off; /* read offset in 'chunk' */
+#endif
 };
 
-/* logger_offset - returns index 'n' into the log via (optimized) modulus */
-size_t logger_offset(struct logger_log *log, size_t n)
+/* logger_offset - returns index 'n' into a ring via (optimized) modulus */
+static inline size_t logger_offset(struct logger_log *log, unsigned long n)
 {
-	return n & (log->size-1);
+	return n & (log->ring_size - 1);
 }
 
+/* logger_before - is ring position 'a' older than position 'b'? */
+static inline bool logger_before(unsigned long a, unsigned long b)
+{
+	return (long)(a - b) < 0;
+}
 
 /*
  * file_get_log - Given a file structure, return the associated log
@@ -95,44 +158,645 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
+/*
+ * ring_read - copies 'len' bytes at position 'pos' of 'ring' into 'dst',
+ * wrapping around the end of the ring.
+ */
+static void ring_read(struct logger_log *log, struct logger_ring *ring,
+		      unsigned long pos, void *dst, size_t len)
+{
+	size_t off = logger_offset(log, pos);
+	size_t n = min(len, log->ring_size - off);
+
+	memcpy(dst, ring->buffer + off, n);
+	if (len != n)
+		memcpy(dst + n, ring->buffer, len - n);
+}
+
 /*
  * get_entry_header - returns a pointer to the logger_entry header within
- * 'log' starting at offset 'off'. A temporary logger_entry 'scratch' must
+ * 'ring' starting at position 'pos'. A temporary logger_entry 'scratch' must
  * be provided. Typically the return value will be a pointer within
- * 'logger->buf'.  However, a pointer to 'scratch' may be returned if
+ * 'ring->buffer'.  However, a pointer to 'scratch' may be returned if
  * the log entry spans the end and beginning of the circular buffer.
+ *
+ * Only the ring's writer may use the returned pointer directly; readers
+ * must go through logger_ring_copy().
  */
 static struct logger_entry *get_entry_header(struct logger_log *log,
-		size_t off, struct logger_entry *scratch)
+		struct logger_ring *ring, unsigned long pos,
+		struct logger_entry *scratch)
 {
-	size_t len = min(sizeof(struct logger_entry), log->size - off);
-	if (len != sizeof(struct logger_entry)) {
-		memcpy(((void *) scratch), log->buffer + off, len);
-		memcpy(((void *) scratch) + len, log->buffer,
-			sizeof(struct logger_entry) - len);
+	size_t off = logger_offset(log, pos);
+
+	if (log->ring_size - off < sizeof(struct logger_entry)) {
+		ring_read(log, ring, pos, scratch, sizeof(struct logger_entry));
 		return scratch;
 	}
 
-	return (struct logger_entry *) (log->buffer + off);
+	return (struct logger_entry *) (ring->buffer + off);
+}
+
+/*
+ * logger_ring_copy - copies 'len' bytes at the reader's position '*pos' of
+ * 'ring' into 'dst'. Returns false if the writer lapped the reader while
+ * we were copying, in which case '*pos' has been pulled forward to the
+ * oldest entry and the copy must be redone.
+ *
+ * Writers move ring->head past an entry before overwriting it, so seeing
+ * 'head' still at or before '*pos' after the copy means the copy is intact.
+ */
+static bool logger_ring_copy(struct logger_log *log, struct logger_ring *ring,
+			     unsigned long *pos, void *dst, size_t len)
+{
+	unsigned long head;
+
+	ring_read(log, ring, *pos, dst, len);
+	smp_rmb();
+	head = ACCESS_ONCE(ring->head);
+	if (logger_before(*pos, head)) {
+		*pos = head;
+		return false;
+	}
+
+	return true;
 }
 
 /*
- * get_entry_msg_len - Grabs the length of the message of the entry
- * starting from from 'off'.
+ * logger_ring_peek - copies the header of the next entry of ring 'i' at
+ * position '*pos' into 'entry', skipping over entries from other uids
+ * unless 'all' is set and pulling '*pos' forward if it was lapped.
+ * Returns false if everything in the ring has been consumed.
+ */
+static bool logger_ring_peek(struct logger_log *log, unsigned int i,
+			     unsigned long *pos, bool all,
+			     struct logger_entry *entry)
+{
+	struct logger_ring *ring = &log->rings[i];
+	unsigned long w_off, head;
+
+	for (;;) {
+		w_off = ACCESS_ONCE(ring->w_off);
+		smp_rmb();
+		head = ACCESS_ONCE(ring->head);
+		if (logger_before(*pos, head))
+			*pos = head;
+		if (*pos == w_off)
+			return false;
+
+		if (!logger_ring_copy(log, ring, pos, entry,
+				      sizeof(struct logger_entry)))
+			continue;
+
+		if (all || entry->euid == current_euid())
+			return true;
+
+		*pos += sizeof(struct logger_entry) + entry->len;
+	}
+}
+
+/*
+ * logger_merge - merges the rings of 'log' by timestamp, reading ring 'i'
+ * from position 'r_off[i]'. Returns the index of the ring holding the
+ * oldest entry and copies its header into 'entry', or returns -1 if there
+ * is nothing left.
+ */
+static int logger_merge(struct logger_log *log, unsigned long *r_off,
+			bool all, struct logger_entry *entry)
+{
+	struct logger_entry scratch;
+	unsigned int i;
+	int next = -1;
+
+	for (i = 0; i < log->nr_rings; i++) {
+		if (!logger_ring_peek(log, i, &r_off[i], all, &scratch))
+			continue;
+		if (next >= 0 && (scratch.sec > entry->sec ||
+		    (scratch.sec == entry->sec && scratch.nsec >= entry->nsec)))
+			continue;
+		*entry = scratch;
+		next = i;
+	}
+
+	return next;
+}
+
+#ifdef CONFIG_ANDROID_LOGGER_COMPRESS
+
+/*
+ * Compressed history
  *
- * An entry length is 2 bytes (16 bits) in host endian order.
- * In the log, the length does not include the size of the log entry structure.
- * This function returns the size including the log entry structure.
+ * Three quarters of each log's buffer hold an archive of lz4-compressed
+ * chunks of older entries; the rings get the rest. Writers never compress
+ * anything: once a ring is half full, they kick a work item that merges the
+ * oldest entries of all rings into chunks of up to LOGGER_CHUNK_SIZE bytes,
+ * compresses them and appends them to the archive, dropping its oldest
+ * chunks as needed. 'a_end' tracks how far each ring has been archived.
+ *
+ * New readers start at the oldest chunk. A reader in the archive
+ * decompresses one chunk at a time into its own buffer, and moves on to
+ * the rings at 'a_end' once it has read the newest chunk.
+ *
+ * Chunks never wrap around the end of the archive. If a chunk does not fit
+ * before the end, the space left is skipped, marked by a zero-length chunk
+ * if there is room for one.
+ */
+#define LOGGER_CHUNK_SIZE	(16 * 1024)
+
+struct logger_chunk {
+	__u32		len;		/* compressed length, 0 if skipped */
+	__u32		raw_len;	/* length of the entries */
+	unsigned char	data[0];	/* the entries, raw if len == raw_len */
+};
+
+/* scratch buffers for the archive work, protected by logger_lz4_mutex */
+static DEFINE_MUTEX(logger_lz4_mutex);
+static unsigned char *logger_lz4_raw;
+static unsigned char *logger_lz4_buf;
+static void *logger_lz4_wrkmem;
+
+static inline size_t logger_rings_size(struct logger_log *log)
+{
+	return log->size / 4;
+}
+
+static inline size_t logger_chunk_size(struct logger_chunk *chunk)
+{
+	return ALIGN(sizeof(struct logger_chunk) + chunk->len,
+		     sizeof(struct logger_chunk));
+}
+
+/*
+ * logger_chunk_at - returns the offset of the chunk at or after 'off',
+ * skipping the space left before the end of the archive.
+ *
+ * Caller needs to hold log->archive_lock.
+ */
+static size_t logger_chunk_at(struct logger_log *log, size_t off)
+{
+	struct logger_chunk *chunk;
+
+	if (log->archive_size - off < sizeof(struct logger_chunk))
+		return 0;
+	chunk = (struct logger_chunk *) (log->archive + off);
+	if (!chunk->len)
+		return 0;
+	return off;
+}
+
+/*
+ * logger_archive_evict - drops the oldest chunk of the archive, or the
+ * space skipped in front of it.
+ *
+ * Caller needs to hold log->archive_lock.
+ */
+static void logger_archive_evict(struct logger_log *log)
+{
+	size_t off = logger_chunk_at(log, log->a_head);
+	struct logger_chunk *chunk;
+
+	if (off != log->a_head) {
+		log->a_used -= log->archive_size - log->a_head;
+		log->a_head = 0;
+		return;
+	}
+
+	chunk = (struct logger_chunk *) (log->archive + off);
+	log->a_used -= logger_chunk_size(chunk);
+	log->a_head += logger_chunk_size(chunk);
+	log->a_first++;
+}
+
+/*
+ * logger_archive_store - appends the 'len' bytes of compressed entries at
+ * 'data', 'raw_len' bytes uncompressed, to the archive.
+ *
+ * Caller needs to hold log->archive_lock.
+ */
+static void logger_archive_store(struct logger_log *log, const void *data,
+				 size_t len, size_t raw_len)
+{
+	struct logger_chunk *chunk;
+	size_t size = ALIGN(sizeof(struct logger_chunk) + len,
+			    sizeof(struct logger_chunk));
+	size_t skip = 0;
+	bool wrap = log->archive_size - log->a_tail < size;
+
+	if (wrap)
+		skip = log->archive_size - log->a_tail;
+
+	while (log->a_used + skip + size > log->archive_size)
+		logger_archive_evict(log);
+
+	if (wrap) {
+		if (skip >= sizeof(struct logger_chunk)) {
+			chunk = (struct logger_chunk *)
+				(log->archive + log->a_tail);
+			chunk->len = 0;
+		}
+		log->a_used += skip;
+		log->a_tail = 0;
+	}
+
+	chunk = (struct logger_chunk *) (log->archive + log->a_tail);
+	chunk->len = len;
+	chunk->raw_len = raw_len;
+	memcpy(chunk->data, data, len);
+
+	log->a_used += size;
+	log->a_tail += size;
+	log->a_next++;
+}
+
+/*
+ * logger_archive_due - is any ring of 'log' more than half full of entries
+ * that have not been archived yet?
+ */
+static bool logger_archive_due(struct logger_log *log, unsigned int i)
+{
+	struct logger_ring *ring = &log->rings[i];
+
+	return ACCESS_ONCE(ring->w_off) - ACCESS_ONCE(log->a_end[i]) >
+		log->ring_size / 2;
+}
+
+/*
+ * logger_archive_chunk - compresses the oldest entries not archived yet
+ * into a new chunk. Returns false if there was nothing to archive.
+ *
+ * Caller needs to hold log->archive_lock and logger_lz4_mutex.
+ */
+static bool logger_archive_chunk(struct logger_log *log)
+{
+	struct logger_entry entry;
+	size_t raw_len = 0;
+	size_t len;
+	int i;
+
+	while ((i = logger_merge(log, log->a_end, true, &entry)) >= 0) {
+		len = sizeof(struct logger_entry) + entry.len;
+		if (raw_len + len > LOGGER_CHUNK_SIZE)
+			break;
+		if (!logger_ring_copy(log, &log->rings[i], &log->a_end[i],
+				      logger_lz4_raw + raw_len, len))
+			continue;
+		log->a_end[i] += len;
+		raw_len += len;
+	}
+
+	if (!raw_len)
+		return false;
+
+	/*
+	 * The entries are already past a_end: if they do not compress,
+	 * keep them as they are rather than lose them.
+	 */
+	if (lz4_compress(logger_lz4_raw, raw_len, logger_lz4_buf, &len,
+			 logger_lz4_wrkmem) < 0 || len >= raw_len) {
+		logger_archive_store(log, logger_lz4_raw, raw_len, raw_len);
+		return true;
+	}
+
+	logger_archive_store(log, logger_lz4_buf, len, raw_len);
+	return true;
+}
+
+static void logger_archive_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      archive_work);
+	unsigned int i;
+
+	mutex_lock(&log->archive_lock);
+	mutex_lock(&logger_lz4_mutex);
+	for (i = 0; i < log->nr_rings; i++) {
+		while (logger_archive_due(log, i))
+			if (!logger_archive_chunk(log))
+				break;
+	}
+	mutex_unlock(&logger_lz4_mutex);
+	mutex_unlock(&log->archive_lock);
+}
+
+/*
+ * logger_archive_kick - called by writers after adding to ring 'i'; queues
+ * the archive work once the ring is half full.
+ */
+static inline void logger_archive_kick(struct logger_log *log, unsigned int i)
+{
+	if (logger_archive_due(log, i) && !work_pending(&log->archive_work))
+		schedule_work(&log->archive_work);
+}
+
+/*
+ * logger_archive_peek - copies the header of the next archived entry
+ * readable by 'reader' into 'entry', decompressing the next chunk if
+ * needed. Returns false, and moves the reader on to the rings, once it
+ * has read the whole archive.
  *
  * Caller needs to hold log->mutex.
  */
-static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
+static bool logger_archive_peek(struct logger_reader *reader,
+				struct logger_entry *entry)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	struct logger_log *log = reader->log;
+	struct logger_chunk *chunk;
+	unsigned int i;
+	size_t len;
+	bool ret = false;
+
+	mutex_lock(&log->archive_lock);
+	while (reader->r_archive) {
+		if (reader->chunk_off < reader->chunk_len) {
+			memcpy(entry, reader->chunk + reader->chunk_off,
+			       sizeof(struct logger_entry));
+			if (reader->r_all || entry->euid == current_euid()) {
+				ret = true;
+				break;
+			}
+			reader->chunk_off += sizeof(struct logger_entry) +
+				entry->len;
+			continue;
+		}
+
+		/* done with the current chunk, if any; get the next one */
+		if (logger_before(reader->a_seq, log->a_first)) {
+			/* our chunk, or the one we were after, was dropped */
+			reader->a_off = log->a_head;
+			reader->a_seq = log->a_first;
+		} else if (reader->chunk_len) {
+			chunk = (struct logger_chunk *)
+				(log->archive + reader->a_off);
+			reader->a_off += logger_chunk_size(chunk);
+			reader->a_seq++;
+		}
+		reader->chunk_len = 0;
+		reader->chunk_off = 0;
+
+		if (reader->a_seq == log->a_next) {
+			for (i = 0; i < log->nr_rings; i++)
+				reader->r_off[i] = log->a_end[i];
+			reader->r_archive = false;
+			break;
+		}
+
+		reader->a_off = logger_chunk_at(log, reader->a_off);
+		chunk = (struct logger_chunk *) (log->archive + reader->a_off);
+		len = LOGGER_CHUNK_SIZE;
+		if (chunk->len == chunk->raw_len) {
+			len = chunk->raw_len;
+			memcpy(reader->chunk, chunk->data, len);
+		} else if (lz4_decompress((const char *) chunk->data,
+					  chunk->len, (char *) reader->chunk,
+					  &len) < 0 || len != chunk->raw_len) {
+			printk(KERN_ERR "logger: corrupt chunk in log '%s'\n",
+			       log->misc.name);
+			len = 0;
+		}
+		/* an empty chunk is skipped by the next iteration */
+		reader->chunk_len = len ? len : 1;
+		reader->chunk_off = len ? 0 : 1;
+	}
+	mutex_unlock(&log->archive_lock);
+
+	return ret;
+}
+
+/*
+ * logger_archive_entry - returns the archived entry that the last
+ * logger_archive_peek() found; logger_archive_consume() moves past it.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static struct logger_entry *logger_archive_entry(struct logger_reader *reader)
+{
+	return (struct logger_entry *) (reader->chunk + reader->chunk_off);
+}
+
+static void logger_archive_consume(struct logger_reader *reader, size_t len)
+{
+	reader->chunk_off += len;
+}
+
+/*
+ * logger_archive_len - bytes left to read in the archive for 'reader'. The
+ * reader's ring positions are pointed at 'a_end', so that the caller can
+ * add what is left in the rings.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static long logger_archive_len(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	struct logger_chunk *chunk;
+	unsigned long seq = reader->a_seq;
+	size_t off = reader->a_off;
+	unsigned int i;
+	long len = 0;
+
+	if (!reader->r_archive)
+		return 0;
+
+	mutex_lock(&log->archive_lock);
+	for (i = 0; i < log->nr_rings; i++)
+		reader->r_off[i] = log->a_end[i];
+
+	if (logger_before(seq, log->a_first)) {
+		seq = log->a_first;
+		off = log->a_head;
+	} else if (reader->chunk_len) {
+		len = reader->chunk_len - reader->chunk_off;
+		chunk = (struct logger_chunk *) (log->archive + off);
+		off += logger_chunk_size(chunk);
+		seq++;
+	}
 
-	entry = get_entry_header(log, off, &scratch);
-	return entry->len;
+	for (; seq != log->a_next; seq++) {
+		off = logger_chunk_at(log, off);
+		chunk = (struct logger_chunk *) (log->archive + off);
+		len += chunk->raw_len;
+		off += logger_chunk_size(chunk);
+	}
+	mutex_unlock(&log->archive_lock);
+
+	return len;
+}
+
+/*
+ * logger_archive_open - starts 'reader' at the oldest archived chunk, or
+ * at the oldest entries of the rings if nothing has been archived yet.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static int logger_archive_open(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	unsigned int i;
+
+	reader->chunk = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+	if (!reader->chunk)
+		return -ENOMEM;
+
+	mutex_lock(&log->archive_lock);
+	reader->a_off = log->a_head;
+	reader->a_seq = log->a_first;
+	reader->chunk_len = 0;
+	reader->chunk_off = 0;
+	reader->r_archive = log->a_first != log->a_next;
+	for (i = 0; i < log->nr_rings; i++)
+		reader->r_off[i] = ACCESS_ONCE(log->rings[i].head);
+	mutex_unlock(&log->archive_lock);
+
+	return 0;
+}
+
+static void logger_archive_release(struct logger_reader *reader)
+{
+	kfree(reader->chunk);
+}
+
+/*
+ * logger_archive_flush - drops the whole archive and takes every reader
+ * out of it.
+ *
+ * Caller needs to hold log->mutex, and must have emptied the rings.
+ */
+static void logger_archive_flush(struct logger_log *log)
+{
+	struct logger_reader *reader;
+	unsigned int i;
+
+	mutex_lock(&log->archive_lock);
+	log->a_head = 0;
+	log->a_tail = 0;
+	log->a_used = 0;
+	log->a_first = log->a_next;
+	for (i = 0; i < log->nr_rings; i++)
+		log->a_end[i] = ACCESS_ONCE(log->rings[i].head);
+	list_for_each_entry(reader, &log->readers, list)
+		reader->r_archive = false;
+	mutex_unlock(&log->archive_lock);
+}
+
+#define LOGGER_ARCHIVE_INITIALIZER(VAR) \
+	.archive_lock = __MUTEX_INITIALIZER(VAR .archive_lock), \
+	.archive_work = __WORK_INITIALIZER(VAR .archive_work, \
+					   logger_archive_work),
+
+static int __init logger_archive_init(struct logger_log *log)
+{
+	log->archive = log->buffer + logger_rings_size(log);
+	log->archive_size = log->size - logger_rings_size(log);
+	log->a_end = kcalloc(log->nr_rings, sizeof(unsigned long),
+			     GFP_KERNEL);
+	if (!log->a_end)
+		return -ENOMEM;
+
+	if (logger_lz4_wrkmem)
+		return 0;
+
+	logger_lz4_raw = kmalloc(LOGGER_CHUNK_SIZE, GFP_KERNEL);
+	logger_lz4_buf = kmalloc(LZ4_COMPRESSBOUND(LOGGER_CHUNK_SIZE),
+				 GFP_KERNEL);
+	logger_lz4_wrkmem = kmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+	if (!logger_lz4_raw || !logger_lz4_buf || !logger_lz4_wrkmem) {
+		kfree(logger_lz4_raw);
+		kfree(logger_lz4_buf);
+		kfree(logger_lz4_wrkmem);
+		logger_lz4_wrkmem = NULL;
+		kfree(log->a_end);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void __init logger_archive_exit(struct logger_log *log)
+{
+	kfree(log->a_end);
+}
+
+#else
+
+static inline size_t logger_rings_size(struct logger_log *log)
+{
+	return log->size;
+}
+
+static inline void logger_archive_kick(struct logger_log *log, unsigned int i)
+{
+}
+
+static inline bool logger_archive_peek(struct logger_reader *reader,
+				       struct logger_entry *entry)
+{
+	return false;
+}
+
+static inline struct logger_entry *
+logger_archive_entry(struct logger_reader *reader)
+{
+	return NULL;
+}
+
+static inline void logger_archive_consume(struct logger_reader *reader,
+					  size_t len)
+{
+}
+
+static inline long logger_archive_len(struct logger_reader *reader)
+{
+	return 0;
+}
+
+static inline int logger_archive_open(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	unsigned int i;
+
+	for (i = 0; i < log->nr_rings; i++)
+		reader->r_off[i] = ACCESS_ONCE(log->rings[i].head);
+
+	return 0;
+}
+
+static inline void logger_archive_release(struct logger_reader *reader)
+{
+}
+
+static inline void logger_archive_flush(struct logger_log *log)
+{
+}
+
+#define LOGGER_ARCHIVE_INITIALIZER(VAR)
+
+static inline int logger_archive_init(struct logger_log *log)
+{
+	return 0;
+}
+
+static inline void logger_archive_exit(struct logger_log *log)
+{
+}
+
+#endif /* CONFIG_ANDROID_LOGGER_COMPRESS */
+
+/*
+ * logger_next_entry - returns where the next entry readable by 'reader'
+ * is and copies its header into 'entry': the index of its ring,
+ * log->nr_rings if it is in the archive, or -1 if there is nothing to read.
+ *
+ * Caller needs to hold log->mutex.
+ */
+static int logger_next_entry(struct logger_reader *reader,
+			     struct logger_entry *entry)
+{
+	struct logger_log *log = reader->log;
+
+	if (logger_archive_peek(reader, entry))
+		return log->nr_rings;
+
+	return logger_merge(log, reader->r_off, reader->r_all, entry);
 }
 
 static size_t get_user_hdr_len(int ver)
@@ -168,79 +832,71 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads the next entry of 'reader' into the
+ * user-space buffer 'buf' of 'count' bytes. Returns the number of bytes
+ * read, 0 if there was nothing to read or -EINVAL if 'buf' is too small.
+ *
+ * The entry is first copied out of its ring into reader->entry, so that
+ * writers can carry on while we copy to userspace.
  *
  * Caller must hold log->mutex.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
+static ssize_t do_read_log_to_user(struct logger_reader *reader,
 				   char __user *buf,
 				   size_t count)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	struct logger_log *log = reader->log;
+	struct logger_entry *entry = (struct logger_entry *) reader->entry;
+	struct logger_entry hdr;
 	size_t len;
-	size_t msg_start;
+	int i;
+
+	do {
+		i = logger_next_entry(reader, &hdr);
+		if (i < 0)
+			return 0;
+
+		len = sizeof(struct logger_entry) + hdr.len;
+		if (count < get_user_hdr_len(reader->r_ver) + hdr.len)
+			return -EINVAL;
+
+		/* archived entries are already in the reader's own buffer */
+		if (i == log->nr_rings) {
+			entry = logger_archive_entry(reader);
+			break;
+		}
+	} while (!logger_ring_copy(log, &log->rings[i], &reader->r_off[i],
+				   entry, len));
 
 	/*
-	 * First, copy the header to userspace, using the version of
-	 * the header requested
+	 * Copy the header to userspace, using the version of the header
+	 * requested, followed by the payload.
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
-	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(log,
-		reader->r_off + sizeof(struct logger_entry));
-
-	/*
-	 * We read from the msg in two disjoint operations. First, we read from
-	 * the current msg head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
+	if (copy_to_user(buf, entry->msg, entry->len))
 		return -EFAULT;
 
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
-
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
+	if (i == log->nr_rings)
+		logger_archive_consume(reader, len);
+	else
+		reader->r_off[i] += len;
 
-	return count + get_user_hdr_len(reader->r_ver);
+	return get_user_hdr_len(reader->r_ver) + entry->len;
 }
 
 /*
- * get_next_entry_by_uid - Starting at 'off', returns an offset into
- * 'log->buffer' which contains the first entry readable by 'euid'
+ * logger_readable - is there anything in the log for 'reader'?
+ *
+ * Caller needs to hold log->mutex.
  */
-static size_t get_next_entry_by_uid(struct logger_log *log,
-		size_t off, uid_t euid)
+static bool logger_readable(struct logger_reader *reader)
 {
-	while (off != log->w_off) {
-		struct logger_entry *entry;
-		struct logger_entry scratch;
-		size_t next_len;
-
-		entry = get_entry_header(log, off, &scratch);
+	struct logger_entry entry;
 
-		if (entry->euid == euid)
-			return off;
-
-		next_len = sizeof(struct logger_entry) + entry->len;
-		off = logger_offset(log, off + next_len);
-	}
-
-	return off;
+	return logger_next_entry(reader, &entry) >= 0;
 }
 
 /*
@@ -269,7 +925,7 @@ start:
 
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		ret = (log->w_off == reader->r_off);
+		ret = !logger_readable(reader);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -293,192 +949,211 @@ start:
 
 	mutex_lock(&log->mutex);
 
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
-
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
-
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(reader, buf, count);
 
-out:
 	mutex_unlock(&log->mutex);
 
+	/* did the entry we saw get overwritten or flushed before we got it? */
+	if (unlikely(!ret))
+		goto start;
+
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_make_room - moves the head of 'ring' forward until there is room
+ * for 'len' more bytes, dropping the oldest entries. Readers that were
+ * still looking at those entries notice it when they next check 'head'.
  *
- * Caller must hold log->mutex.
+ * The caller needs to hold ring->lock.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static void logger_make_room(struct logger_log *log, struct logger_ring *ring,
+			     size_t len)
 {
-	size_t count = 0;
+	struct logger_entry scratch;
+	struct logger_entry *entry;
+	unsigned long head = ring->head;
 
-	do {
-		size_t nr = sizeof(struct logger_entry) +
-			get_entry_msg_len(log, off);
-		off = logger_offset(log, off + nr);
-		count += nr;
-	} while (count < len);
+	while (ring->w_off + len - head > log->ring_size) {
+		entry = get_entry_header(log, ring, head, &scratch);
+		head += sizeof(struct logger_entry) + entry->len;
+	}
 
-	return off;
+	if (head != ring->head) {
+		ring->head = head;
+		/* order the new head before the data that overwrites */
+		smp_wmb();
+	}
 }
 
 /*
- * is_between - is a < c < b, accounting for wrapping of a, b, and c
- *    positions in the buffer
- *
- * That is, if a<b, check for c between a and b
- * and if a>b, check for c outside (not between) a and b
- *
- * |------- a xxxxxxxx b --------|
- *               c^
+ * do_write_log - writes 'count' bytes from 'buf' to 'ring' at 'pos'
  *
- * |xxxxx b --------- a xxxxxxxxx|
- *    c^
- *  or                    c^
+ * The caller needs to hold ring->lock.
  */
-static inline int is_between(size_t a, size_t b, size_t c)
+static void do_write_log(struct logger_log *log, struct logger_ring *ring,
+			 unsigned long pos, const void *buf, size_t count)
 {
-	if (a < b) {
-		/* is c between a and b? */
-		if (a < c && c <= b)
-			return 1;
-	} else {
-		/* is c outside of b through a? */
-		if (c <= b || a < c)
-			return 1;
-	}
+	size_t off = logger_offset(log, pos);
+	size_t len;
 
-	return 0;
+	len = min(count, log->ring_size - off);
+	memcpy(ring->buffer + off, buf, len);
+
+	if (count != len)
+		memcpy(ring->buffer, buf + len, count - len);
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * do_write_log_from_user - writes 'count' bytes from the user-space buffer
+ * 'buf' to 'ring' at 'pos'
  *
- * The caller needs to hold log->mutex.
+ * This runs under ring->lock and must not sleep, so user pages are not
+ * faulted in here; the caller faults them in and retries instead.
+ *
+ * The caller needs to hold ring->lock.
+ *
+ * Returns 0 on success, non-zero if a page was not present.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static int do_write_log_from_user(struct logger_log *log,
+				  struct logger_ring *ring, unsigned long pos,
+				  const void __user *buf, size_t count)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(log, old + len);
-	struct logger_reader *reader;
+	size_t off = logger_offset(log, pos);
+	size_t len;
+	int ret;
 
-	if (is_between(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	pagefault_disable();
+	len = min(count, log->ring_size - off);
+	ret = __copy_from_user_inatomic(ring->buffer + off, buf, len);
+	if (!ret && count != len)
+		ret = __copy_from_user_inatomic(ring->buffer, buf + len,
+						count - len);
+	pagefault_enable();
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	return ret;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * logger_commit - writes one entry with header 'header' and the first
+ * header->len bytes of 'iov' to the ring of the current cpu.
  *
- * The caller needs to hold log->mutex.
+ * The entry is only published by moving ring->w_off once all of it is in
+ * place; on failure it is simply abandoned. The room made for it stays
+ * made, so a retry does not drop any more entries. Copies the start of
+ * the payload into 'tmp' when it has to be echoed to the kernel log.
+ *
+ * Returns 0 on success or -EFAULT if a user page was not present.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static int logger_commit(struct logger_log *log, struct logger_entry *header,
+			 const struct iovec *iov, unsigned long nr_segs,
+			 char *tmp, size_t tmp_len)
 {
-	size_t len;
+	struct logger_ring *ring;
+	struct timespec now;
+	unsigned long pos;
+	unsigned int i;
+	size_t len = sizeof(struct logger_entry) + header->len;
+	size_t done = 0;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	i = get_cpu() % log->nr_rings;
+	ring = &log->rings[i];
+	spin_lock(&ring->lock);
 
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+	/* stamp under the lock so that each ring stays in time order */
+	getnstimeofday(&now);
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
+
+	logger_make_room(log, ring, len);
+
+	pos = ring->w_off;
+	do_write_log(log, ring, pos, header, sizeof(struct logger_entry));
+	pos += sizeof(struct logger_entry);
+
+	while (nr_segs-- > 0 && done < header->len) {
+		/* figure out how much of this vector we can keep */
+		size_t nr = min_t(size_t, iov->iov_len, header->len - done);
+
+		/* write out this segment's payload */
+		if (unlikely(do_write_log_from_user(log, ring, pos + done,
+						    iov->iov_base, nr))) {
+			spin_unlock(&ring->lock);
+			put_cpu();
+			return -EFAULT;
+		}
+
+		iov++;
+		done += nr;
+	}
+
+	/* print as kernel log if the log string starts with "!@" */
+	tmp[0] = '\0';
+	if (header->len >= 2) {
+		ring_read(log, ring, pos, tmp, 2);
+		if (tmp[0] == '!' && tmp[1] == '@') {
+			size_t n = min_t(size_t, header->len, tmp_len - 1);
+			ring_read(log, ring, pos, tmp, n);
+			tmp[n] = '\0';
+		} else
+			tmp[0] = '\0';
+	}
 
-	log->w_off = logger_offset(log, log->w_off + count);
+	/* publish the entry only once it is complete */
+	smp_wmb();
+	ring->w_off = pos + header->len;
 
+	spin_unlock(&ring->lock);
+	put_cpu();
+
+	logger_archive_kick(log, i);
+
+	return 0;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * logger_fault_in - faults in the user pages backing the first 'len' bytes
+ * of 'iov'. No segment we copy is larger than a page, so touching its
+ * first and last byte is enough.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int logger_fault_in(const struct iovec *iov, unsigned long nr_segs,
+			   size_t len)
 {
-	size_t len;
+	while (nr_segs-- > 0 && len) {
+		size_t nr = min_t(size_t, iov->iov_len, len);
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
-
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
+		if (nr && fault_in_pages_readable(iov->iov_base, nr))
 			return -EFAULT;
 
-	/* print as kernel log if the log string starts with "!@" */
-	if (count >= 2) {
-		if (log->buffer[log->w_off] == '!'
-		    && log->buffer[logger_offset(log, log->w_off + 1)] == '@') {
-			char tmp[256];
-			int i;
-			for (i = 0; i < min(count, sizeof(tmp) - 1); i++)
-				tmp[i] =
-				    log->buffer[logger_offset \
-						(log, log->w_off + i)];
-			tmp[i] = '\0';
-			printk(KERN_INFO"%s\n", tmp);
-		}
+		iov++;
+		len -= nr;
 	}
-	log->w_off = logger_offset(log, log->w_off + count);
 
-	return count;
+	return 0;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * Writers never sleep on the log: each one appends to the ring of its cpu,
+ * faulting in its user pages beforehand, outside of any lock.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
-	struct timespec now;
-	ssize_t ret = 0;
+	char tmp[256];
+	int ret;
 
 	if (!enabled)
 		return 0;
 
-	now = current_kernel_time();
-
 	header.pid = current->tgid;
 	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
 	header.euid = current_euid();
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 	header.hdr_size = sizeof(struct logger_entry);
@@ -487,43 +1162,32 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * logger_commit() drops the oldest entries to make room before it
+	 * copies the payload, so make sure the copy will not fault first:
+	 * a bad buffer must not cost entries that are already in the log.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+	ret = logger_fault_in(iov, nr_segs, header.len);
+	if (ret)
+		return ret;
 
-		iov++;
-		ret += nr;
+	/* the pages were reclaimed again in between, rare */
+	while ((ret = logger_commit(log, &header, iov, nr_segs,
+				    tmp, sizeof(tmp)))) {
+		ret = logger_fault_in(iov, nr_segs, header.len);
+		if (ret)
+			return ret;
 	}
 
-	mutex_unlock(&log->mutex);
+	if (unlikely(tmp[0]))
+		printk(KERN_INFO"%s\n", tmp);
 
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
-	return ret;
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -553,6 +1217,16 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->r_off = kcalloc(log->nr_rings, sizeof(unsigned long),
+					GFP_KERNEL);
+		reader->entry = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->r_off || !reader->entry) {
+			kfree(reader->entry);
+			kfree(reader->r_off);
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
 		reader->r_ver = 1;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
@@ -561,7 +1235,14 @@ static int logger_open(struct inode *inode, struct file *file)
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		ret = logger_archive_open(reader);
+		if (ret) {
+			mutex_unlock(&log->mutex);
+			kfree(reader->entry);
+			kfree(reader->r_off);
+			kfree(reader);
+			return ret;
+		}
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -587,6 +1268,9 @@ static int logger_release(struct inode *ignored, struct file *file)
 		list_del(&reader->list);
 		mutex_unlock(&log->mutex);
 
+		logger_archive_release(reader);
+		kfree(reader->entry);
+		kfree(reader->r_off);
 		kfree(reader);
 	}
 
@@ -617,11 +1301,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
-
-	if (log->w_off != reader->r_off)
+	if (logger_readable(reader))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -641,10 +1321,60 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+/*
+ * logger_log_len - bytes left to read in all rings for 'reader'
+ *
+ * Caller needs to hold log->mutex.
+ */
+static long logger_log_len(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	unsigned long w_off, head;
+	unsigned int i;
+	long len = 0;
+
+	for (i = 0; i < log->nr_rings; i++) {
+		w_off = ACCESS_ONCE(log->rings[i].w_off);
+		smp_rmb();
+		head = ACCESS_ONCE(log->rings[i].head);
+		if (logger_before(reader->r_off[i], head))
+			reader->r_off[i] = head;
+		len += w_off - reader->r_off[i];
+	}
+
+	return len;
+}
+
+/*
+ * logger_flush - drops everything in the log, for readers and writers alike
+ *
+ * Caller needs to hold log->mutex.
+ */
+static void logger_flush(struct logger_log *log)
+{
+	struct logger_reader *reader;
+	struct logger_ring *ring;
+	unsigned int i;
+
+	for (i = 0; i < log->nr_rings; i++) {
+		ring = &log->rings[i];
+
+		spin_lock(&ring->lock);
+		ring->head = ring->w_off;
+		spin_unlock(&ring->lock);
+
+		list_for_each_entry(reader, &log->readers, list)
+			reader->r_off[i] = ring->head;
+	}
+
+	logger_archive_flush(log);
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_entry entry;
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
@@ -660,10 +1390,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		ret = logger_archive_len(reader) + logger_log_len(reader);
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -672,13 +1399,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
-		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
-
-		if (log->w_off != reader->r_off)
-			ret = get_user_hdr_len(reader->r_ver) +
-				get_entry_msg_len(log, reader->r_off);
+		if (logger_next_entry(reader, &entry) >= 0)
+			ret = get_user_hdr_len(reader->r_ver) + entry.len;
 		else
 			ret = 0;
 		break;
@@ -687,9 +1409,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
-		log->head = log->w_off;
+		logger_flush(log);
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -728,8 +1448,8 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * must be a power of two, and at least LOGGER_RING_MIN_SIZE. The buffer is
+ * split into per-cpu rings by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
 static unsigned char _buf_ ## VAR[SIZE]; \
@@ -744,9 +1464,8 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
-	.w_off = 0, \
-	.head = 0, \
 	.size = SIZE, \
+	LOGGER_ARCHIVE_INITIALIZER(VAR) \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 2048*1024)
@@ -770,19 +1489,49 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+/*
+ * init_log - splits the log's buffer, or the part of it not used for the
+ * compressed archive, into one ring per possible cpu, fewer if that would
+ * make the rings smaller than LOGGER_RING_MIN_SIZE, and registers its
+ * device.
+ */
 static int __init init_log(struct logger_log *log)
 {
+	size_t size = logger_rings_size(log);
+	unsigned int i;
 	int ret;
 
+	log->nr_rings = clamp_t(unsigned int, nr_cpu_ids, 1,
+				size / LOGGER_RING_MIN_SIZE);
+	log->ring_size = rounddown_pow_of_two(size / log->nr_rings);
+	log->rings = kcalloc(log->nr_rings, sizeof(struct logger_ring),
+			     GFP_KERNEL);
+	if (!log->rings)
+		return -ENOMEM;
+
+	for (i = 0; i < log->nr_rings; i++) {
+		spin_lock_init(&log->rings[i].lock);
+		log->rings[i].buffer = log->buffer + i * log->ring_size;
+	}
+
+	ret = logger_archive_init(log);
+	if (unlikely(ret)) {
+		kfree(log->rings);
+		return ret;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		logger_archive_exit(log);
+		kfree(log->rings);
 		return ret;
 	}
 
-	printk(KERN_INFO "logger: created %luK log '%s'\n",
-	       (unsigned long) log->size >> 10, log->misc.name);
+	printk(KERN_INFO "logger: created %luK log '%s' (%u rings)\n",
+	       (unsigned long) log->size >> 10, log->misc.name,
+	       log->nr_rings);
 
 	return 0;
 }
@@ -40,6 +40,13 @@
 #include <linux/notifier.h>
 #include <linux/memory.h>
 #include <linux/memory_hotplug.h>
+#include <linux/vmpressure.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/wait.h>
+
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
 
 #ifdef CONFIG_INTERNAL_ISP_START_CAMERA
 #include <linux/uaccess.h>
@@ -192,6 +199,219 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+/*
+ * Index of processes by oom_score_adj, so that lowmem_shrink() only looks
+ * at processes it may kill, highest oom_score_adj first, instead of
+ * walking every task. Thread group leaders are added at fork, removed
+ * when they are unhashed and moved when their oom_score_adj changes.
+ * Nests inside tasklist_lock, task_lock() nests inside it. Outside the
+ * write side of tasklist_lock, which already disables interrupts, it is
+ * taken with interrupts off: tasklist_lock is read locked from interrupt
+ * context, and a writer may be spinning on us while holding it.
+ */
+#define LOWMEM_ADJ_BUCKETS	64
+
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+static struct list_head lowmem_adj_buckets[LOWMEM_ADJ_BUCKETS];
+
+static int lowmem_adj_bucket(int oom_score_adj)
+{
+	return (oom_score_adj - OOM_SCORE_ADJ_MIN) * (LOWMEM_ADJ_BUCKETS - 1) /
+		(OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN);
+}
+
+/* Called with tasklist_lock held for writing */
+void lowmem_adj_index_add(struct task_struct *p)
+{
+	int i;
+
+	spin_lock(&lowmem_adj_lock);
+	/* the first fork (init) comes long before any initcall */
+	if (unlikely(!lowmem_adj_buckets[0].next)) {
+		for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+			INIT_LIST_HEAD(&lowmem_adj_buckets[i]);
+	}
+	list_add_tail(&p->lmk_adj_node, &lowmem_adj_buckets[
+			lowmem_adj_bucket(p->signal->oom_score_adj)]);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/* Called with tasklist_lock held for writing */
+void lowmem_adj_index_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_adj_lock);
+	list_del_init(&p->lmk_adj_node);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/* A thread took over as group leader in exec, tasklist_lock is held */
+void lowmem_adj_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	spin_lock(&lowmem_adj_lock);
+	list_replace_init(&old->lmk_adj_node, &new->lmk_adj_node);
+	spin_unlock(&lowmem_adj_lock);
+}
+
+/*
+ * The oom_score_adj of p's thread group changed. Called without
+ * task_lock() or the siglock held.
+ */
+void lowmem_adj_index_update(struct task_struct *p)
+{
+	struct task_struct *leader;
+	unsigned long flags;
+
+	rcu_read_lock();
+	leader = ACCESS_ONCE(p->group_leader);
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	/* an exiting leader has already been taken off */
+	if (!list_empty(&leader->lmk_adj_node))
+		list_move_tail(&leader->lmk_adj_node, &lowmem_adj_buckets[
+				lowmem_adj_bucket(leader->signal->oom_score_adj)]);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+	rcu_read_unlock();
+}
+
+/*
+ * A killed process only gives its memory back once its exit path runs,
+ * which can take a long time if it is blocked or scheduled on a slow
+ * core, while lowmem_deathpending holds off further kills. The reaper
+ * thread unmaps the private anonymous memory of each victim right after
+ * the kill, which also frees its swap (zram) slots. Faults on the reaped
+ * areas fail afterwards, see MMF_UNSTABLE in handle_mm_fault().
+ */
+#define LOWMEM_REAP_QUEUE	8
+#define LOWMEM_REAP_RETRIES	10
+
+struct lowmem_reap_entry {
+	struct task_struct *task;
+	ktime_t killed;
+};
+
+static uint32_t lowmem_reap_enable = 1;
+static DEFINE_SPINLOCK(lowmem_reap_lock);
+static struct lowmem_reap_entry lowmem_reap_queue[LOWMEM_REAP_QUEUE];
+static unsigned int lowmem_reap_head, lowmem_reap_tail;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_reap_wait);
+static struct task_struct *lowmem_reaper;
+
+static void lowmem_queue_reap(struct task_struct *task)
+{
+	struct lowmem_reap_entry *e;
+
+	if (!lowmem_reap_enable || !lowmem_reaper)
+		return;
+
+	spin_lock(&lowmem_reap_lock);
+	if (lowmem_reap_head - lowmem_reap_tail < LOWMEM_REAP_QUEUE) {
+		e = &lowmem_reap_queue[lowmem_reap_head++ % LOWMEM_REAP_QUEUE];
+		get_task_struct(task);
+		e->task = task;
+		e->killed = ktime_get();
+	}
+	spin_unlock(&lowmem_reap_lock);
+	wake_up(&lowmem_reap_wait);
+}
+
+static int lowmem_reap_pop(struct lowmem_reap_entry *e)
+{
+	int ret = 0;
+
+	spin_lock(&lowmem_reap_lock);
+	if (lowmem_reap_tail != lowmem_reap_head) {
+		*e = lowmem_reap_queue[lowmem_reap_tail++ % LOWMEM_REAP_QUEUE];
+		ret = 1;
+	}
+	spin_unlock(&lowmem_reap_lock);
+	return ret;
+}
+
+static void lowmem_reap_task(struct task_struct *tsk, ktime_t killed)
+{
+	struct task_struct *p;
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	unsigned long before, after;
+	ktime_t start = ktime_get();
+	int retries = 0;
+	int i;
+
+	p = find_lock_task_mm(tsk);
+	if (!p)
+		return;		/* it has already exited */
+	mm = p->mm;
+	atomic_inc(&mm->mm_users);
+	task_unlock(p);
+
+	/*
+	 * Every thread holds a reference: anything beyond those and ours
+	 * may be a CLONE_VM process that keeps running, leave it alone.
+	 */
+	if (atomic_read(&mm->mm_users) > get_nr_threads(tsk) + 1 ||
+	    mm->core_state)
+		goto out;
+
+	while (!down_read_trylock(&mm->mmap_sem)) {
+		if (++retries > LOWMEM_REAP_RETRIES)
+			goto out;
+		schedule_timeout_interruptible(HZ / 10);
+	}
+
+	set_bit(MMF_UNSTABLE, &mm->flags);
+	before = get_mm_rss(mm) + get_mm_counter(mm, MM_SWAPENTS);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (!vma->anon_vma)
+			continue;
+		if (vma->vm_flags & (VM_SHARED | VM_LOCKED | VM_HUGETLB |
+				     VM_PFNMAP | VM_MIXEDMAP | VM_IO))
+			continue;
+		zap_page_range(vma, vma->vm_start, vma->vm_end - vma->vm_start,
+			       NULL);
+	}
+	after = get_mm_rss(mm) + get_mm_counter(mm, MM_SWAPENTS);
+	up_read(&mm->mmap_sem);
+
+	trace_lowmem_reap(tsk, before - after, ktime_us_delta(start, killed),
+			  ktime_us_delta(ktime_get(), start));
+	lowmem_print(2, "reaped %d (%s), %lu pages\n",
+		     tsk->pid, tsk->comm, before - after);
+
+	/* what is left is freed by the exit path, don't wait for it */
+#ifdef ENHANCED_LMK_ROUTINE
+	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
+		if (lowmem_deathpending[i] == tsk)
+			lowmem_deathpending[i] = NULL;
+	}
+#else
+	if (lowmem_deathpending == tsk)
+		lowmem_deathpending = NULL;
+#endif
+out:
+	mmput(mm);
+}
+
+static int lowmem_reap_thread(void *unused)
+{
+	struct lowmem_reap_entry e;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(lowmem_reap_wait,
+				lowmem_reap_tail != lowmem_reap_head ||
+				kthread_should_stop());
+
+		while (lowmem_reap_pop(&e)) {
+			lowmem_reap_task(e.task, e.killed);
+			put_task_struct(e.task);
+		}
+	}
+
+	/* the killers are unregistered by now, drop what they left queued */
+	while (lowmem_reap_pop(&e))
+		put_task_struct(e.task);
+
+	return 0;
+}
+
 #ifdef CONFIG_MEMORY_HOTPLUG
 static int lmk_hotplug_callback(struct notifier_block *self,
 				unsigned long cmd, void *data)
@@ -216,7 +436,48 @@ static int lmk_hotplug_callback(struct notifier_block *self,
 }
 #endif
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * If we already have a death outstanding, then
+ * bail out right away; indicating to vmscan
+ * that we have nothing further to offer on
+ * this pass.
+ *
+ * Note: Currently you need CONFIG_PROFILING
+ * for this to work correctly.
+ */
+static int lowmem_death_pending(void)
+{
+#ifdef ENHANCED_LMK_ROUTINE
+	int i;
+
+	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
+		if (lowmem_deathpending[i] &&
+			time_before_eq(jiffies, lowmem_deathpending_timeout))
+			return 1;
+	}
+	return 0;
+#else
+	return lowmem_deathpending &&
+		time_before_eq(jiffies, lowmem_deathpending_timeout);
+#endif
+}
+
+static int lowmem_array_size(void)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+/*
+ * Kill the process(es) with the highest oom_score_adj at or above
+ * min_score_adj, biggest first. Returns the number of pages they held.
+ */
+static int lowmem_select_and_kill(int min_score_adj)
 {
 	struct task_struct *tsk;
 #ifdef ENHANCED_LMK_ROUTINE
@@ -224,10 +485,10 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 #else
 	struct task_struct *selected = NULL;
 #endif
-	int rem = 0;
+	int freed = 0;
 	int tasksize;
 	int i;
-	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int bucket;
 #ifdef ENHANCED_LMK_ROUTINE
 	int selected_tasksize[LOWMEM_DEATHPENDING_DEPTH] = {0,};
 	int selected_oom_score_adj[LOWMEM_DEATHPENDING_DEPTH] = {OOM_ADJUST_MAX,};
@@ -237,73 +498,6 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	int selected_tasksize = 0;
 	int selected_oom_score_adj;
 #endif
-	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
-	struct zone *zone;
-
-#ifdef CONFIG_ZRAM_FOR_ANDROID
-	other_file -= total_swapcache_pages();
-#endif
-
-	if (offlining) {
-		/* Discount all free space in the section being offlined */
-		for_each_zone(zone) {
-			 if (zone_idx(zone) == ZONE_MOVABLE) {
-				other_free -= zone_page_state(zone,
-						NR_FREE_PAGES);
-				lowmem_print(4, "lowmem_shrink discounted "
-					"%lu pages in movable zone\n",
-					zone_page_state(zone, NR_FREE_PAGES));
-			}
-		}
-	}
-	/*
-	 * If we already have a death outstanding, then
-	 * bail out right away; indicating to vmscan
-	 * that we have nothing further to offer on
-	 * this pass.
-	 *
-	 * Note: Currently you need CONFIG_PROFILING
-	 * for this to work correctly.
-	 */
-#ifdef ENHANCED_LMK_ROUTINE
-	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-		if (lowmem_deathpending[i] &&
-			time_before_eq(jiffies, lowmem_deathpending_timeout))
-			return 0;
-	}
-#else
-	if (lowmem_deathpending &&
-		time_before_eq(jiffies, lowmem_deathpending_timeout))
-		return 0;
-#endif
-
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_score_adj = lowmem_adj[i];
-			break;
-		}
-	}
-	if (sc->nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
-				sc->nr_to_scan, sc->gfp_mask, other_free,
-				other_file, min_score_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
-		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
-			     sc->nr_to_scan, sc->gfp_mask, rem);
-		return rem;
-	}
 
 #ifdef ENHANCED_LMK_ROUTINE
 	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++)
@@ -316,82 +510,96 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	atomic_set(&s_reclaim.lmk_running, 1);
 #endif
 	read_lock(&tasklist_lock);
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
+	spin_lock_irq(&lowmem_adj_lock);
+	for (bucket = LOWMEM_ADJ_BUCKETS - 1;
+	     bucket >= lowmem_adj_bucket(min_score_adj); bucket--) {
+		/* lower buckets only hold lower oom_score_adj values */
 #ifdef ENHANCED_LMK_ROUTINE
-		int is_exist_oom_task = 0;
+		if (all_selected_oom == LOWMEM_DEATHPENDING_DEPTH)
+			break;
+#else
+		if (selected)
+			break;
+#endif
+		list_for_each_entry(tsk, &lowmem_adj_buckets[bucket],
+				    lmk_adj_node) {
+			struct task_struct *p;
+			int oom_score_adj;
+#ifdef ENHANCED_LMK_ROUTINE
+			int is_exist_oom_task = 0;
 #endif
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+			if (tsk->flags & PF_KTHREAD)
+				continue;
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+			p = find_lock_task_mm(tsk);
+			if (!p)
+				continue;
 
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
+			oom_score_adj = p->signal->oom_score_adj;
+			if (oom_score_adj < min_score_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(p->mm);
 			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
+			if (tasksize <= 0)
+				continue;
 
 #ifdef ENHANCED_LMK_ROUTINE
-		if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH) {
-			for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-				if (!selected[i]) {
-					is_exist_oom_task = 1;
-					max_selected_oom_idx = i;
-					break;
-				}
-			}
-		} else if (selected_oom_score_adj[max_selected_oom_idx] < oom_score_adj ||
-			(selected_oom_score_adj[max_selected_oom_idx] == oom_score_adj &&
-			selected_tasksize[max_selected_oom_idx] < tasksize)) {
-			is_exist_oom_task = 1;
-		}
-
-		if (is_exist_oom_task) {
-			selected[max_selected_oom_idx] = p;
-			selected_tasksize[max_selected_oom_idx] = tasksize;
-			selected_oom_score_adj[max_selected_oom_idx] = oom_score_adj;
-
-			if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH)
-				all_selected_oom++;
-
-			if (all_selected_oom == LOWMEM_DEATHPENDING_DEPTH) {
+			if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH) {
 				for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
-					if (selected_oom_score_adj[i] < selected_oom_score_adj[max_selected_oom_idx])
-						max_selected_oom_idx = i;
-					else if (selected_oom_score_adj[i] == selected_oom_score_adj[max_selected_oom_idx] &&
-						selected_tasksize[i] < selected_tasksize[max_selected_oom_idx])
+					if (!selected[i]) {
+						is_exist_oom_task = 1;
 						max_selected_oom_idx = i;
+						break;
+					}
 				}
+			} else if (selected_oom_score_adj[max_selected_oom_idx] < oom_score_adj ||
+				(selected_oom_score_adj[max_selected_oom_idx] == oom_score_adj &&
+				selected_tasksize[max_selected_oom_idx] < tasksize)) {
+				is_exist_oom_task = 1;
 			}
 
-			lowmem_print(2, "select %d (%s), adj %d, \
-					size %d, to kill\n",
-				p->pid, p->comm, oom_score_adj, tasksize);
-		}
+			if (is_exist_oom_task) {
+				selected[max_selected_oom_idx] = p;
+				selected_tasksize[max_selected_oom_idx] = tasksize;
+				selected_oom_score_adj[max_selected_oom_idx] = oom_score_adj;
+
+				if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH)
+					all_selected_oom++;
+
+				if (all_selected_oom == LOWMEM_DEATHPENDING_DEPTH) {
+					for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
+						if (selected_oom_score_adj[i] < selected_oom_score_adj[max_selected_oom_idx])
+							max_selected_oom_idx = i;
+						else if (selected_oom_score_adj[i] == selected_oom_score_adj[max_selected_oom_idx] &&
+							selected_tasksize[i] < selected_tasksize[max_selected_oom_idx])
+							max_selected_oom_idx = i;
+					}
+				}
+
+				lowmem_print(2, "select %d (%s), adj %d, \
+						size %d, to kill\n",
+					p->pid, p->comm, oom_score_adj, tasksize);
+			}
 #else
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_score_adj, tasksize);
+			if (selected) {
+				if (oom_score_adj < selected_oom_score_adj)
+					continue;
+				if (oom_score_adj == selected_oom_score_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_score_adj = oom_score_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_score_adj, tasksize);
 #endif
+		}
 	}
+	spin_unlock_irq(&lowmem_adj_lock);
 #ifdef ENHANCED_LMK_ROUTINE
 	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
 		if (selected[i]) {
@@ -403,7 +611,10 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			lowmem_deathpending[i] = selected[i];
 			lowmem_deathpending_timeout = jiffies + HZ;
 			send_sig(SIGKILL, selected[i], 0);
-			rem -= selected_tasksize[i];
+			trace_lowmem_kill(selected[i], selected_oom_score_adj[i],
+					  selected_tasksize[i]);
+			lowmem_queue_reap(selected[i]);
+			freed += selected_tasksize[i];
 #ifdef LMK_COUNT_READ
 			lmk_count++;
 #endif
@@ -417,18 +628,160 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_deathpending_timeout = jiffies + HZ;
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
-		rem -= selected_tasksize;
+		trace_lowmem_kill(selected, selected_oom_score_adj,
+				  selected_tasksize);
+		lowmem_queue_reap(selected);
+		freed += selected_tasksize;
 #ifdef LMK_COUNT_READ
 		lmk_count++;
 #endif
 	}
 #endif
-	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
-		     sc->nr_to_scan, sc->gfp_mask, rem);
 	read_unlock(&tasklist_lock);
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	atomic_set(&s_reclaim.lmk_running, 0);
 #endif
+	return freed;
+}
+
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+/*
+ * Pressure-driven kills. The minfree thresholds only look at how much
+ * memory is free or cached, not at how hard it is to get it back: they
+ * fire too late when an allocation burst outruns reclaim and too early
+ * when the page cache is cheap to drop. Instead, every window of reclaim
+ * reports its scanned/reclaimed ratio (see mm/vmpressure.c) and the kill
+ * level follows that pressure: from lowmem_pressure_min the highest
+ * oom_score_adj level in lowmem_adj may be killed, going down linearly to
+ * lowmem_adj[1] at lowmem_pressure_max. lowmem_adj[0] is left to the
+ * minfree backstop, which lowmem_shrink() keeps applying for its first
+ * level only.
+ *
+ * Once swap (typically zram) use passes lowmem_swap_full percent, anon
+ * memory can no longer be reclaimed and the pressure is scaled up
+ * towards 100 as swap fills the remaining space.
+ */
+static uint32_t lowmem_pressure_enable = 1;
+static uint32_t lowmem_pressure_min = 60;
+static uint32_t lowmem_pressure_max = 95;
+static uint32_t lowmem_swap_full = 90;
+static uint32_t lowmem_pressure;
+
+static unsigned int lowmem_swap_util(void)
+{
+	long total = total_swap_pages;
+
+	if (total <= 0)
+		return 0;
+	return (total - nr_swap_pages) * 100 / total;
+}
+
+static int lowmem_pressure_to_adj(unsigned int pressure)
+{
+	int array_size = lowmem_array_size();
+	int i;
+
+	if (array_size < 2 || pressure < lowmem_pressure_min)
+		return OOM_SCORE_ADJ_MAX + 1;
+
+	if (pressure >= lowmem_pressure_max)
+		i = 1;
+	else
+		i = array_size - 1 - (pressure - lowmem_pressure_min) *
+			(array_size - 1) /
+			(lowmem_pressure_max - lowmem_pressure_min);
+	return lowmem_adj[i];
+}
+
+static int lowmem_vmpressure_notify(struct notifier_block *nb,
+				    unsigned long action, void *data)
+{
+	unsigned int pressure = action;
+	unsigned int swap_util = lowmem_swap_util();
+	int min_score_adj;
+
+	if (swap_util > lowmem_swap_full && lowmem_swap_full < 100)
+		pressure += (100 - pressure) * (swap_util - lowmem_swap_full) /
+			(100 - lowmem_swap_full);
+	lowmem_pressure = pressure;
+
+	if (!lowmem_pressure_enable || lowmem_death_pending())
+		return NOTIFY_OK;
+
+	min_score_adj = lowmem_pressure_to_adj(pressure);
+	if (min_score_adj == OOM_SCORE_ADJ_MAX + 1)
+		return NOTIFY_OK;
+
+	lowmem_print(3, "lowmem_pressure %lu, swap %u%%, pressure %u, ma %d\n",
+		     action, swap_util, pressure, min_score_adj);
+	lowmem_select_and_kill(min_score_adj);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block lowmem_vmpressure_nb = {
+	.notifier_call = lowmem_vmpressure_notify,
+};
+#endif /* CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE */
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem = 0;
+	int i;
+	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
+	int array_size = lowmem_array_size();
+	int other_free = global_page_state(NR_FREE_PAGES) - totalreserve_pages;
+	int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+	struct zone *zone;
+
+#ifdef CONFIG_ZRAM_FOR_ANDROID
+	other_file -= total_swapcache_pages();
+#endif
+
+	if (offlining) {
+		/* Discount all free space in the section being offlined */
+		for_each_zone(zone) {
+			 if (zone_idx(zone) == ZONE_MOVABLE) {
+				other_free -= zone_page_state(zone,
+						NR_FREE_PAGES);
+				lowmem_print(4, "lowmem_shrink discounted "
+					"%lu pages in movable zone\n",
+					zone_page_state(zone, NR_FREE_PAGES));
+			}
+		}
+	}
+	if (lowmem_death_pending())
+		return 0;
+
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+	/* the pressure notifier handles every level but the last resort */
+	if (lowmem_pressure_enable && array_size > 1)
+		array_size = 1;
+#endif
+	for (i = 0; i < array_size; i++) {
+		if (other_free < lowmem_minfree[i] &&
+		    other_file < lowmem_minfree[i]) {
+			min_score_adj = lowmem_adj[i];
+			break;
+		}
+	}
+	if (sc->nr_to_scan > 0)
+		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
+				sc->nr_to_scan, sc->gfp_mask, other_free,
+				other_file, min_score_adj);
+	rem = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_FILE);
+	if (sc->nr_to_scan <= 0 || min_score_adj == OOM_SCORE_ADJ_MAX + 1) {
+		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
+			     sc->nr_to_scan, sc->gfp_mask, rem);
+		return rem;
+	}
+
+	rem -= lowmem_select_and_kill(min_score_adj);
+	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
+		     sc->nr_to_scan, sc->gfp_mask, rem);
 	return rem;
 }
 
@@ -995,6 +1348,11 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	lowmem_reaper = kthread_run(lowmem_reap_thread, NULL, "lmk_reaper");
+	if (IS_ERR(lowmem_reaper)) {
+		pr_err("%s: couldn't start the reaper thread.\n", __func__);
+		lowmem_reaper = NULL;
+	}
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 #ifdef CONFIG_MEMORY_HOTPLUG
@@ -1003,6 +1361,9 @@ static int __init lowmem_init(void)
 #ifdef CONFIG_ANDROID_OOM_KILLER
 	register_oom_notifier(&android_oom_notifier);
 #endif
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+	vmpressure_notifier_register(&lowmem_vmpressure_nb);
+#endif
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	s_reclaim.kcompcached = kthread_run(do_compcache, NULL, "kcompcached");
 	if (IS_ERR(s_reclaim.kcompcached)) {
@@ -1031,8 +1392,15 @@ static int __init lowmem_init(void)
 
 static void __exit lowmem_exit(void)
 {
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+	vmpressure_notifier_unregister(&lowmem_vmpressure_nb);
+#endif
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+	if (lowmem_reaper) {
+		kthread_stop(lowmem_reaper);
+		lowmem_reaper = NULL;
+	}
 
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	idle_notifier_unregister(&kcompcache_idle_nb);
@@ -1140,11 +1508,20 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(reap, lowmem_reap_enable, uint, S_IRUGO | S_IWUSR);
 
 #ifdef LMK_COUNT_READ
 module_param_named(lmkcount, lmk_count, uint, S_IRUGO);
 #endif
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_VMPRESSURE
+module_param_named(pressure_kill, lowmem_pressure_enable, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_min, lowmem_pressure_min, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_max, lowmem_pressure_max, uint, S_IRUGO | S_IWUSR);
+module_param_named(swap_full, lowmem_swap_full, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure, lowmem_pressure, uint, S_IRUGO);
+#endif
+
 #ifdef OOM_COUNT_READ
 module_param_named(oomcount, oom_count, uint, S_IRUGO);
 #endif
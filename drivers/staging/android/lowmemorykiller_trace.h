@@ -0,0 +1,77 @@
+/*
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_kill,
+	TP_PROTO(struct task_struct *task, int oom_score_adj, int tasksize),
+	TP_ARGS(task, oom_score_adj, tasksize),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(int, oom_score_adj)
+		__field(int, tasksize)
+	),
+	TP_fast_assign(
+		__entry->pid = task->pid;
+		memcpy(__entry->comm, task->comm, TASK_COMM_LEN);
+		__entry->oom_score_adj = oom_score_adj;
+		__entry->tasksize = tasksize;
+	),
+	TP_printk("pid=%d comm=%s oom_score_adj=%d tasksize=%d",
+		  __entry->pid, __entry->comm, __entry->oom_score_adj,
+		  __entry->tasksize)
+);
+
+/*
+ * @pages: resident and swapped out pages the reaper freed
+ * @delay_us: time from the kill to the reaper starting on the victim
+ * @reap_us: time the reaper spent unmapping
+ */
+TRACE_EVENT(lowmem_reap,
+	TP_PROTO(struct task_struct *task, unsigned long pages,
+		 s64 delay_us, s64 reap_us),
+	TP_ARGS(task, pages, delay_us, reap_us),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(unsigned long, pages)
+		__field(s64, delay_us)
+		__field(s64, reap_us)
+	),
+	TP_fast_assign(
+		__entry->pid = task->pid;
+		memcpy(__entry->comm, task->comm, TASK_COMM_LEN);
+		__entry->pages = pages;
+		__entry->delay_us = delay_us;
+		__entry->reap_us = reap_us;
+	),
+	TP_printk("pid=%d comm=%s pages=%lu delay_us=%lld reap_us=%lld",
+		  __entry->pid, __entry->comm, __entry->pages,
+		  __entry->delay_us, __entry->reap_us)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+#include <trace/define_trace.h>
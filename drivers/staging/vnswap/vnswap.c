@@ -25,6 +25,7 @@
 #include <linux/atomic.h>
 #include <linux/types.h>
 #include <linux/vmalloc.h>
+#include <linux/percpu.h>
 
 #include "vnswap.h"
 
@@ -40,13 +41,43 @@ struct page *swap_header_page;
  * vnswap_table [1] = 0, vnswap_table [3] = 1, vnswap_table [6] = 2,
  * vnswap_table [7] = 3,
  * vnswap_table [10] = 4, vnswap_table [Others] = -1
+ * Entries are read with ACCESS_ONCE() and changed with xchg(), the swap
+ * layer never reads and writes one swap slot at the same time.
  */
-static DEFINE_SPINLOCK(vnswap_table_lock);
 int *vnswap_table;
 
 /* Backing Storage bitmap information */
 unsigned long *backing_storage_bitmap;
-unsigned int backing_storage_bitmap_last_allocated_index = -1;
+
+/*
+ * Backing Storage cluster information
+ *  - every cpu allocates slots from a cluster of VNSWAP_CLUSTER_PAGES
+ *    slots it owns (busy bit set), from next up to end.
+ *  - the last cluster is short if bs_size is not a multiple of
+ *    VNSWAP_CLUSTER_PAGES.
+ */
+struct vnswap_cpu_cluster {
+	int next;
+	int end;	/* 0: no cluster */
+};
+
+static DEFINE_PER_CPU(struct vnswap_cpu_cluster, vnswap_cpu_cluster);
+static DEFINE_SPINLOCK(vnswap_cluster_lock);
+unsigned long *backing_storage_cluster_busy;
+static int backing_storage_next_cluster;
+
+static int vnswap_nr_clusters(void)
+{
+	return (vnswap_device->bs_size + VNSWAP_CLUSTER_PAGES - 1) >>
+			VNSWAP_CLUSTER_SHIFT;
+}
+
+/* first slot past the cluster starting at start */
+static int vnswap_cluster_end(int start)
+{
+	return min_t(u64, start + VNSWAP_CLUSTER_PAGES,
+			vnswap_device->bs_size);
+}
 
 /* Backing Storage bmap and bdev information */
 sector_t *backing_storage_bmap;
@@ -90,7 +121,7 @@ int vnswap_init_backing_storage(void)
 	unsigned blkbits, blocks_per_page;
 	sector_t probe_block, last_block, first_block;
 	sector_t discard_start_block = 0, discard_last_block = 0;
-	int ret = 0, i;
+	int ret = 0, cpu;
 	mm_segment_t oldfs;
 	struct timeval discard_start, discard_end;
 	int discard_time;
@@ -178,39 +209,31 @@ int vnswap_init_backing_storage(void)
 		goto close_file;
 	}
 
-	/*
-	* Align sizeof(unsigned long) * 8 page
-	*  - This alignment is for Integer (sizeof(unsigned long) Bytes ->
-	*    sizeof(unsigned long) * 8 Bit -> sizeof(unsigned long) * 8 page)
-	*    bitmap operation
-	*/
-	if (vnswap_device->bs_size % (sizeof(unsigned long)*8) != 0) {
-		dprintk("%s %d: backing storage size is misaligned " \
-				"(32 page align)." \
-				"So, it is truncated from %llu pages to %llu pages\n",
-				__func__, __LINE__, vnswap_device->bs_size,
-				vnswap_device->bs_size /
-				(sizeof(unsigned long)*8)*
-				(sizeof(unsigned long)*8));
-		vnswap_device->bs_size = (vnswap_device->bs_size /
-			(sizeof(unsigned long)*8) * (sizeof(unsigned long)*8));
-	}
-
-	backing_storage_bitmap = vmalloc(vnswap_device->bs_size / 8);
+	backing_storage_bitmap = vmalloc(BITS_TO_LONGS(vnswap_device->bs_size) *
+			sizeof(unsigned long));
 	if (backing_storage_bitmap == NULL) {
 		ret = -ENOMEM;
 		goto close_file;
 	}
+	bitmap_zero(backing_storage_bitmap, vnswap_device->bs_size);
 
-	for (i = 0; i < vnswap_device->bs_size / 32; i++)
-		backing_storage_bitmap[i] = 0;
-	backing_storage_bitmap_last_allocated_index = -1;
+	backing_storage_cluster_busy = vzalloc(BITS_TO_LONGS(
+			vnswap_nr_clusters()) * sizeof(unsigned long));
+	if (backing_storage_cluster_busy == NULL) {
+		ret = -ENOMEM;
+		goto free_bitmap;
+	}
+	backing_storage_next_cluster = 0;
+	for_each_possible_cpu(cpu) {
+		per_cpu(vnswap_cpu_cluster, cpu).next = 0;
+		per_cpu(vnswap_cpu_cluster, cpu).end = 0;
+	}
 
 	backing_storage_bmap = vmalloc(vnswap_device->bs_size *
 							sizeof(sector_t));
 	if (backing_storage_bmap == NULL) {
 		ret = -ENOMEM;
-		goto free_bitmap;
+		goto free_cluster_busy;
 	}
 
 	for (probe_block = 0; probe_block < last_block; probe_block++) {
@@ -294,9 +317,15 @@ int vnswap_init_backing_storage(void)
 
 free_bmap:
 	vfree(backing_storage_bmap);
+	backing_storage_bmap = NULL;
+
+free_cluster_busy:
+	vfree(backing_storage_cluster_busy);
+	backing_storage_cluster_busy = NULL;
 
 free_bitmap:
 	vfree(backing_storage_bitmap);
+	backing_storage_bitmap = NULL;
 
 close_file:
 	filp_close(backing_storage_file, NULL);
@@ -306,194 +335,221 @@ error:
 	return ret;
 }
 
-/* find free area (nand_offset, page_offset) in backing storage */
-int vnswap_find_free_area_in_backing_storage(int *nand_offset)
+/* Clusters are handed out to cpus under this lock */
+static void vnswap_put_cluster(int cluster)
 {
-	int i, found = 0;
+	spin_lock(&vnswap_cluster_lock);
+	clear_bit(cluster, backing_storage_cluster_busy);
+	spin_unlock(&vnswap_cluster_lock);
+}
 
-	/* Backing Storage is full */
-	if (backing_storage_bitmap_last_allocated_index ==
-		vnswap_device->bs_size) {
-		atomic_inc(&vnswap_device->stats.
-			vnswap_backing_storage_full_num);
+/*
+ * find a free cluster in backing storage for a cpu
+ *  - a cluster without any used slot is preferred, so that the pages
+ *    written through it are contiguous in backing storage.
+ *  - otherwise the first cluster with a free slot is taken.
+ */
+static int vnswap_get_cluster(void)
+{
+	int nr_clusters = vnswap_nr_clusters();
+	int i, cluster, start, end, partial = -1;
+
+	spin_lock(&vnswap_cluster_lock);
+	for (i = 0; i < nr_clusters; i++) {
+		cluster = (backing_storage_next_cluster + i) % nr_clusters;
+		if (test_bit(cluster, backing_storage_cluster_busy))
+			continue;
+
+		start = cluster << VNSWAP_CLUSTER_SHIFT;
+		end = vnswap_cluster_end(start);
+		if (find_next_bit(backing_storage_bitmap, end, start) >= end)
+			goto found;
+		if (partial == -1 &&
+			find_next_zero_bit(backing_storage_bitmap,
+					end, start) < end)
+			partial = cluster;
+	}
+
+	if (partial == -1) {
+		spin_unlock(&vnswap_cluster_lock);
 		return -ENOSPC;
 	}
+	cluster = partial;
+
+found:
+	set_bit(cluster, backing_storage_cluster_busy);
+	backing_storage_next_cluster = (cluster + 1) % nr_clusters;
+	spin_unlock(&vnswap_cluster_lock);
 
-	for (i = backing_storage_bitmap_last_allocated_index + 1;
-		i < vnswap_device->bs_size; i++)
-		if (!test_bit(i, backing_storage_bitmap)) {
-			found = 1;
-			break;
+	atomic_inc(&vnswap_device->stats.vnswap_cluster_alloc_num);
+	return cluster;
+}
+
+/*
+ * find a free slot anywhere in backing storage
+ *  - once every cluster with a free slot is owned by a cpu, the free
+ *    slots left are in clusters other cpus own, or behind the point
+ *    their owner allocated up to. Any of them will do.
+ */
+static int vnswap_alloc_any_slot(void)
+{
+	int bs_size = vnswap_device->bs_size;
+	int nand_offset = 0;
+
+	while ((nand_offset = find_next_zero_bit(backing_storage_bitmap,
+					bs_size, nand_offset)) < bs_size) {
+		if (!test_and_set_bit(nand_offset, backing_storage_bitmap))
+			return nand_offset;
+	}
+
+	return -ENOSPC;
+}
+
+/*
+ * find a free slot (nand_offset) in backing storage
+ *  - slots are taken from the cluster owned by this cpu with
+ *    test_and_set_bit(), frees only clear bits, so no lock is needed.
+ *  - when no cluster is left, vnswap_alloc_any_slot() takes whatever
+ *    free slot there is, racing the owners with test_and_set_bit() too.
+ */
+static int vnswap_alloc_slot(void)
+{
+	struct vnswap_cpu_cluster *cpu_cluster;
+	int nand_offset, cluster;
+
+	cpu_cluster = &get_cpu_var(vnswap_cpu_cluster);
+	while (1) {
+		while (cpu_cluster->next < cpu_cluster->end) {
+			nand_offset = cpu_cluster->next++;
+			if (!test_and_set_bit(nand_offset,
+					backing_storage_bitmap))
+				goto out;
 		}
 
-	if (!found) {
-		for (i = 0;
-			i < backing_storage_bitmap_last_allocated_index;
-			i++)
-			if (!test_bit(i, backing_storage_bitmap)) {
-				found = 1;
-				break;
-			}
+		if (cpu_cluster->end)
+			vnswap_put_cluster((cpu_cluster->end - 1) >>
+						VNSWAP_CLUSTER_SHIFT);
+		cpu_cluster->next = cpu_cluster->end = 0;
+
+		cluster = vnswap_get_cluster();
+		if (cluster < 0) {
+			nand_offset = vnswap_alloc_any_slot();
+			if (nand_offset < 0)
+				/* Backing Storage is full */
+				atomic_inc(&vnswap_device->stats.
+					vnswap_backing_storage_full_num);
+			goto out;
+		}
+		cpu_cluster->next = cluster << VNSWAP_CLUSTER_SHIFT;
+		cpu_cluster->end = vnswap_cluster_end(cpu_cluster->next);
 	}
 
-	/* Backing Storage is full */
-	if (!found) {
-		backing_storage_bitmap_last_allocated_index =
-			vnswap_device->bs_size;
+out:
+	put_cpu_var(vnswap_cpu_cluster);
+	return nand_offset;
+}
+
+/* map swap slot index to nand_offset, dropping a previous mapping */
+static void vnswap_map_slot(u32 index, int nand_offset)
+{
+	int old_nand_offset;
+
+	old_nand_offset = xchg(&vnswap_table[index], nand_offset);
+
+	/* duplicate write - remove existing mapping */
+	if (old_nand_offset != -1) {
 		atomic_inc(&vnswap_device->stats.
-			vnswap_backing_storage_full_num);
-		return -ENOSPC;
+			vnswap_double_mapped_slot_num);
+		clear_bit(old_nand_offset, backing_storage_bitmap);
+		atomic_dec(&vnswap_device->stats.
+			vnswap_used_slot_num);
+		atomic_dec(&vnswap_device->stats.
+			vnswap_stored_pages);
 	}
-	*nand_offset =
-		backing_storage_bitmap_last_allocated_index = i;
-	return i;
+	atomic_inc(&vnswap_device->stats.
+		vnswap_used_slot_num);
+	atomic_inc(&vnswap_device->stats.
+		vnswap_stored_pages);
 }
 
-/* refer req_bio_endio() */
-void vnswap_bio_end_read(struct bio *bio, int err)
+/* unmap swap slot index, returns -1 if it was not mapped */
+static int vnswap_unmap_slot(u32 index)
 {
-	const int uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
-	struct page *page = bio->bi_io_vec[0].bv_page;
-	struct bio *original_bio = (struct bio *) bio->bi_private;
-	unsigned long flags;
+	int nand_offset;
 
-	dprintk("%s %d: (uptodate,error,bi_size) = (%d, %d, %d)\n",
-			__func__, __LINE__, uptodate, err, bio->bi_size);
-
-	if (!uptodate || err) {
-		atomic_inc(&vnswap_device->stats.vnswap_bio_end_fail_r1_num);
-		pr_err("%s %d: (error, bio->bi_size, original_bio->bi_size," \
-				"bio->bi_vcnt, original_bio->bi_vcnt, " \
-				"bio->bi_idx," \
-				"original_bio->bi_idx, " \
-				"vnswap_bio_end_fail_r1_num ~" \
-				"vnswap_bio_end_fail_r3_num) =" \
-				"(%d, %d, %d, %d, %d, %d, %d, %d, %d, %d)\n",
-				__func__, __LINE__, err, bio->bi_size,
-				original_bio->bi_size,
-				bio->bi_vcnt, original_bio->bi_vcnt,
-				bio->bi_idx,
-				original_bio->bi_idx,
-				vnswap_device->stats.
-					vnswap_bio_end_fail_r1_num.counter,
-				vnswap_device->stats.
-					vnswap_bio_end_fail_r2_num.counter,
-				vnswap_device->stats.
-					vnswap_bio_end_fail_r3_num.counter);
-		bio_io_error(original_bio);
-		goto out_bio_put;
-	} else {
-		/*
-		* There are bytes yet to be transferred.
-		* blk_end_request() -> blk_end_bidi_request() ->
-		* blk_update_bidi_request() ->
-		* blk_update_request() -> req_bio_endio() ->
-		* bio->bi_size -= nbytes;
-		*/
-		spin_lock_irqsave(&vnswap_original_bio_lock, flags);
-		original_bio->bi_size -= (PAGE_SIZE-bio->bi_size);
+	nand_offset = xchg(&vnswap_table[index], -1);
+	if (nand_offset == -1)
+		return -1;
 
-		if (bio->bi_size == PAGE_SIZE) {
-			atomic_inc(&vnswap_device->stats.
-				vnswap_bio_end_fail_r2_num);
-			pr_err("%s %d: (error, bio->bi_size, " \
-					"original_bio->bi_size," \
-					"bio->bi_vcnt," \
-					"original_bio->bi_vcnt, bio->bi_idx, " \
-					"original_bio->bi_idx," \
-					"vnswap_bio_end_fail_r1_num ~ " \
-					"vnswap_bio_end_fail_r3_num) = " \
-					"(%d, %d, %d, %d, %d, %d, %d, %d, %d, %d)\n",
-					__func__, __LINE__, err, bio->bi_size,
-					original_bio->bi_size,
-					bio->bi_vcnt, original_bio->bi_vcnt,
-					bio->bi_idx,
-					original_bio->bi_idx,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_r1_num.
-						counter,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_r2_num.
-						counter,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_r3_num.
-						counter);
-			spin_unlock_irqrestore(&vnswap_original_bio_lock,
-				flags);
-			goto out_bio_put;
-		}
+	atomic_dec(&vnswap_device->stats.
+		vnswap_stored_pages);
+	atomic_dec(&vnswap_device->stats.
+		vnswap_used_slot_num);
+	clear_bit(nand_offset, backing_storage_bitmap);
+
+	return nand_offset;
+}
+
+/*
+ * Account bytes of original_bio as done, and end it once all are.
+ * Child bios, the swap header page and pages failed before reaching
+ * the backing storage all come through here.
+ */
+static void vnswap_original_bio_done(struct bio *original_bio,
+	unsigned int bytes, int rw, int err)
+{
+	unsigned long flags;
+	int done;
 
-		if (bio->bi_size || original_bio->bi_size) {
+	spin_lock_irqsave(&vnswap_original_bio_lock, flags);
+	if (err)
+		clear_bit(BIO_UPTODATE, &original_bio->bi_flags);
+	if (unlikely(bytes > original_bio->bi_size)) {
+		if (rw)
+			atomic_inc(&vnswap_device->stats.
+				vnswap_bio_end_fail_w3_num);
+		else
 			atomic_inc(&vnswap_device->stats.
 				vnswap_bio_end_fail_r3_num);
-			pr_err("%s %d: (error, bio->bi_size, " \
-					"original_bio->bi_size," \
-					"bio->bi_vcnt," \
-					"original_bio->bi_vcnt, bio->bi_idx, " \
-					"original_bio->bi_idx," \
-					"vnswap_bio_end_fail_r1_num ~ " \
-					"vnswap_bio_end_fail_r3_num) = " \
-					"(%d, %d, %d, %d, %d, %d, %d, %d, %d, %d)\n",
-					__func__, __LINE__, err, bio->bi_size,
-					original_bio->bi_size,
-					bio->bi_vcnt, original_bio->bi_vcnt,
-					bio->bi_idx, original_bio->bi_idx,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_r1_num.
-						counter,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_r2_num.
-						counter,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_r3_num.
-						counter);
-			spin_unlock_irqrestore(&vnswap_original_bio_lock,
-				flags);
-			goto out_bio_put;
-		}
-
-		set_bit(BIO_UPTODATE, &original_bio->bi_flags);
-		spin_unlock_irqrestore(&vnswap_original_bio_lock, flags);
-		bio_endio(original_bio, 0);
+		pr_err("%s %d: (rw, bytes, original_bio->bi_size) = " \
+				"(%d, %u, %u)\n",
+				__func__, __LINE__, rw, bytes,
+				original_bio->bi_size);
+		bytes = original_bio->bi_size;
 	}
+	original_bio->bi_size -= bytes;
+	done = !original_bio->bi_size;
+	spin_unlock_irqrestore(&vnswap_original_bio_lock, flags);
 
-out_bio_put:
-	bio_put(bio);
+	/* bio_endio() turns a cleared BIO_UPTODATE into -EIO */
+	if (done)
+		bio_endio(original_bio, 0);
 }
 
 /* refer req_bio_endio() */
-void vnswap_bio_end_write(struct bio *bio, int err)
+void vnswap_bio_end_io(struct bio *bio, int err)
 {
-	struct page *page = bio->bi_io_vec[0].bv_page;
 	struct bio *original_bio = (struct bio *) bio->bi_private;
-	unsigned long flags;
+	int rw = bio_data_dir(bio);
 
-	dprintk("%s %d: (error, bi_size) = (%d, %d)\n",
-			__func__, __LINE__, err, bio->bi_size);
-
-	if (err) {
-		atomic_inc(&vnswap_device->stats.vnswap_bio_end_fail_w1_num);
-		pr_err("%s %d: (error, bio->bi_size, original_bio->bi_size, " \
-				"bio->bi_vcnt," \
-				"original_bio->bi_vcnt, bio->bi_idx, " \
-				"original_bio->bi_idx," \
-				"vnswap_bio_end_fail_w1_num ~ " \
-				"vnswap_bio_end_fail_w3_num) = " \
-				"(%d, %d, %d, %d, %d, %d, %d, %d, %d, %d)\n",
-				__func__, __LINE__, err, bio->bi_size,
-				original_bio->bi_size,
-				bio->bi_vcnt, original_bio->bi_vcnt,
-				bio->bi_idx,
-				original_bio->bi_idx,
-				vnswap_device->stats.
-					vnswap_bio_end_fail_w1_num.counter,
-				vnswap_device->stats.
-					vnswap_bio_end_fail_w2_num.counter,
-				vnswap_device->stats.
-					vnswap_bio_end_fail_w3_num.counter);
-		bio_io_error(original_bio);
-		goto out_bio_put;
-	} else {
+	dprintk("%s %d: (rw, error, bi_size, bi_vcnt) = (%d, %d, %d, %d)\n",
+			__func__, __LINE__, rw, err, bio->bi_size,
+			bio->bi_vcnt);
+
+	if (err || !test_bit(BIO_UPTODATE, &bio->bi_flags)) {
+		if (rw)
+			atomic_inc(&vnswap_device->stats.
+				vnswap_bio_end_fail_w1_num);
+		else
+			atomic_inc(&vnswap_device->stats.
+				vnswap_bio_end_fail_r1_num);
+		pr_err("%s %d: (rw, error, bio->bi_sector, bio->bi_vcnt) = " \
+				"(%d, %d, %llu, %d)\n",
+				__func__, __LINE__, rw, err,
+				(unsigned long long)bio->bi_sector,
+				bio->bi_vcnt);
+		err = err ? err : -EIO;
+	} else if (bio->bi_size) {
 		/*
 		* There are bytes yet to be transferred.
 		* blk_end_request() -> blk_end_bidi_request() ->
@@ -501,280 +557,112 @@ void vnswap_bio_end_write(struct bio *bio, int err)
 		* blk_update_request() -> req_bio_endio() ->
 		* bio->bi_size -= nbytes;
 		*/
-		spin_lock_irqsave(&vnswap_original_bio_lock, flags);
-		original_bio->bi_size -= (PAGE_SIZE-bio->bi_size);
-
-		if (bio->bi_size == PAGE_SIZE) {
+		if (rw)
 			atomic_inc(&vnswap_device->stats.
 				vnswap_bio_end_fail_w2_num);
-			pr_err("%s %d: (error, bio->bi_size, " \
-					"original_bio->bi_size, " \
-					"bio->bi_vcnt," \
-					"original_bio->bi_vcnt, bio->bi_idx, " \
-					"original_bio->bi_idx," \
-					"vnswap_bio_end_fail_w1_num ~ " \
-					"vnswap_bio_end_fail_w3_num) = " \
-					"(%d, %d, %d, %d, %d, %d, %d, %d, %d, %d)\n",
-					__func__, __LINE__, err, bio->bi_size,
-					original_bio->bi_size,
-					bio->bi_vcnt, original_bio->bi_vcnt,
-					bio->bi_idx,
-					original_bio->bi_idx,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_w1_num.
-						counter,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_w2_num.
-						counter,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_w3_num.
-						counter);
-			spin_unlock_irqrestore(&vnswap_original_bio_lock,
-				flags);
-			goto out_bio_put;
-		}
-
-		if (bio->bi_size || original_bio->bi_size) {
+		else
 			atomic_inc(&vnswap_device->stats.
-				vnswap_bio_end_fail_w3_num);
-			pr_err("%s %d: (error, bio->bi_size, " \
-					"original_bio->bi_size, " \
-					"bio->bi_vcnt," \
-					"original_bio->bi_vcnt, bio->bi_idx, " \
-					"original_bio->bi_idx," \
-					"vnswap_bio_end_fail_w1_num ~ " \
-					"vnswap_bio_end_fail_w3_num) = " \
-					"(%d, %d, %d, %d, %d, %d, %d, %d, %d, %d)\n",
-					__func__, __LINE__, err, bio->bi_size,
-					original_bio->bi_size,
-					bio->bi_vcnt, original_bio->bi_vcnt,
-					bio->bi_idx,
-					original_bio->bi_idx,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_w1_num.
-						counter,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_w2_num.
-						counter,
-					vnswap_device->stats.
-						vnswap_bio_end_fail_w3_num.
-						counter);
-			spin_unlock_irqrestore(&vnswap_original_bio_lock,
-				flags);
-			goto out_bio_put;
-		}
-
-		set_bit(BIO_UPTODATE, &original_bio->bi_flags);
-		spin_unlock_irqrestore(&vnswap_original_bio_lock,
-			flags);
-		bio_endio(original_bio, 0);
+				vnswap_bio_end_fail_r2_num);
+		pr_err("%s %d: (rw, bio->bi_size, bio->bi_vcnt) = " \
+				"(%d, %d, %d)\n",
+				__func__, __LINE__, rw, bio->bi_size,
+				bio->bi_vcnt);
+		err = -EIO;
 	}
 
-out_bio_put:
+	vnswap_original_bio_done(original_bio, bio->bi_vcnt << PAGE_SHIFT,
+		rw, err);
 	bio_put(bio);
 }
 
-/* Insert entry into VNSWAP_IO sub system */
-int vnswap_submit_bio(int rw, int nand_offset,
-	struct page *page, struct bio *original_bio)
+/*
+ * Allocate a bio to backing storage starting at nand_offset, with room
+ * for the nr_pages pages of original_bio that are left.
+ */
+static struct bio *vnswap_alloc_bio(int nand_offset, int nr_pages,
+	struct bio *original_bio)
 {
 	struct bio *bio;
-	int ret = 0;
-
-	if (!rw) {
-		VM_BUG_ON(!PageLocked(page));
-		VM_BUG_ON(PageUptodate(page));
-	}
-
-	bio = bio_alloc(GFP_NOIO, 1);
 
+	bio = bio_alloc(GFP_NOIO, min(nr_pages, BIO_MAX_PAGES));
 	if (!bio) {
 		atomic_inc(&vnswap_device->stats.vnswap_bio_no_mem_num);
-		ret = -ENOMEM;
-		goto out;
+		return NULL;
 	}
 
 	bio->bi_sector = (backing_storage_bmap[nand_offset] <<
 					(PAGE_SHIFT - 9));
 	bio->bi_bdev = backing_storage_bdev;
-	bio->bi_io_vec[0].bv_page = page;
-	bio->bi_io_vec[0].bv_len = PAGE_SIZE;
-	bio->bi_io_vec[0].bv_offset = 0;
-	bio->bi_vcnt = 1;
-	bio->bi_idx = 0;
-	bio->bi_size = PAGE_SIZE;
 	bio->bi_private = (void *) original_bio;
-	if (rw)
-		bio->bi_end_io = vnswap_bio_end_write;
-	else
-		bio->bi_end_io = vnswap_bio_end_read;
-
-	dprintk("%s %d: (rw, nand_offset) = (%d,%d)\n",
-			__func__, __LINE__, rw, nand_offset);
-
-	submit_bio(rw, bio);
-
-	if (rw) {
-		atomic_inc(&vnswap_device->stats.
-			vnswap_stored_pages);
-		atomic_inc(&vnswap_device->stats.
-			vnswap_write_pages);
-	} else {
-		atomic_inc(&vnswap_device->stats.
-			vnswap_read_pages);
-	}
-	/* TODO: check bio->bi_flags */
+	bio->bi_end_io = vnswap_bio_end_io;
 
-out:
-	return ret;
+	return bio;
 }
 
-int vnswap_bvec_read(struct vnswap *vnswap, struct bio_vec *bvec,
-	u32 index, struct bio *bio)
+/*
+ * Add page at nand_offset to the pending bio if it directly follows
+ * it in backing storage, otherwise submit the pending bio and start a
+ * new one. Returns the pending bio, NULL if the page could not be
+ * added.
+ */
+static struct bio *vnswap_add_page(int rw, struct bio *bio,
+	struct page *page, int nand_offset, int nr_pages,
+	struct bio *original_bio)
 {
-	struct page *page;
-	unsigned char *user_mem, *swap_header_page_mem;
-	int nand_offset = 0, ret = 0;
-	struct page *io_pool_page;
-	unsigned char *src, *dst;
-
-	page = bvec->bv_page;
-
-	/* swap header */
-	if (index == 0) {
-		user_mem = kmap_atomic(page);
-		swap_header_page_mem = kmap_atomic(swap_header_page);
-		memcpy(user_mem, swap_header_page_mem, bvec->bv_len);
-		kunmap_atomic(swap_header_page_mem);
-		kunmap_atomic(user_mem);
-		flush_dcache_page(page);
-		return 0;
-	}
+	sector_t sector = backing_storage_bmap[nand_offset] <<
+					(PAGE_SHIFT - 9);
 
-	spin_lock(&vnswap_table_lock);
-	nand_offset = vnswap_table[index];
-	if (nand_offset == -1) {
-		pr_err("%s %d: vnswap_table is not mapped. " \
-				"(index, nand_offset)" \
-				"= (%d, %d)\n", __func__, __LINE__,
-				index, nand_offset);
-		ret = -EIO;
-		atomic_inc(&vnswap_device->stats.
-			vnswap_not_mapped_read_pages);
-		spin_unlock(&vnswap_table_lock);
-		goto out;
+	if (bio) {
+		if (bio->bi_sector + (bio->bi_size >> 9) == sector &&
+			bio_add_page(bio, page, PAGE_SIZE, 0) == PAGE_SIZE) {
+			atomic_inc(&vnswap_device->stats.
+				vnswap_bio_merged_pages);
+			return bio;
+		}
+		submit_bio(rw, bio);
 	}
-	spin_unlock(&vnswap_table_lock);
 
-	dprintk("%s %d: (index, nand_offset) = (%d, %d)\n",
-			__func__, __LINE__, index, nand_offset);
+	bio = vnswap_alloc_bio(nand_offset, nr_pages, original_bio);
+	if (!bio)
+		return NULL;
 
-	/* Read nand_offset position backing storage into page */
-	ret = vnswap_submit_bio(0, nand_offset, page, bio);
+	if (bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE) {
+		bio_put(bio);
+		return NULL;
+	}
 
-out:
-	return ret;
+	return bio;
 }
 
-int vnswap_bvec_write(struct vnswap *vnswap, struct bio_vec *bvec,
-	u32 index, struct bio *bio)
+static void vnswap_rw_swap_header(struct page *page, int rw)
 {
-	struct page *page;
 	unsigned char *user_mem, *swap_header_page_mem;
-	int nand_offset = 0, ret;
-	struct page *io_page = NULL;
-	unsigned char *dst, *buf;
 
-	page = bvec->bv_page;
-
-	/* swap header */
-	if (index == 0) {
-		user_mem = kmap_atomic(page);
-		swap_header_page_mem = kmap_atomic(swap_header_page);
+	user_mem = kmap_atomic(page);
+	swap_header_page_mem = kmap_atomic(swap_header_page);
+	if (rw)
 		memcpy(swap_header_page_mem, user_mem, PAGE_SIZE);
-		kunmap_atomic(swap_header_page_mem);
-		kunmap_atomic(user_mem);
-		return 0;
-	}
-
-	spin_lock(&vnswap_table_lock);
-	nand_offset = vnswap_table[index];
-
-	/* duplicate write - remove existing mapping */
-	if (nand_offset != -1) {
-		atomic_inc(&vnswap_device->stats.
-			vnswap_double_mapped_slot_num);
-		clear_bit(nand_offset, backing_storage_bitmap);
-		vnswap_table[index] = -1;
-		atomic_dec(&vnswap_device->stats.
-			vnswap_used_slot_num);
-		atomic_dec(&vnswap_device->stats.
-			vnswap_stored_pages);
-	}
-
-	ret = vnswap_find_free_area_in_backing_storage(&nand_offset);
-	if (ret < 0) {
-		spin_unlock(&vnswap_table_lock);
-		return ret;
-	}
-	set_bit(nand_offset, backing_storage_bitmap);
-	vnswap_table[index] = nand_offset;
-	atomic_inc(&vnswap_device->stats.
-		vnswap_used_slot_num);
-	spin_unlock(&vnswap_table_lock);
-
-	dprintk("%s %d: (index, nand_offset) = (%d, %d)\n",
-			__func__, __LINE__, index, nand_offset);
-	ret = vnswap_submit_bio(1, nand_offset, page, bio);
-
-	if (ret) {
-		spin_lock(&vnswap_table_lock);
-		clear_bit(nand_offset, backing_storage_bitmap);
-		vnswap_table[index] = -1;
-		spin_unlock(&vnswap_table_lock);
-	}
-
-	return ret;
-}
-
-int vnswap_bvec_rw(struct vnswap *vnswap, struct bio_vec *bvec,
-	u32 index, struct bio *bio, int rw)
-{
-	int ret;
-
-	if (rw == READ) {
-		down_read(&vnswap->lock);
-		dprintk("%s %d: (rw,index) = (%d, %d)\n",
-			__func__, __LINE__, rw, index);
-		ret = vnswap_bvec_read(vnswap, bvec, index, bio);
-		up_read(&vnswap->lock);
-	} else {
-		down_write(&vnswap->lock);
-		dprintk("%s %d: (rw,index) = (%d, %d)\n",
-			__func__, __LINE__, rw, index);
-		ret = vnswap_bvec_write(vnswap, bvec, index, bio);
-		up_write(&vnswap->lock);
-	}
-
-	return ret;
+	else
+		memcpy(user_mem, swap_header_page_mem, PAGE_SIZE);
+	kunmap_atomic(swap_header_page_mem);
+	kunmap_atomic(user_mem);
+	if (!rw)
+		flush_dcache_page(page);
 }
 
 void __vnswap_make_request(struct vnswap *vnswap,
 	struct bio *bio, int rw)
 {
-	int i, offset, first_vec = 1, ret;
-	u32 index, is_swap_header_page;
+	int i, offset, nand_offset, err = 0;
+	unsigned int done_bytes = 0;
+	u32 index;
 	struct bio_vec *bvec;
+	struct bio *pending_bio = NULL;
 
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) <<
 				SECTOR_SHIFT;
 
-	if (index == 0)
-		is_swap_header_page = 1;
-	else
-		is_swap_header_page = 0;
-
 	dprintk("%s %d: (rw, index, offset, bi_size) = " \
 			"(%d, %d, %d, %d)\n",
 			__func__, __LINE__,
@@ -793,17 +681,14 @@ void __vnswap_make_request(struct vnswap *vnswap,
 		goto out_error;
 	}
 
-	if (bio->bi_size > PAGE_SIZE) {
+	/* multi page bios are mapped onto as few backing bios as possible */
+	if (bio->bi_size > PAGE_SIZE)
 		atomic_inc(&vnswap_device->stats.
 			vnswap_bio_large_bi_size_num);
-		goto out_error;
-	}
 
-	if (bio->bi_vcnt > 1) {
+	if (bio->bi_vcnt > 1)
 		atomic_inc(&vnswap_device->stats.
 			vnswap_bio_large_bi_vcnt_num);
-		goto out_error;
-	}
 
 	bio_for_each_segment(bvec, bio, i) {
 		if (bvec->bv_len != PAGE_SIZE || bvec->bv_offset != 0) {
@@ -818,31 +703,84 @@ void __vnswap_make_request(struct vnswap *vnswap,
 						vnswap_bio_invalid_num.counter);
 			goto out_error;
 		}
+	}
+
+	/*
+	 * Nothing touches bio after the last backing bio is submitted,
+	 * unless done_bytes keeps it from completing.
+	 */
+	bio_for_each_segment(bvec, bio, i) {
+		struct page *page = bvec->bv_page;
 
 		dprintk("%s %d: (rw, index, bvec->bv_len) = " \
 				"(%d, %d, %d)\n",
 				__func__, __LINE__, rw, index, bvec->bv_len);
 
-		ret = vnswap_bvec_rw(vnswap, bvec, index, bio, rw);
-		if (ret < 0) {
-			if (ret != -ENOSPC)
-				pr_err("%s %d: vnswap_bvec_rw failed." \
-						"(ret) = (%d)\n",
-						__func__, __LINE__, ret);
-			else
-				dprintk("%s %d: vnswap_bvec_rw failed. " \
-				"(ret) = (%d)\n",
-						__func__, __LINE__, ret);
-			goto out_error;
+		/* swap header */
+		if (index == 0) {
+			vnswap_rw_swap_header(page, rw);
+			done_bytes += PAGE_SIZE;
+			index++;
+			continue;
+		}
+
+		if (rw) {
+			nand_offset = vnswap_alloc_slot();
+			if (nand_offset < 0) {
+				dprintk("%s %d: backing storage is full\n",
+						__func__, __LINE__);
+				err = nand_offset;
+				done_bytes += PAGE_SIZE;
+				index++;
+				continue;
+			}
+			vnswap_map_slot(index, nand_offset);
+			atomic_inc(&vnswap_device->stats.
+				vnswap_write_pages);
+		} else {
+			VM_BUG_ON(!PageLocked(page));
+			VM_BUG_ON(PageUptodate(page));
+
+			nand_offset = ACCESS_ONCE(vnswap_table[index]);
+			if (nand_offset == -1) {
+				pr_err("%s %d: vnswap_table is not mapped. " \
+						"(index, nand_offset)" \
+						"= (%d, %d)\n", __func__, __LINE__,
+						index, nand_offset);
+				atomic_inc(&vnswap_device->stats.
+					vnswap_not_mapped_read_pages);
+				err = -EIO;
+				done_bytes += PAGE_SIZE;
+				index++;
+				continue;
+			}
+			atomic_inc(&vnswap_device->stats.
+				vnswap_read_pages);
 		}
 
+		dprintk("%s %d: (rw, index, nand_offset) = (%d, %d, %d)\n",
+				__func__, __LINE__, rw, index, nand_offset);
+
+		pending_bio = vnswap_add_page(rw, pending_bio, page,
+				nand_offset, bio->bi_vcnt - i, bio);
+		if (!pending_bio) {
+			pr_err("%s %d: backing bio allocation failed. " \
+					"(index, nand_offset) = (%d, %d)\n",
+					__func__, __LINE__, index, nand_offset);
+			if (rw)
+				vnswap_unmap_slot(index);
+			err = -ENOMEM;
+			done_bytes += PAGE_SIZE;
+		}
 		index++;
 	}
 
-	if (is_swap_header_page) {
-		set_bit(BIO_UPTODATE, &bio->bi_flags);
-		bio_endio(bio, 0);
-	}
+	if (pending_bio)
+		submit_bio(rw, pending_bio);
+
+	/* the swap header page and pages that failed, err tells which */
+	if (done_bytes)
+		vnswap_original_bio_done(bio, done_bytes, rw, err);
 
 	return;
 
@@ -917,32 +855,17 @@ void vnswap_slot_free_notify(struct block_device *bdev, unsigned long index)
 
 	vnswap = bdev->bd_disk->private_data;
 
-	spin_lock(&vnswap_table_lock);
-	nand_offset = vnswap_table[index];
+	nand_offset = vnswap_unmap_slot(index);
 
 	/* This index is not mapped to vnswap and is mapped to zswap */
 	if (nand_offset == -1) {
 		atomic_inc(&vnswap_device->stats.
 			vnswap_not_mapped_slot_free_num);
-		spin_unlock(&vnswap_table_lock);
 		return;
 	}
 
 	atomic_inc(&vnswap_device->stats.
 		vnswap_mapped_slot_free_num);
-	atomic_dec(&vnswap_device->stats.
-		vnswap_stored_pages);
-	atomic_dec(&vnswap_device->stats.
-		vnswap_used_slot_num);
-	clear_bit(nand_offset, backing_storage_bitmap);
-	vnswap_table[index] = -1;
-
-	/* When Backing Storage is full, set Backing Storage is not full */
-	if (backing_storage_bitmap_last_allocated_index ==
-		vnswap_device->bs_size) {
-		backing_storage_bitmap_last_allocated_index = nand_offset;
-	}
-	spin_unlock(&vnswap_table_lock);
 
 	/*
 	 * disable blkdev_issue_discard
@@ -970,8 +893,6 @@ static int create_device(struct vnswap *vnswap)
 {
 	int ret = 0;
 
-	init_rwsem(&vnswap->lock);
-
 	vnswap->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!vnswap->queue) {
 		pr_err("%s %d: Error allocating disk queue for device\n",
@@ -1012,9 +933,10 @@ static int create_device(struct vnswap *vnswap)
 	blk_queue_logical_block_size(vnswap->disk->queue,
 		VNSWAP_LOGICAL_BLOCK_SIZE);
 	blk_queue_io_min(vnswap->disk->queue, PAGE_SIZE);
-	blk_queue_io_opt(vnswap->disk->queue, PAGE_SIZE);
+	blk_queue_io_opt(vnswap->disk->queue,
+		VNSWAP_CLUSTER_PAGES * PAGE_SIZE);
 	blk_queue_max_hw_sectors(vnswap->disk->queue,
-		PAGE_SIZE / SECTOR_SIZE);
+		VNSWAP_CLUSTER_PAGES * PAGE_SIZE / SECTOR_SIZE);
 
 	add_disk(vnswap->disk);
 
@@ -1088,6 +1010,7 @@ int __init vnswap_init(void)
 	/* Initialize global variables */
 	vnswap_table = NULL;
 	backing_storage_bitmap = NULL;
+	backing_storage_cluster_busy = NULL;
 	backing_storage_bmap = NULL;
 	backing_storage_bdev = NULL;
 	backing_storage_file = NULL;
@@ -1138,6 +1061,8 @@ void __exit vnswap_exit(void)
 	kfree(vnswap_device);
 	if (backing_storage_bmap)
 		vfree(backing_storage_bmap);
+	if (backing_storage_cluster_busy)
+		vfree(backing_storage_cluster_busy);
 	if (backing_storage_bitmap)
 		vfree(backing_storage_bitmap);
 	if (vnswap_table)
@@ -37,6 +37,14 @@
  */
 #define MAX_BACKING_STORAGE_SIZE_PAGES	(_AC(1 , UL) << 18)
 
+/*
+ * Backing Storage Cluster Size (256KB)
+ *  - 64 page = 4KB*64 = 256KB, handed out to one cpu at a time so that
+ *    the pages it writes are contiguous in backing storage
+ */
+#define VNSWAP_CLUSTER_SHIFT	6
+#define VNSWAP_CLUSTER_PAGES	(1 << VNSWAP_CLUSTER_SHIFT)
+
 #define VNSWAP_INIT_DISKSIZE_SUCCESS 0x1
 #define VNSWAP_INIT_DISKSIZE_FAIL 0x2
 #define VNSWAP_INIT_BACKING_STORAGE_SUCCESS 0x10
@@ -89,11 +97,13 @@ struct vnswap_stats {
 		/* total write_fail_because_of_backing_storage_full number */
 	int vnswap_backing_storage_open_fail;
 		/* backing storage file open fail */
+	atomic_t vnswap_cluster_alloc_num;
+		/* total clusters handed out to cpus */
+	atomic_t vnswap_bio_merged_pages;
+		/* total pages merged into a preceding backing bio */
 };
 
 struct vnswap {
-	struct rw_semaphore lock;
-		/* protect buffers against concurrent read and writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	u64 disksize;	/* bytes */
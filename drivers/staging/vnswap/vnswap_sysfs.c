@@ -119,6 +119,15 @@ static ssize_t vnswap_swap_info_show(struct device *dev,
 	);
 }
 
+static ssize_t vnswap_cluster_info_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "(%d, %d, %d)\n",
+		VNSWAP_CLUSTER_PAGES,
+		vnswap_device->stats.vnswap_cluster_alloc_num.counter,
+		vnswap_device->stats.vnswap_bio_merged_pages.counter);
+}
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR, disksize_show,
 	disksize_store);
 static DEVICE_ATTR(swap_filename, S_IRUGO | S_IWUSR, swap_filename_show,
@@ -129,6 +138,8 @@ static DEVICE_ATTR(vnswap_init, S_IRUGO | S_IWUSR,
 	vnswap_init_show, NULL);
 static DEVICE_ATTR(vnswap_swap_info, S_IRUGO | S_IWUSR,
 	vnswap_swap_info_show, NULL);
+static DEVICE_ATTR(vnswap_cluster_info, S_IRUGO,
+	vnswap_cluster_info_show, NULL);
 
 static struct attribute *vnswap_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -136,6 +147,7 @@ static struct attribute *vnswap_disk_attrs[] = {
 	&dev_attr_init_backing_storage.attr,
 	&dev_attr_vnswap_init.attr,
 	&dev_attr_vnswap_swap_info.attr,
+	&dev_attr_vnswap_cluster_info.attr,
 	NULL,
 };
 
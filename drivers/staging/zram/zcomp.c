@@ -0,0 +1,230 @@
+/*
+ * Compression streams for zram
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+
+#include "zcomp.h"
+
+/*
+ * Compression output may be larger than the input for incompressible
+ * data, so the buffer is twice the page size.
+ */
+#define ZCOMP_BUFFER_ORDER 1
+
+/* Algorithms offered through the comp_algorithm attribute */
+static const char * const backends[] = {
+	"lzo",
+	"lz4",
+	"lz4hc",
+	"snappy",
+	"deflate",
+	NULL
+};
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, ZCOMP_BUFFER_ORDER);
+	kfree(zstrm);
+}
+
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(comp->name, 0, 0);
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+			ZCOMP_BUFFER_ORDER);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zcomp_strm_free(zstrm);
+		return NULL;
+	}
+	return zstrm;
+}
+
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (!crypto_has_comp(backends[i], 0, 0))
+			continue;
+		if (!strcmp(comp, backends[i]))
+			sz += scnprintf(buf + sz, PAGE_SIZE - sz - 2,
+					"[%s] ", backends[i]);
+		else
+			sz += scnprintf(buf + sz, PAGE_SIZE - sz - 2,
+					"%s ", backends[i]);
+	}
+	sz += scnprintf(buf + sz, PAGE_SIZE - sz, "\n");
+	return sz;
+}
+
+bool zcomp_available_algorithm(const char *comp)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (!strcmp(comp, backends[i]))
+			return crypto_has_comp(comp, 0, 0);
+	}
+	return false;
+}
+
+/*
+ * Get an idle stream, sleeping until another user releases one if all
+ * max_strm streams are busy.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	for (;;) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_entry(comp->idle_strm.next,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->strm_lock);
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm > comp->max_strm) {
+		/* the pool was shrunk while this stream was in use */
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		zcomp_strm_free(zstrm);
+		return;
+	}
+	list_add(&zstrm->list, &comp->idle_strm);
+	spin_unlock(&comp->strm_lock);
+	wake_up(&comp->strm_wait);
+}
+
+int zcomp_set_max_streams(struct zcomp *comp, int max_strm)
+{
+	struct zcomp_strm *zstrm;
+
+	if (max_strm < 1)
+		return -EINVAL;
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = max_strm;
+	while (comp->avail_strm < comp->max_strm) {
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+		zstrm = zcomp_strm_alloc(comp);
+		spin_lock(&comp->strm_lock);
+		if (!zstrm) {
+			comp->avail_strm--;
+			spin_unlock(&comp->strm_lock);
+			return -ENOMEM;
+		}
+		list_add(&zstrm->list, &comp->idle_strm);
+		wake_up(&comp->strm_wait);
+	}
+	/* busy streams above the limit are freed on release */
+	while (comp->avail_strm > comp->max_strm &&
+			!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		zcomp_strm_free(zstrm);
+		spin_lock(&comp->strm_lock);
+	}
+	spin_unlock(&comp->strm_lock);
+	return 0;
+}
+
+int zcomp_compress(struct zcomp_strm *zstrm, const unsigned char *src,
+		size_t *dst_len)
+{
+	unsigned int dlen = PAGE_SIZE << ZCOMP_BUFFER_ORDER;
+	int ret;
+
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+			zstrm->buffer, &dlen);
+	*dst_len = dlen;
+	return ret;
+}
+
+int zcomp_decompress(struct zcomp_strm *zstrm, const unsigned char *src,
+		size_t src_len, unsigned char *dst)
+{
+	unsigned int dlen = PAGE_SIZE;
+
+	return crypto_comp_decompress(zstrm->tfm, src, src_len, dst, &dlen);
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_entry(comp->idle_strm.next,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Create a pool of max_strm streams for the given algorithm.
+ * Returns ERR_PTR on failure.
+ */
+struct zcomp *zcomp_create(const char *compress, int max_strm)
+{
+	struct zcomp *comp;
+	int ret;
+
+	if (!zcomp_available_algorithm(compress))
+		return ERR_PTR(-EINVAL);
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	strlcpy(comp->name, compress, sizeof(comp->name));
+
+	ret = zcomp_set_max_streams(comp, max_strm);
+	if (ret) {
+		zcomp_destroy(comp);
+		return ERR_PTR(ret);
+	}
+	return comp;
+}
@@ -0,0 +1,59 @@
+/*
+ * Compression streams for zram
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/*
+ * A compression stream: a crypto transform together with its output
+ * buffer. Streams are handed out one user at a time, so neither the
+ * transform nor the buffer needs any further locking and the caller
+ * may sleep while holding one.
+ */
+struct zcomp_strm {
+	struct crypto_comp *tfm;
+	/* compression output buffer, ZCOMP_BUFFER_ORDER pages */
+	void *buffer;
+	struct list_head list;
+};
+
+/* Pool of preallocated compression streams for one algorithm */
+struct zcomp {
+	spinlock_t strm_lock;		/* protects idle_strm, avail_strm */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;	/* waiters for an idle stream */
+	int avail_strm;			/* no. of streams allocated */
+	int max_strm;			/* upper bound for avail_strm */
+	char name[CRYPTO_MAX_ALG_NAME];
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+bool zcomp_available_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *comp, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+int zcomp_set_max_streams(struct zcomp *comp, int max_strm);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp_strm *zstrm, const unsigned char *src,
+		size_t *dst_len);
+int zcomp_decompress(struct zcomp_strm *zstrm, const unsigned char *src,
+		size_t src_len, unsigned char *dst);
+
+#endif /* _ZCOMP_H_ */
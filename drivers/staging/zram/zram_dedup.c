@@ -0,0 +1,189 @@
+/*
+ * Compressed page deduplication for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/* One hash bucket per 16 pages of disksize, within these bounds */
+#define ZRAM_HASH_SHIFT		4
+#define ZRAM_HASH_SIZE_MIN	(1 << 10)
+#define ZRAM_HASH_SIZE_MAX	(1 << 20)
+
+u32 zram_dedup_checksum(const unsigned char *mem, size_t len)
+{
+	return jhash(mem, len, 0);
+}
+
+static struct zram_hash *zram_dedup_bucket(struct zram_meta *meta,
+					u32 checksum)
+{
+	return &meta->hash[checksum & (meta->hash_size - 1)];
+}
+
+/*
+ * Look for an object with the same compressed data. On success the
+ * entry's reference count is raised on behalf of the caller.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 checksum)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zram_hash *hash = zram_dedup_bucket(meta, checksum);
+	struct zram_entry *entry;
+	struct rb_node *rb_node;
+	unsigned char *cmem;
+	int match;
+
+	spin_lock(&hash->lock);
+	rb_node = hash->rb_root.rb_node;
+	while (rb_node) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (checksum < entry->checksum)
+			rb_node = rb_node->rb_left;
+		else if (checksum > entry->checksum)
+			rb_node = rb_node->rb_right;
+		else
+			break;
+	}
+
+	/*
+	 * Entries with equal checksums are adjacent in order but may sit
+	 * on either side of the one found, so rewind to the first.
+	 */
+	while (rb_node && rb_prev(rb_node) &&
+			rb_entry(rb_prev(rb_node), struct zram_entry,
+				rb_node)->checksum == checksum)
+		rb_node = rb_prev(rb_node);
+
+	for (; rb_node; rb_node = rb_next(rb_node)) {
+		entry = rb_entry(rb_node, struct zram_entry, rb_node);
+		if (entry->checksum != checksum)
+			break;
+		if (entry->len != len)
+			continue;
+
+		cmem = zs_map_object(meta->mem_pool, entry->handle, ZS_MM_RO);
+		match = !memcmp(cmem, mem, len);
+		zs_unmap_object(meta->mem_pool, entry->handle);
+		if (match) {
+			entry->refcount++;
+			spin_unlock(&hash->lock);
+			atomic64_add(len, &zram->stats.dup_data_size);
+			return entry;
+		}
+	}
+	spin_unlock(&hash->lock);
+
+	return NULL;
+}
+
+/*
+ * Index a newly stored object. Objects stored uncompressed are not
+ * worth a lookup, they only get an entry so that every slot of a dedup
+ * device looks the same. Returns NULL if out of memory.
+ */
+struct zram_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zram_hash *hash = zram_dedup_bucket(meta, checksum);
+	struct zram_entry *entry, *cur;
+	struct rb_node **rb_node, *parent = NULL;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->checksum = checksum;
+	entry->refcount = 1;
+	entry->handle = handle;
+	entry->len = len;
+
+	if (len == PAGE_SIZE) {
+		RB_CLEAR_NODE(&entry->rb_node);
+		return entry;
+	}
+
+	spin_lock(&hash->lock);
+	rb_node = &hash->rb_root.rb_node;
+	while (*rb_node) {
+		parent = *rb_node;
+		cur = rb_entry(parent, struct zram_entry, rb_node);
+		if (checksum < cur->checksum)
+			rb_node = &parent->rb_left;
+		else
+			rb_node = &parent->rb_right;
+	}
+	rb_link_node(&entry->rb_node, parent, rb_node);
+	rb_insert_color(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	return entry;
+}
+
+/* Drop a slot's reference, freeing the object with the last one */
+void zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_meta *meta = zram->meta;
+	struct zram_hash *hash = zram_dedup_bucket(meta, entry->checksum);
+	unsigned long refcount;
+
+	spin_lock(&hash->lock);
+	refcount = --entry->refcount;
+	if (!refcount && !RB_EMPTY_NODE(&entry->rb_node))
+		rb_erase(&entry->rb_node, &hash->rb_root);
+	spin_unlock(&hash->lock);
+
+	if (refcount) {
+		atomic64_sub(entry->len, &zram->stats.dup_data_size);
+		return;
+	}
+
+	zs_free(meta->mem_pool, entry->handle);
+	kfree(entry);
+}
+
+int zram_dedup_init(struct zram_meta *meta, size_t num_pages)
+{
+	size_t i;
+
+	meta->hash_size = clamp_t(size_t, num_pages >> ZRAM_HASH_SHIFT,
+				ZRAM_HASH_SIZE_MIN, ZRAM_HASH_SIZE_MAX);
+	meta->hash_size = rounddown_pow_of_two(meta->hash_size);
+	meta->hash = vmalloc(meta->hash_size * sizeof(*meta->hash));
+	if (!meta->hash) {
+		pr_err("Error allocating zram dedup hash\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < meta->hash_size; i++) {
+		spin_lock_init(&meta->hash[i].lock);
+		meta->hash[i].rb_root = RB_ROOT;
+	}
+
+	return 0;
+}
+
+/* All entries must have been put already */
+void zram_dedup_fini(struct zram_meta *meta)
+{
+	vfree(meta->hash);
+	meta->hash = NULL;
+	meta->hash_size = 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Compressed page deduplication for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+
+struct zram;
+struct zram_meta;
+
+/*
+ * A zsmalloc object shared by all slots holding the same compressed
+ * data. With deduplication enabled table.handle points to one of these
+ * instead of being the zsmalloc handle itself.
+ */
+struct zram_entry {
+	struct rb_node rb_node;
+	u32 checksum;
+	unsigned long refcount;	/* protected by the hash bucket lock */
+	unsigned long handle;	/* zsmalloc handle */
+	size_t len;		/* compressed length */
+};
+
+/* Bucket of the content hash index, entries sorted by checksum */
+struct zram_hash {
+	spinlock_t lock;
+	struct rb_root rb_root;
+};
+
+#ifdef CONFIG_ZRAM_DEDUP
+int zram_dedup_init(struct zram_meta *meta, size_t num_pages);
+void zram_dedup_fini(struct zram_meta *meta);
+
+u32 zram_dedup_checksum(const unsigned char *mem, size_t len);
+struct zram_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 checksum);
+struct zram_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum);
+void zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+#else
+static inline int zram_dedup_init(struct zram_meta *meta, size_t num_pages)
+{
+	return 0;
+}
+static inline void zram_dedup_fini(struct zram_meta *meta) {}
+
+static inline u32 zram_dedup_checksum(const unsigned char *mem, size_t len)
+{
+	return 0;
+}
+static inline struct zram_entry *zram_dedup_find(struct zram *zram,
+		const unsigned char *mem, size_t len, u32 checksum)
+{
+	return NULL;
+}
+static inline struct zram_entry *zram_dedup_insert(struct zram *zram,
+		unsigned long handle, size_t len, u32 checksum)
+{
+	return NULL;
+}
+static inline void zram_dedup_put(struct zram *zram,
+		struct zram_entry *entry) {}
+#endif
+
+#endif /* _ZRAM_DEDUP_H_ */
@@ -23,16 +23,18 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
-#include <linux/crypto.h>
-#include <linux/cpu.h>
+#include <linux/err.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -45,248 +47,281 @@ static struct zram *zram_devices;
 /* Module params (documentation at end) */
 static unsigned int num_devices = 1;
 
-/* Cryptographic API features */
+/* Default compression algorithm for new devices */
 static char *zram_compressor = ZRAM_COMPRESSOR_DEFAULT;
-static struct crypto_comp * __percpu *zram_comp_pcpu_tfms;
 
-enum comp_op {
-	ZRAM_COMPOP_COMPRESS,
-	ZRAM_COMPOP_DECOMPRESS
-};
-
-static int zram_comp_op(enum comp_op op, const u8 *src, unsigned int slen,
-			u8 *dst, unsigned int *dlen)
+static inline struct zram *dev_to_zram(struct device *dev)
 {
-	struct crypto_comp *tfm;
-	int ret;
+	return (struct zram *)dev_to_disk(dev)->private_data;
+}
 
-	tfm = *per_cpu_ptr(zram_comp_pcpu_tfms, get_cpu());
-	switch (op) {
-	case ZRAM_COMPOP_COMPRESS:
-		ret = crypto_comp_compress(tfm, src, slen, dst, dlen);
-		break;
-	case ZRAM_COMPOP_DECOMPRESS:
-		ret = crypto_comp_decompress(tfm, src, slen, dst, dlen);
-		break;
-	default:
-		ret = -EINVAL;
-	}
-	put_cpu();
+static ssize_t disksize_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
 
-	return ret;
+	return sprintf(buf, "%llu\n", zram->disksize);
 }
 
-static int __init zram_comp_init(void)
+static ssize_t initstate_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	int ret;
-	ret = crypto_has_comp(zram_compressor, 0, 0);
-	if (!ret) {
-		pr_info("%s is not available\n", zram_compressor);
-		zram_compressor = ZRAM_COMPRESSOR_DEFAULT;
-		ret = crypto_has_comp(zram_compressor, 0, 0);
-		if (!ret)
-			return -ENODEV;
-	}
-	pr_info("using %s compressor\n", zram_compressor);
-
-	/* alloc percpu transforms */
-	zram_comp_pcpu_tfms = alloc_percpu(struct crypto_comp *);
-	if (!zram_comp_pcpu_tfms)
-		return -ENOMEM;
+	struct zram *zram = dev_to_zram(dev);
 
-	return 0;
+	return sprintf(buf, "%u\n", zram->init_done);
 }
 
-static inline void zram_comp_exit(void)
+static ssize_t num_reads_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	/* free percpu transforms */
-	if (zram_comp_pcpu_tfms)
-		free_percpu(zram_comp_pcpu_tfms);
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+			(u64)atomic64_read(&zram->stats.num_reads));
 }
 
+static ssize_t num_writes_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
 
-/* Crypto API features: percpu code */
-#define ZRAM_DSTMEM_ORDER 1
-static DEFINE_PER_CPU(u8 *, zram_dstmem);
+	return sprintf(buf, "%llu\n",
+			(u64)atomic64_read(&zram->stats.num_writes));
+}
 
-static int zram_comp_cpu_up(int cpu)
+static ssize_t invalid_io_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct crypto_comp *tfm;
+	struct zram *zram = dev_to_zram(dev);
 
-	tfm = crypto_alloc_comp(zram_compressor, 0, 0);
-	if (IS_ERR(tfm))
-		return NOTIFY_BAD;
-	*per_cpu_ptr(zram_comp_pcpu_tfms, cpu) = tfm;
-	return NOTIFY_OK;
+	return sprintf(buf, "%llu\n",
+			(u64)atomic64_read(&zram->stats.invalid_io));
 }
 
-static void zram_comp_cpu_down(int cpu)
+static ssize_t notify_free_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct crypto_comp *tfm;
+	struct zram *zram = dev_to_zram(dev);
 
-	tfm = *per_cpu_ptr(zram_comp_pcpu_tfms, cpu);
-	crypto_free_comp(tfm);
-	*per_cpu_ptr(zram_comp_pcpu_tfms, cpu) = NULL;
+	return sprintf(buf, "%llu\n",
+			(u64)atomic64_read(&zram->stats.notify_free));
 }
 
-static int zram_cpu_notifier(struct notifier_block *nb,
-				unsigned long action, void *pcpu)
+static ssize_t same_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	int ret;
-	int cpu = (long) pcpu;
+	struct zram *zram = dev_to_zram(dev);
 
-	switch (action) {
-	case CPU_UP_PREPARE:
-		ret = zram_comp_cpu_up(cpu);
-		if (ret != NOTIFY_OK) {
-			pr_err("zram: can't allocate compressor xform\n");
-			return ret;
-		}
-		per_cpu(zram_dstmem, cpu) = (void *)__get_free_pages(
-			GFP_KERNEL | __GFP_REPEAT, ZRAM_DSTMEM_ORDER);
-		break;
-	case CPU_DEAD:
-	case CPU_UP_CANCELED:
-		zram_comp_cpu_down(cpu);
-		free_pages((unsigned long) per_cpu(zram_dstmem, cpu),
-			    ZRAM_DSTMEM_ORDER);
-		per_cpu(zram_dstmem, cpu) = NULL;
-		break;
-	default:
-		break;
-	}
-	return NOTIFY_OK;
+	return sprintf(buf, "%llu\n",
+			(u64)atomic64_read(&zram->stats.pages_same));
 }
 
-static struct notifier_block zram_cpu_notifier_block = {
-	.notifier_call = zram_cpu_notifier
-};
-
-/* Helper function releasing tfms from online cpus */
-static inline void zram_comp_cpus_down(void)
+static ssize_t dup_data_size_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	int cpu;
+	struct zram *zram = dev_to_zram(dev);
 
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		void *pcpu = (void *)(long)cpu;
-		zram_cpu_notifier(&zram_cpu_notifier_block,
-				  CPU_UP_CANCELED, pcpu);
-	}
-	put_online_cpus();
+	return sprintf(buf, "%llu\n",
+			(u64)atomic64_read(&zram->stats.dup_data_size));
 }
 
-static int zram_cpu_init(void)
+static ssize_t orig_data_size_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	int ret;
-	unsigned int cpu;
-
-	ret = register_cpu_notifier(&zram_cpu_notifier_block);
-	if (ret) {
-		pr_err("zram: can't register cpu notifier\n");
-		goto out;
-	}
+	struct zram *zram = dev_to_zram(dev);
 
-	get_online_cpus();
-	for_each_online_cpu(cpu) {
-		void *pcpu = (void *)(long)cpu;
-		if (zram_cpu_notifier(&zram_cpu_notifier_block,
-				      CPU_UP_PREPARE, pcpu) != NOTIFY_OK)
-			goto cleanup;
-	}
-	put_online_cpus();
-	return ret;
+	return sprintf(buf, "%llu\n",
+		(u64)atomic64_read(&zram->stats.pages_stored) << PAGE_SHIFT);
+}
 
-cleanup:
-	zram_comp_cpus_down();
+static ssize_t compr_data_size_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
 
-out:
-	put_online_cpus();
-	return -ENOMEM;
+	return sprintf(buf, "%llu\n",
+			(u64)atomic64_read(&zram->stats.compr_size));
 }
-/* end of Cryptographic API features */
 
-static inline struct zram *dev_to_zram(struct device *dev)
+static ssize_t max_comp_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	return (struct zram *)dev_to_disk(dev)->private_data;
+	int val;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	val = zram->max_comp_streams;
+	up_read(&zram->init_lock);
+
+	return sprintf(buf, "%d\n", val);
 }
 
-static ssize_t disksize_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static ssize_t max_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
 {
+	int num;
+	int ret;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n", zram->disksize);
+	ret = kstrtoint(buf, 0, &num);
+	if (ret)
+		return ret;
+	if (num < 1)
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (zram->init_done) {
+		ret = zcomp_set_max_streams(zram->comp, num);
+		if (ret) {
+			up_write(&zram->init_lock);
+			pr_info("Cannot change max compression streams\n");
+			return ret;
+		}
+	}
+	zram->max_comp_streams = num;
+	up_write(&zram->init_lock);
+
+	return len;
 }
 
-static ssize_t initstate_show(struct device *dev,
+static ssize_t comp_algorithm_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	size_t sz;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->init_done);
+	down_read(&zram->init_lock);
+	sz = zcomp_available_show(zram->compressor, buf);
+	up_read(&zram->init_lock);
+
+	return sz;
 }
 
-static ssize_t num_reads_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
 {
+	char compressor[CRYPTO_MAX_ALG_NAME];
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-			(u64)atomic64_read(&zram->stats.num_reads));
+	strlcpy(compressor, buf, sizeof(compressor));
+	/* ignore trailing newline */
+	strim(compressor);
+
+	if (!zcomp_available_algorithm(compressor))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (zram->init_done) {
+		up_write(&zram->init_lock);
+		pr_info("Cannot change algorithm for initialized device\n");
+		return -EBUSY;
+	}
+	strlcpy(zram->compressor, compressor, sizeof(zram->compressor));
+	up_write(&zram->init_lock);
+
+	return len;
 }
 
-static ssize_t num_writes_show(struct device *dev,
+#ifdef CONFIG_ZRAM_DEDUP
+static ssize_t use_dedup_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	bool val;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-			(u64)atomic64_read(&zram->stats.num_writes));
+	down_read(&zram->init_lock);
+	val = zram->use_dedup;
+	up_read(&zram->init_lock);
+
+	return sprintf(buf, "%d\n", (int)val);
 }
 
-static ssize_t invalid_io_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
 {
+	int val;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-			(u64)atomic64_read(&zram->stats.invalid_io));
+	if (kstrtoint(buf, 10, &val) || (val != 0 && val != 1))
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	if (zram->init_done) {
+		up_write(&zram->init_lock);
+		pr_info("Cannot change dedup for initialized device\n");
+		return -EBUSY;
+	}
+	zram->use_dedup = val;
+	up_write(&zram->init_lock);
+
+	return len;
 }
+#endif
 
-static ssize_t notify_free_show(struct device *dev,
+static ssize_t mem_limit_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	u64 val;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-			(u64)atomic64_read(&zram->stats.notify_free));
+	down_read(&zram->init_lock);
+	val = zram->limit_pages;
+	up_read(&zram->init_lock);
+
+	return sprintf(buf, "%llu\n", val << PAGE_SHIFT);
 }
 
-static ssize_t zero_pages_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+static ssize_t mem_limit_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
 {
+	u64 limit;
+	char *tmp;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	limit = memparse(buf, &tmp);
+	if (buf == tmp) /* no chars parsed, invalid input */
+		return -EINVAL;
+
+	down_write(&zram->init_lock);
+	zram->limit_pages = PAGE_ALIGN(limit) >> PAGE_SHIFT;
+	up_write(&zram->init_lock);
+
+	return len;
 }
 
-static ssize_t orig_data_size_show(struct device *dev,
+static ssize_t mem_used_max_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
+	u64 val = 0;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-		(u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+	down_read(&zram->init_lock);
+	if (zram->init_done)
+		val = atomic64_read(&zram->stats.max_used_pages);
+	up_read(&zram->init_lock);
+
+	return sprintf(buf, "%llu\n", val << PAGE_SHIFT);
 }
 
-static ssize_t compr_data_size_show(struct device *dev,
-		struct device_attribute *attr, char *buf)
+/* Writing 0 restarts the watermark from the current usage */
+static ssize_t mem_used_max_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
 {
+	int err;
+	unsigned long val;
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%llu\n",
-			(u64)atomic64_read(&zram->stats.compr_size));
+	err = kstrtoul(buf, 10, &val);
+	if (err || val != 0)
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (zram->init_done)
+		atomic64_set(&zram->stats.max_used_pages,
+				zs_get_total_pages(zram->meta->mem_pool));
+	up_read(&zram->init_lock);
+
+	return len;
 }
 
 static ssize_t mem_used_total_show(struct device *dev,
@@ -304,22 +339,79 @@ static ssize_t mem_used_total_show(struct device *dev,
 	return sprintf(buf, "%llu\n", val);
 }
 
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	if (!zram->init_done) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+	zs_compact(zram->meta->mem_pool);
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t compacted_pages_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	unsigned long val = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	down_read(&zram->init_lock);
+	if (zram->init_done)
+		val = zs_get_compacted_pages(zram->meta->mem_pool);
+	up_read(&zram->init_lock);
+
+	return sprintf(buf, "%lu\n", val);
+}
+
+/*
+ * Table entries are protected by a bit spinlock embedded in their
+ * flags, so that I/O on different slots never contends.
+ */
+static void zram_lock_slot(struct zram_meta *meta, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
+static void zram_unlock_slot(struct zram_meta *meta, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &meta->table[index].value);
+}
+
 static int zram_test_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
-	return meta->table[index].flags & BIT(flag);
+	return meta->table[index].value & BIT(flag);
 }
 
 static void zram_set_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
-	meta->table[index].flags |= BIT(flag);
+	meta->table[index].value |= BIT(flag);
 }
 
 static void zram_clear_flag(struct zram_meta *meta, u32 index,
 			enum zram_pageflags flag)
 {
-	meta->table[index].flags &= ~BIT(flag);
+	meta->table[index].value &= ~BIT(flag);
+}
+
+static size_t zram_get_obj_size(struct zram_meta *meta, u32 index)
+{
+	return meta->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
+}
+
+static void zram_set_obj_size(struct zram_meta *meta, u32 index,
+			size_t size)
+{
+	unsigned long flags = meta->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	meta->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
 static inline int is_partial_io(struct bio_vec *bvec)
@@ -353,15 +445,16 @@ static inline int valid_io_request(struct zram *zram, struct bio *bio)
 
 static void zram_meta_free(struct zram_meta *meta)
 {
+	zram_dedup_fini(meta);
 	zs_destroy_pool(meta->mem_pool);
 	vfree(meta->table);
 	kfree(meta);
 }
 
-static struct zram_meta *zram_meta_alloc(u64 disksize)
+static struct zram_meta *zram_meta_alloc(u64 disksize, bool use_dedup)
 {
 	size_t num_pages;
-	struct zram_meta *meta = kmalloc(sizeof(*meta), GFP_KERNEL);
+	struct zram_meta *meta = kzalloc(sizeof(*meta), GFP_KERNEL);
 	if (!meta)
 		goto out;
 
@@ -372,14 +465,20 @@ static struct zram_meta *zram_meta_alloc(u64 disksize)
 		goto free_meta;
 	}
 
-	meta->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
+	meta->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM | __GFP_MOVABLE,
+					NULL);
 	if (!meta->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		goto free_table;
 	}
 
+	if (use_dedup && zram_dedup_init(meta, num_pages))
+		goto free_pool;
+
 	return meta;
 
+free_pool:
+	zs_destroy_pool(meta->mem_pool);
 free_table:
 	vfree(meta->table);
 free_meta:
@@ -389,6 +488,186 @@ out:
 	return meta;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+struct zram_bio_wait {
+	struct completion done;
+	int error;
+};
+
+static void zram_bdev_end_io(struct bio *bio, int err)
+{
+	struct zram_bio_wait *wait = bio->bi_private;
+
+	if (!err && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+	wait->error = err;
+	complete(&wait->done);
+}
+
+/* Synchronously read or write one page at backing device block blk */
+static int zram_bdev_rw(struct zram *zram, int rw, unsigned long blk,
+			struct page *page)
+{
+	struct zram_bio_wait wait;
+	struct bio *bio;
+	sector_t sector;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	if (zram->bd_bmap)
+		sector = zram->bd_bmap[blk] << SECTORS_PER_PAGE_SHIFT;
+	else
+		sector = (sector_t)blk << SECTORS_PER_PAGE_SHIFT;
+
+	init_completion(&wait.done);
+	bio->bi_sector = sector;
+	bio->bi_bdev = zram->bdev;
+	bio->bi_io_vec[0].bv_page = page;
+	bio->bi_io_vec[0].bv_len = PAGE_SIZE;
+	bio->bi_io_vec[0].bv_offset = 0;
+	bio->bi_vcnt = 1;
+	bio->bi_idx = 0;
+	bio->bi_size = PAGE_SIZE;
+	bio->bi_private = &wait;
+	bio->bi_end_io = zram_bdev_end_io;
+
+	submit_bio(rw | REQ_SYNC, bio);
+	wait_for_completion(&wait.done);
+	bio_put(bio);
+
+	if (rw == READ)
+		atomic64_inc(&zram->stats.bd_reads);
+	else
+		atomic64_inc(&zram->stats.bd_writes);
+	return wait.error;
+}
+
+struct zram_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int error;
+};
+
+static void zram_sync_read(struct work_struct *work)
+{
+	struct zram_work *zw = container_of(work, struct zram_work, work);
+
+	zw->error = zram_bdev_rw(zw->zram, READ, zw->blk, zw->page);
+}
+
+/*
+ * Reads come from zram_make_request(), where current->bio_list only
+ * queues a bio until we return, so waiting for it there never ends.
+ * Submit it from a worker instead and wait for that.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			unsigned long blk)
+{
+	struct zram_work work;
+
+	work.zram = zram;
+	work.page = page;
+	work.blk = blk;
+	INIT_WORK_ONSTACK(&work.work, zram_sync_read);
+	queue_work(system_unbound_wq, &work.work);
+	flush_work(&work.work);
+	destroy_work_on_stack(&work.work);
+
+	return work.error;
+}
+
+/* Block 0 is reserved so that a zero handle always means "empty" */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->bitmap_lock);
+	blk = find_next_zero_bit(zram->bitmap, zram->nr_bd_pages, 1);
+	if (blk >= zram->nr_bd_pages)
+		blk = 0;
+	else
+		set_bit(blk, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+
+	return blk;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bitmap_lock);
+	WARN_ON_ONCE(!test_bit(blk, zram->bitmap));
+	clear_bit(blk, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+}
+
+/*
+ * A regular file is accessed through a block map of its pages, the same
+ * way vnswap does it, so it must be fully allocated and use page sized
+ * blocks.
+ */
+static sector_t *zram_bdev_bmap(struct inode *inode, unsigned long nr_pages)
+{
+	sector_t *bmap_table;
+	unsigned long i;
+
+	if (inode->i_blkbits != PAGE_SHIFT) {
+		pr_err("backing file block size is not PAGE_SIZE\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	bmap_table = vmalloc(nr_pages * sizeof(sector_t));
+	if (!bmap_table)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < nr_pages; i++) {
+		bmap_table[i] = bmap(inode, i);
+		if (!bmap_table[i]) {
+			pr_err("backing file has holes\n");
+			vfree(bmap_table);
+			return ERR_PTR(-EINVAL);
+		}
+	}
+	return bmap_table;
+}
+
+/* Caller must hold init_lock for writing */
+static void zram_reset_bdev(struct zram *zram)
+{
+	struct inode *inode;
+
+	if (!zram->backing_dev)
+		return;
+
+	inode = zram->backing_dev->f_mapping->host;
+	if (S_ISBLK(inode->i_mode))
+		blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	else
+		inode->i_flags &= ~S_IMMUTABLE;
+	filp_close(zram->backing_dev, NULL);
+
+	vfree(zram->bd_bmap);
+	vfree(zram->bitmap);
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->bd_bmap = NULL;
+	zram->bitmap = NULL;
+	zram->nr_bd_pages = 0;
+}
+#else
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			unsigned long blk)
+{
+	return -EIO;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk) {}
+static void zram_reset_bdev(struct zram *zram) {}
+#endif
+
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
 	if (*offset + bvec->bv_len >= PAGE_SIZE)
@@ -396,91 +675,209 @@ static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Check whether the page is filled with a single repeated word, e.g.
+ * all zeroes or a memset() pattern, and return that word in element.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != val)
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void zram_fill_page(void *ptr, unsigned long len,
+			unsigned long element)
+{
+	unsigned long *page = ptr;
+	unsigned long pos;
+
+	if (!element) {
+		memset(ptr, 0, len);
+		return;
+	}
+
+	for (pos = 0; pos < len / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
+	/* bv_offset is sector aligned, so the pattern stays in phase */
 	user_mem = kmap_atomic(page);
-	if (is_partial_io(bvec))
-		memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
-	else
-		clear_page(user_mem);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
 }
 
+/*
+ * zsmalloc handle of a slot holding compressed data. With dedup the
+ * slot references a shared zram_entry instead.
+ */
+static unsigned long zram_get_handle(struct zram_meta *meta, u32 index)
+{
+	unsigned long handle = meta->table[index].handle;
+
+	if (zram_dedup_enabled(meta))
+		return ((struct zram_entry *)handle)->handle;
+	return handle;
+}
+
+/* Caller must hold the slot lock */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	struct zram_meta *meta = zram->meta;
 	unsigned long handle = meta->table[index].handle;
-	u16 size = meta->table[index].size;
+	size_t size = zram_get_obj_size(meta, index);
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(meta, index, ZRAM_ZERO)) {
-			zram_clear_flag(meta, index, ZRAM_ZERO);
-			zram->stats.pages_zero--;
-		}
+	zram_clear_flag(meta, index, ZRAM_IDLE);
+
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		zram_clear_flag(meta, index, ZRAM_WB);
+		/* a reader still uses the block, it frees it when done */
+		if (!zram_test_flag(meta, index, ZRAM_UNDER_READ))
+			zram_free_block(zram, handle);
+		atomic64_dec(&zram->stats.bd_count);
+		meta->table[index].handle = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(meta, index, ZRAM_SAME)) {
+		zram_clear_flag(meta, index, ZRAM_SAME);
+		atomic64_dec(&zram->stats.pages_same);
+		meta->table[index].handle = 0;
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
 	if (unlikely(size > max_zpage_size))
-		zram->stats.bad_compress--;
+		atomic64_dec(&zram->stats.bad_compress);
 
-	zs_free(meta->mem_pool, handle);
+	if (zram_dedup_enabled(meta))
+		zram_dedup_put(zram, (struct zram_entry *)handle);
+	else
+		zs_free(meta->mem_pool, handle);
 
 	if (size <= PAGE_SIZE / 2)
-		zram->stats.good_compress--;
+		atomic64_dec(&zram->stats.good_compress);
 
-	atomic64_sub(meta->table[index].size, &zram->stats.compr_size);
-	zram->stats.pages_stored--;
+	atomic64_sub(size, &zram->stats.compr_size);
+	atomic64_dec(&zram->stats.pages_stored);
 
 	meta->table[index].handle = 0;
-	meta->table[index].size = 0;
+	zram_set_obj_size(meta, index, 0);
 }
 
-static int zram_decompress_page(struct zram *zram, char *mem, u32 index)
+static int zram_bit_wait(void *word)
+{
+	io_schedule();
+	return 0;
+}
+
+/*
+ * Reads the page stored on the backing device at block blk for slot
+ * index, which the caller marked ZRAM_UNDER_READ. The slot may be freed
+ * or written to while we sleep, but the block is not released until we
+ * are done with it.
+ */
+static int zram_read_slot_from_bdev(struct zram *zram, struct page *page,
+				    u32 index, unsigned long blk)
 {
-	int ret = 0;
-	size_t clen = PAGE_SIZE;
-	unsigned char *cmem;
 	struct zram_meta *meta = zram->meta;
-	unsigned long handle = meta->table[index].handle;
+	int ret;
+
+	ret = zram_read_from_bdev(zram, page, blk);
+
+	zram_lock_slot(meta, index);
+	zram_clear_flag(meta, index, ZRAM_UNDER_READ);
+	if (!zram_test_flag(meta, index, ZRAM_WB) ||
+			meta->table[index].handle != blk)
+		zram_free_block(zram, blk);
+	zram_unlock_slot(meta, index);
 
-	if (!handle || zram_test_flag(meta, index, ZRAM_ZERO)) {
-		clear_page(mem);
+	smp_mb();
+	wake_up_bit(&meta->table[index].value, ZRAM_UNDER_READ);
+	return ret;
+}
+
+static int zram_decompress_page(struct zram *zram, struct page *page,
+				u32 index)
+{
+	int ret = 0;
+	unsigned char *cmem, *mem;
+	struct zram_meta *meta = zram->meta;
+	struct zcomp_strm *zstrm;
+	unsigned long handle;
+	size_t size;
+
+again:
+	/* Finding a stream may sleep, so do it before taking the slot */
+	zstrm = zcomp_strm_find(zram->comp);
+	zram_lock_slot(meta, index);
+	handle = meta->table[index].handle;
+	size = zram_get_obj_size(meta, index);
+
+	if (!handle || zram_test_flag(meta, index, ZRAM_SAME)) {
+		zram_unlock_slot(meta, index);
+		zcomp_strm_release(zram->comp, zstrm);
+		mem = kmap_atomic(page);
+		zram_fill_page(mem, PAGE_SIZE, handle);
+		kunmap_atomic(mem);
 		return 0;
 	}
 
+	if (zram_test_flag(meta, index, ZRAM_WB)) {
+		/* handle is the backing device block, see writeback_store */
+		if (zram_test_flag(meta, index, ZRAM_UNDER_READ)) {
+			/* one reader at a time, then look at the slot again */
+			zram_unlock_slot(meta, index);
+			zcomp_strm_release(zram->comp, zstrm);
+			wait_on_bit(&meta->table[index].value, ZRAM_UNDER_READ,
+				    zram_bit_wait, TASK_UNINTERRUPTIBLE);
+			goto again;
+		}
+		zram_set_flag(meta, index, ZRAM_UNDER_READ);
+		zram_unlock_slot(meta, index);
+		zcomp_strm_release(zram->comp, zstrm);
+		ret = zram_read_slot_from_bdev(zram, page, index, handle);
+		goto out;
+	}
+
+	handle = zram_get_handle(meta, index);
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_RO);
-	if (meta->table[index].size == PAGE_SIZE)
+	mem = kmap_atomic(page);
+	if (size == PAGE_SIZE)
 		copy_page(mem, cmem);
 	else
-		ret = zram_comp_op(ZRAM_COMPOP_DECOMPRESS, cmem,
-			meta->table[index].size, mem, &clen);
+		ret = zcomp_decompress(zstrm, cmem, size, mem);
+	kunmap_atomic(mem);
 
 	zs_unmap_object(meta->mem_pool, handle);
+	zram_unlock_slot(meta, index);
+	zcomp_strm_release(zram->comp, zstrm);
 
+out:
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret != 0)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
@@ -496,78 +893,101 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 {
 	int ret;
 	struct page *page;
-	unsigned char *user_mem, *uncmem = NULL;
+	unsigned char *user_mem, *uncmem;
+	unsigned long element;
 	struct zram_meta *meta = zram->meta;
 	page = bvec->bv_page;
 
+	zram_lock_slot(meta, index);
+	zram_clear_flag(meta, index, ZRAM_IDLE);
 	if (unlikely(!meta->table[index].handle) ||
-			zram_test_flag(meta, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+			zram_test_flag(meta, index, ZRAM_SAME)) {
+		element = meta->table[index].handle;
+		zram_unlock_slot(meta, index);
+		handle_same_page(bvec, element);
 		return 0;
 	}
+	zram_unlock_slot(meta, index);
 
-	if (is_partial_io(bvec))
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
-
-	user_mem = kmap_atomic(page);
-	if (!is_partial_io(bvec))
-		uncmem = user_mem;
-
-	if (!uncmem) {
-		pr_info("Unable to allocate temp memory\n");
-		ret = -ENOMEM;
-		goto out_cleanup;
+	if (is_partial_io(bvec)) {
+		/* Use a temporary page to decompress the page */
+		page = alloc_page(GFP_NOIO);
+		if (!page) {
+			pr_info("Unable to allocate temp memory\n");
+			return -ENOMEM;
+		}
 	}
 
-	ret = zram_decompress_page(zram, uncmem, index);
+	ret = zram_decompress_page(zram, page, index);
 	/* Should NEVER happen. Return bio error if it does. */
 	if (unlikely(ret != 0))
 		goto out_cleanup;
 
-	if (is_partial_io(bvec))
+	if (is_partial_io(bvec)) {
+		user_mem = kmap_atomic(bvec->bv_page);
+		uncmem = kmap_atomic(page);
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 				bvec->bv_len);
+		kunmap_atomic(uncmem);
+		kunmap_atomic(user_mem);
+	}
 
-	flush_dcache_page(page);
-	ret = 0;
+	flush_dcache_page(bvec->bv_page);
 out_cleanup:
-	kunmap_atomic(user_mem);
 	if (is_partial_io(bvec))
-		kfree(uncmem);
+		__free_page(page);
 	return ret;
 }
 
+static void update_used_max(struct zram *zram, const unsigned long pages)
+{
+	u64 old_max, cur_max;
+
+	old_max = atomic64_read(&zram->stats.max_used_pages);
+
+	do {
+		cur_max = old_max;
+		if (pages > cur_max)
+			old_max = atomic64_cmpxchg(
+				&zram->stats.max_used_pages, cur_max, pages);
+	} while (old_max != cur_max);
+}
+
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret = 0;
 	size_t clen;
-	unsigned long handle;
+	unsigned long handle, element, alloced_pages;
 	struct page *page;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 	struct zram_meta *meta = zram->meta;
+	struct zcomp_strm *zstrm = NULL;
+	struct page *tmp_page = NULL;
+	struct zram_entry *entry;
+	u32 checksum = 0;
 
 	page = bvec->bv_page;
-	src = __get_cpu_var(zram_dstmem);
-	BUG_ON(src == NULL);
 
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
-		if (!uncmem) {
+		tmp_page = alloc_page(GFP_NOIO);
+		if (!tmp_page) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_decompress_page(zram, uncmem, index);
+		ret = zram_decompress_page(zram, tmp_page, index);
 		if (ret)
 			goto out;
+		uncmem = page_address(tmp_page);
 	}
 
+	zstrm = zcomp_strm_find(zram->comp);
+	src = zstrm->buffer;
 	user_mem = kmap_atomic(page);
 
 	if (is_partial_io(bvec)) {
@@ -579,27 +999,22 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		uncmem = user_mem;
 	}
 
-	if (page_zero_filled(uncmem)) {
-		kunmap_atomic(user_mem);
+	if (page_same_filled(uncmem, &element)) {
+		if (!is_partial_io(bvec))
+			kunmap_atomic(user_mem);
 		/* Free memory associated with this sector now. */
+		zram_lock_slot(meta, index);
 		zram_free_page(zram, index);
+		zram_set_flag(meta, index, ZRAM_SAME);
+		meta->table[index].handle = element;
+		zram_unlock_slot(meta, index);
 
-		zram->stats.pages_zero++;
-		zram_set_flag(meta, index, ZRAM_ZERO);
+		atomic64_inc(&zram->stats.pages_same);
 		ret = 0;
 		goto out;
 	}
-	
-	/*
-	 * zram_slot_free_notify could miss free so that let's
-	 * double check.
-	 */
-	if (unlikely(meta->table[index].handle ||
-			zram_test_flag(meta, index, ZRAM_ZERO)))
-		zram_free_page(zram, index);
 
-	ret = zram_comp_op(ZRAM_COMPOP_COMPRESS, uncmem,
-			   PAGE_SIZE, src, &clen);
+	ret = zcomp_compress(zstrm, uncmem, &clen);
 
 	if (!is_partial_io(bvec)) {
 		kunmap_atomic(user_mem);
@@ -613,11 +1028,17 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	}
 
 	if (unlikely(clen > max_zpage_size)) {
-		zram->stats.bad_compress++;
 		clen = PAGE_SIZE;
 		src = NULL;
 		if (is_partial_io(bvec))
 			src = uncmem;
+	} else if (zram_dedup_enabled(meta)) {
+		checksum = zram_dedup_checksum(src, clen);
+		entry = zram_dedup_find(zram, src, clen, checksum);
+		if (entry) {
+			handle = (unsigned long)entry;
+			goto found;
+		}
 	}
 
 	handle = zs_malloc(meta->mem_pool, clen);
@@ -627,6 +1048,15 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = -ENOMEM;
 		goto out;
 	}
+
+	alloced_pages = zs_get_total_pages(meta->mem_pool);
+	if (zram->limit_pages && alloced_pages > zram->limit_pages) {
+		zs_free(meta->mem_pool, handle);
+		ret = -ENOMEM;
+		goto out;
+	}
+	update_used_max(zram, alloced_pages);
+
 	cmem = zs_map_object(meta->mem_pool, handle, ZS_MM_WO);
 
 	if ((clen == PAGE_SIZE) && !is_partial_io(bvec)) {
@@ -639,73 +1069,339 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	zs_unmap_object(meta->mem_pool, handle);
 
+	if (zram_dedup_enabled(meta)) {
+		entry = zram_dedup_insert(zram, handle, clen, checksum);
+		if (!entry) {
+			zs_free(meta->mem_pool, handle);
+			ret = -ENOMEM;
+			goto out;
+		}
+		handle = (unsigned long)entry;
+	}
+
+found:
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
+
 	/*
 	 * Free memory associated with this sector
 	 * before overwriting unused sectors.
 	 */
+	zram_lock_slot(meta, index);
 	zram_free_page(zram, index);
 
 	meta->table[index].handle = handle;
-	meta->table[index].size = clen;
+	zram_set_obj_size(meta, index, clen);
+	zram_unlock_slot(meta, index);
 
 	/* Update stats */
 	atomic64_add(clen, &zram->stats.compr_size);
-	zram->stats.pages_stored++;
+	atomic64_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
-		zram->stats.good_compress++;
+		atomic64_inc(&zram->stats.good_compress);
+	else if (clen > max_zpage_size)
+		atomic64_inc(&zram->stats.bad_compress);
 
 out:
-	if (is_partial_io(bvec))
-		kfree(uncmem);
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (tmp_page)
+		__free_page(tmp_page);
 
 	if (ret)
 		atomic64_inc(&zram->stats.failed_writes);
 	return ret;
 }
 
-static void handle_pending_slot_free(struct zram *zram)
+static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
+			int offset, struct bio *bio, int rw)
+{
+	int ret;
+
+	if (rw == READ)
+		ret = zram_bvec_read(zram, bvec, index, offset, bio);
+	else
+		ret = zram_bvec_write(zram, bvec, index, offset);
+
+	return ret;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
 {
-	struct zram_slot_free *free_rq;
+	struct zram *zram = dev_to_zram(dev);
+	char *p;
+	ssize_t ret;
+
+	down_read(&zram->init_lock);
+	if (!zram->backing_dev) {
+		up_read(&zram->init_lock);
+		return sprintf(buf, "none\n");
+	}
 
-	spin_lock(&zram->slot_free_lock);
-	while (zram->slot_free_rq) {
-		free_rq = zram->slot_free_rq;
-		zram->slot_free_rq = free_rq->next;
-		zram_free_page(zram, free_rq->index);
-		kfree(free_rq);
+	p = d_path(&zram->backing_dev->f_path, buf, PAGE_SIZE - 1);
+	if (IS_ERR(p)) {
+		ret = PTR_ERR(p);
+	} else {
+		ret = strlen(p);
+		memmove(buf, p, ret);
+		buf[ret++] = '\n';
 	}
-	spin_unlock(&zram->slot_free_lock);
+	up_read(&zram->init_lock);
+
+	return ret;
 }
 
-static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
-			int offset, struct bio *bio, int rw)
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
 {
-	int ret;
+	struct zram *zram = dev_to_zram(dev);
+	char *file_name;
+	struct file *backing_dev;
+	struct inode *inode;
+	struct block_device *bdev = NULL;
+	sector_t *bd_bmap = NULL;
+	unsigned long *bitmap;
+	unsigned long nr_pages;
+	int err;
+
+	file_name = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!file_name)
+		return -ENOMEM;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
-		handle_pending_slot_free(zram);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
+	strlcpy(file_name, buf, PATH_MAX);
+	/* ignore trailing newline */
+	strim(file_name);
+
+	down_write(&zram->init_lock);
+	if (zram->init_done || zram->backing_dev) {
+		pr_info("Cannot change backing device for initialized device\n");
+		err = -EBUSY;
+		goto out;
+	}
+
+	backing_dev = filp_open(file_name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev)) {
+		err = PTR_ERR(backing_dev);
+		goto out;
+	}
+
+	inode = backing_dev->f_mapping->host;
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		err = -EINVAL;
+		goto close_file;
+	}
+
+	if (S_ISBLK(inode->i_mode)) {
+		bdev = bdgrab(I_BDEV(inode));
+		err = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				zram);
+		if (err < 0)
+			goto close_file;
+	} else if (S_ISREG(inode->i_mode)) {
+		bd_bmap = zram_bdev_bmap(inode, nr_pages);
+		if (IS_ERR(bd_bmap)) {
+			err = PTR_ERR(bd_bmap);
+			goto close_file;
+		}
+		bdev = inode->i_sb->s_bdev;
+		inode->i_flags |= S_IMMUTABLE;
 	} else {
-		down_write(&zram->lock);
-		handle_pending_slot_free(zram);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
+		err = -ENOTBLK;
+		goto close_file;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		err = -ENOMEM;
+		goto put_bdev;
+	}
+	/* block 0 is reserved, see zram_alloc_block() */
+	set_bit(0, bitmap);
+
+	zram->backing_dev = backing_dev;
+	zram->bdev = bdev;
+	zram->bd_bmap = bd_bmap;
+	zram->bitmap = bitmap;
+	zram->nr_bd_pages = nr_pages;
+	up_write(&zram->init_lock);
+
+	pr_info("setup backing device %s\n", file_name);
+	kfree(file_name);
+
+	return len;
+
+put_bdev:
+	if (S_ISBLK(inode->i_mode)) {
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	} else {
+		inode->i_flags &= ~S_IMMUTABLE;
+		vfree(bd_bmap);
+	}
+close_file:
+	filp_close(backing_dev, NULL);
+out:
+	up_write(&zram->init_lock);
+	kfree(file_name);
+
+	return err;
+}
+
+/*
+ * Writing "all" marks every stored slot idle. Any later access to a slot
+ * clears the mark, so what is still idle at writeback time was not used
+ * in between.
+ */
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages, index;
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!zram->init_done) {
+		up_read(&zram->init_lock);
+		return -EINVAL;
+	}
+
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		zram_lock_slot(meta, index);
+		if (meta->table[index].handle &&
+				!zram_test_flag(meta, index, ZRAM_SAME) &&
+				!zram_test_flag(meta, index, ZRAM_WB))
+			zram_set_flag(meta, index, ZRAM_IDLE);
+		zram_unlock_slot(meta, index);
+	}
+	up_read(&zram->init_lock);
+
+	return len;
+}
+
+/*
+ * Move slots to the backing device: "huge" writes back the pages that
+ * did not compress and are stored as a full page, "idle" those marked
+ * by idle_store() and not accessed since.
+ */
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zram_meta *meta;
+	unsigned long nr_pages, index, blk = 0;
+	struct page *page;
+	bool huge;
+	ssize_t ret = len;
+	int err;
+
+	if (sysfs_streq(buf, "huge"))
+		huge = true;
+	else if (sysfs_streq(buf, "idle"))
+		huge = false;
+	else
+		return -EINVAL;
+
+	down_read(&zram->init_lock);
+	if (!zram->init_done || !zram->backing_dev) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
+	meta = zram->meta;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages; index++) {
+		if (!blk) {
+			blk = zram_alloc_block(zram);
+			if (!blk) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
+
+		zram_lock_slot(meta, index);
+		if (!meta->table[index].handle ||
+				zram_test_flag(meta, index, ZRAM_SAME) ||
+				zram_test_flag(meta, index, ZRAM_WB) ||
+				zram_test_flag(meta, index, ZRAM_UNDER_WB))
+			goto next;
+		if (huge && zram_get_obj_size(meta, index) != PAGE_SIZE)
+			goto next;
+		if (!huge && !zram_test_flag(meta, index, ZRAM_IDLE))
+			goto next;
+		/*
+		 * Any access while the page is being written clears
+		 * ZRAM_IDLE and makes us drop the copy on the device.
+		 */
+		zram_set_flag(meta, index, ZRAM_UNDER_WB);
+		zram_set_flag(meta, index, ZRAM_IDLE);
+		zram_unlock_slot(meta, index);
+
+		err = zram_decompress_page(zram, page, index);
+		if (!err)
+			err = zram_bdev_rw(zram, WRITE, blk, page);
+
+		zram_lock_slot(meta, index);
+		zram_clear_flag(meta, index, ZRAM_UNDER_WB);
+		if (err) {
+			zram_clear_flag(meta, index, ZRAM_IDLE);
+			ret = err;
+			goto next;
+		}
+		if (!zram_test_flag(meta, index, ZRAM_IDLE))
+			goto next;
+
+		zram_free_page(zram, index);
+		zram_set_flag(meta, index, ZRAM_WB);
+		meta->table[index].handle = blk;
+		blk = 0;
+		atomic64_inc(&zram->stats.bd_count);
+next:
+		zram_unlock_slot(meta, index);
+	}
+
+	if (blk)
+		zram_free_block(zram, blk);
+	__free_page(page);
+out:
+	up_read(&zram->init_lock);
+
 	return ret;
 }
 
+static ssize_t bd_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%8llu %8llu %8llu\n",
+			(u64)atomic64_read(&zram->stats.bd_count),
+			(u64)atomic64_read(&zram->stats.bd_reads),
+			(u64)atomic64_read(&zram->stats.bd_writes));
+}
+#endif
+
 static void zram_reset_device(struct zram *zram, bool reset_capacity)
 {
 	size_t index;
 	struct zram_meta *meta;
 
-	flush_work(&zram->free_work);
-
 	down_write(&zram->init_lock);
 	if (!zram->init_done) {
+		/* a backing device can be set before disksize */
+		zram_reset_bdev(zram);
 		up_write(&zram->init_lock);
 		return;
 	}
@@ -716,24 +1412,33 @@ static void zram_reset_device(struct zram *zram, bool reset_capacity)
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		unsigned long handle = meta->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(meta, index, ZRAM_SAME) ||
+				zram_test_flag(meta, index, ZRAM_WB))
 			continue;
 
-		zs_free(meta->mem_pool, handle);
+		if (zram_dedup_enabled(meta))
+			zram_dedup_put(zram, (struct zram_entry *)handle);
+		else
+			zs_free(meta->mem_pool, handle);
 	}
 
 	zram_meta_free(zram->meta);
 	zram->meta = NULL;
+	zcomp_destroy(zram->comp);
+	zram->comp = NULL;
+	zram_reset_bdev(zram);
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
 	zram->disksize = 0;
+	zram->limit_pages = 0;
 	if (reset_capacity)
 		set_capacity(zram->disk, 0);
 	up_write(&zram->init_lock);
 }
 
-static void zram_init_device(struct zram *zram, struct zram_meta *meta)
+static void zram_init_device(struct zram *zram, struct zram_meta *meta,
+			struct zcomp *comp)
 {
 	if (zram->disksize > 2 * (totalram_pages << PAGE_SHIFT)) {
 		pr_info(
@@ -753,6 +1458,7 @@ static void zram_init_device(struct zram *zram, struct zram_meta *meta)
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
 	zram->meta = meta;
+	zram->comp = comp;
 	zram->init_done = 1;
 
 	pr_debug("Initialization done!\n");
@@ -763,28 +1469,45 @@ static ssize_t disksize_store(struct device *dev,
 {
 	u64 disksize;
 	struct zram_meta *meta;
+	struct zcomp *comp;
 	struct zram *zram = dev_to_zram(dev);
+	int err;
 
 	disksize = memparse(buf, NULL);
 	if (!disksize)
 		return -EINVAL;
 
 	disksize = PAGE_ALIGN(disksize);
-	meta = zram_meta_alloc(disksize);
+	meta = zram_meta_alloc(disksize, zram->use_dedup);
+	if (!meta)
+		return -ENOMEM;
+
 	down_write(&zram->init_lock);
 	if (zram->init_done) {
-		up_write(&zram->init_lock);
-		zram_meta_free(meta);
 		pr_info("Cannot change disksize for initialized device\n");
-		return -EBUSY;
+		err = -EBUSY;
+		goto out_free_meta;
+	}
+
+	comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (IS_ERR(comp)) {
+		pr_info("Cannot initialise %s compressing backend\n",
+				zram->compressor);
+		err = PTR_ERR(comp);
+		goto out_free_meta;
 	}
 
 	zram->disksize = disksize;
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
-	zram_init_device(zram, meta);
+	zram_init_device(zram, meta, comp);
 	up_write(&zram->init_lock);
 
 	return len;
+
+out_free_meta:
+	up_write(&zram->init_lock);
+	zram_meta_free(meta);
+	return err;
 }
 
 static ssize_t reset_store(struct device *dev,
@@ -898,40 +1621,23 @@ error:
 	bio_io_error(bio);
 }
 
-static void zram_slot_free(struct work_struct *work)
-{
-	struct zram *zram;
-
-	zram = container_of(work, struct zram, free_work);
-	down_write(&zram->lock);
-	handle_pending_slot_free(zram);
-	up_write(&zram->lock);
-}
-
-static void add_slot_free(struct zram *zram, struct zram_slot_free *free_rq)
-{
-	spin_lock(&zram->slot_free_lock);
-	free_rq->next = zram->slot_free_rq;
-	zram->slot_free_rq = free_rq;
-	spin_unlock(&zram->slot_free_lock);
-}
-
+/*
+ * Called from the swap code with swap_lock held. The slot lock is a
+ * spinlock, so the slot can be released right away.
+ */
 static void zram_slot_free_notify(struct block_device *bdev,
 				unsigned long index)
 {
 	struct zram *zram;
-	struct zram_slot_free *free_rq;
+	struct zram_meta *meta;
 
 	zram = bdev->bd_disk->private_data;
-	atomic64_inc(&zram->stats.notify_free);
-
-	free_rq = kmalloc(sizeof(struct zram_slot_free), GFP_ATOMIC);
-	if (!free_rq)
-		return;
+	meta = zram->meta;
 
-	free_rq->index = index;
-	add_slot_free(zram, free_rq);
-	schedule_work(&zram->free_work);
+	zram_lock_slot(meta, index);
+	zram_free_page(zram, index);
+	zram_unlock_slot(meta, index);
+	atomic64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -947,10 +1653,33 @@ static DEVICE_ATTR(num_reads, S_IRUGO, num_reads_show, NULL);
 static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
 static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
-static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
+static DEVICE_ATTR(zero_pages, S_IRUGO, same_pages_show, NULL);
+static DEVICE_ATTR(same_pages, S_IRUGO, same_pages_show, NULL);
+static DEVICE_ATTR(dup_data_size, S_IRUGO, dup_data_size_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(compacted_pages, S_IRUGO, compacted_pages_show, NULL);
+static DEVICE_ATTR(mem_limit, S_IRUGO | S_IWUSR, mem_limit_show,
+		mem_limit_store);
+static DEVICE_ATTR(mem_used_max, S_IRUGO | S_IWUSR, mem_used_max_show,
+		mem_used_max_store);
+static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
+		max_comp_streams_show, max_comp_streams_store);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
+#ifdef CONFIG_ZRAM_DEDUP
+static DEVICE_ATTR(use_dedup, S_IRUGO | S_IWUSR,
+		use_dedup_show, use_dedup_store);
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(bd_stat, S_IRUGO, bd_stat_show, NULL);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
@@ -961,9 +1690,26 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_invalid_io.attr,
 	&dev_attr_notify_free.attr,
 	&dev_attr_zero_pages.attr,
+	&dev_attr_same_pages.attr,
+	&dev_attr_dup_data_size.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_compacted_pages.attr,
+	&dev_attr_mem_limit.attr,
+	&dev_attr_mem_used_max.attr,
+	&dev_attr_max_comp_streams.attr,
+	&dev_attr_comp_algorithm.attr,
+#ifdef CONFIG_ZRAM_DEDUP
+	&dev_attr_use_dedup.attr,
+#endif
+#ifdef CONFIG_ZRAM_WRITEBACK
+	&dev_attr_backing_dev.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_stat.attr,
+#endif
 	NULL,
 };
 
@@ -975,12 +1721,13 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = -ENOMEM;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bitmap_lock);
+#endif
 
-	INIT_WORK(&zram->free_work, zram_slot_free);
-	spin_lock_init(&zram->slot_free_lock);
-	zram->slot_free_rq = NULL;
+	strlcpy(zram->compressor, zram_compressor, sizeof(zram->compressor));
+	zram->max_comp_streams = num_online_cpus();
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -1059,32 +1806,28 @@ static int __init zram_init(void)
 {
 	int ret, dev_id;
 
-	/* Initialize Cryptographic API */
-	pr_info("Loading Crypto API features\n");
-	if (zram_comp_init()) {
-		pr_err("Compressor initialization failed\n");
-		ret = -ENOMEM;
-		goto out;
-	}
-
-	if (zram_cpu_init()) {
-		pr_err("Per-cpu initialization failed\n");
-		ret = -ENOMEM;
-		goto free_comp;
+	if (!zcomp_available_algorithm(zram_compressor)) {
+		pr_info("%s is not available\n", zram_compressor);
+		zram_compressor = ZRAM_COMPRESSOR_DEFAULT;
+		if (!zcomp_available_algorithm(zram_compressor)) {
+			ret = -ENODEV;
+			goto out;
+		}
 	}
+	pr_info("using %s compressor by default\n", zram_compressor);
 
 	if (num_devices > max_num_devices) {
 		pr_warn("Invalid value for num_devices: %u\n",
 				num_devices);
 		ret = -EINVAL;
-		goto free_cpu_comp;
+		goto out;
 	}
 
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warn("Unable to get major number\n");
 		ret = -EBUSY;
-		goto free_cpu_comp;
+		goto out;
 	}
 
 	/* Allocate the device array and initialize each one */
@@ -1110,10 +1853,6 @@ free_devices:
 	kfree(zram_devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
-free_cpu_comp:
-	zram_comp_cpus_down();
-free_comp:
-	zram_comp_exit();
 out:
 	return ret;
 }
@@ -1137,8 +1876,6 @@ static void __exit zram_exit(void)
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(zram_devices);
-	zram_comp_cpus_down();
-	zram_comp_exit();
 	pr_debug("Cleanup done!\n");
 }
 
@@ -1149,7 +1886,7 @@ module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of zram devices");
 
 module_param_named(compressor, zram_compressor, charp, 0);
-MODULE_PARM_DESC(compressor, "Compressor type");
+MODULE_PARM_DESC(compressor, "Default compressor type for new devices");
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Nitin Gupta <ngupta@vflare.org>");
@@ -19,6 +19,8 @@
 #include <linux/mutex.h>
 
 #include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -51,10 +53,26 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * The lower ZRAM_FLAG_SHIFT bits of table.value hold the object size
+ * (excluding header), the higher bits are used for zram_pageflags.
+ */
+#define ZRAM_FLAG_SHIFT 24
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is filled with one repeated word, kept in handle */
+	ZRAM_SAME = ZRAM_FLAG_SHIFT,
+	/* Slot is locked, see zram_lock_slot() */
+	ZRAM_ACCESS,
+	/* Page is stored on the backing device, handle is the block */
+	ZRAM_WB,
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+	/* Page is being read from the backing device, its block is pinned */
+	ZRAM_UNDER_READ,
+	/* Page was not accessed since it was marked idle */
+	ZRAM_IDLE,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -64,14 +82,12 @@ enum zram_pageflags {
 /* Allocated for each disk page */
 struct table {
 	unsigned long handle;
-	u16 size;	/* object size (excluding header) */
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __attribute__((aligned(4)));
+	unsigned long value;	/* object size and zram_pageflags */
+};
 
 /*
- * All 64bit fields should only be manipulated by 64bit atomic accessors.
- * All modifications to 32bit counter should be protected by zram->lock.
+ * All fields are manipulated by atomic accessors only: reads, writes
+ * and slot free notifications on different slots run concurrently.
  */
 struct zram_stats {
 	atomic64_t compr_size;	/* compressed size of pages stored */
@@ -81,30 +97,38 @@ struct zram_stats {
 	atomic64_t failed_writes;	/* can happen when memory is too low */
 	atomic64_t invalid_io;	/* non-page-aligned I/O requests */
 	atomic64_t notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 bad_compress;	/* % of pages with compression ratio>=75% */
+	atomic64_t pages_same;		/* no. of same element filled pages */
+	atomic64_t pages_stored;	/* no. of pages currently stored */
+	atomic64_t good_compress;	/* no. of pages with ratio<=50% */
+	atomic64_t bad_compress;	/* no. of pages with ratio>=75% */
+	atomic64_t max_used_pages;	/* no. of maximum pages stored */
+	atomic64_t dup_data_size;	/* compressed bytes saved by dedup */
+	atomic64_t bd_count;	/* no. of pages on the backing device */
+	atomic64_t bd_reads;	/* no. of reads from the backing device */
+	atomic64_t bd_writes;	/* no. of writes to the backing device */
 };
 
 struct zram_meta {
-	struct table *table;
+	struct table *table;	/* each entry locked by its ZRAM_ACCESS bit */
 	struct zs_pool *mem_pool;
+#ifdef CONFIG_ZRAM_DEDUP
+	struct zram_hash *hash;	/* NULL if dedup is off for this device */
+	size_t hash_size;
+#endif
 };
 
-struct zram_slot_free {
-	unsigned long index;
-	struct zram_slot_free *next;
-};
+static inline bool zram_dedup_enabled(struct zram_meta *meta)
+{
+#ifdef CONFIG_ZRAM_DEDUP
+	return meta->hash != NULL;
+#else
+	return false;
+#endif
+}
 
 struct zram {
 	struct zram_meta *meta;
-	struct rw_semaphore lock; /* protect compression buffers, table,
-				   * 32bit stat counters against concurrent
-				   * notifications, reads and writes */
-
-	struct work_struct free_work;  /* handle pending free request */
-	struct zram_slot_free *slot_free_rq; /* list head of free request */
+	struct zcomp *comp;	/* compression streams, valid if init_done */
 
 	struct request_queue *queue;
 	struct gendisk *disk;
@@ -116,7 +140,22 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
-	spinlock_t slot_free_lock;
+	/*
+	 * Upper bound on pages backing the pool, writes fail with -ENOMEM
+	 * beyond it. 0 means no limit.
+	 */
+	unsigned long limit_pages;
+	int max_comp_streams;
+	bool use_dedup;		/* applied at init, see zram_meta_alloc() */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct file *backing_dev;	/* NULL if writeback is not set up */
+	struct block_device *bdev;
+	sector_t *bd_bmap;	/* page to block map for a backing file */
+	unsigned long *bitmap;	/* allocated backing device pages */
+	unsigned long nr_bd_pages;
+	spinlock_t bitmap_lock;
+#endif
 
 	struct zram_stats stats;
 };
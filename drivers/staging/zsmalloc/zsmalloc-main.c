@@ -27,35 +27,43 @@
  * page boundaries. The code refers to these linked pages as a single entity
  * called zspage.
  *
- * Following is how we use various fields and flags of underlying
- * struct page(s) to form a zspage.
+ * The state of a zspage (fullness group, free object list, number of
+ * objects in use) is kept in a small 'struct zspage' allocated from a
+ * slab cache, so that the struct page fields of the component pages
+ * stay free for page migration, which needs page->lru.
  *
  * Usage of struct page fields:
- *	page->first_page: points to the first component (0-order) page
- *	page->index (union with page->freelist): offset of the first object
- *		starting in this page. For the first page, this is
- *		always 0, so we use this field (aka freelist) to point
- *		to the first free object in zspage.
- *	page->lru: links together all component pages (except the first page)
- *		of a zspage
- *
- *	For _first_ page only:
- *
- *	page->private (union with page->first_page): refers to the
- *		component page after the first page
- *	page->freelist: points to the first free object in zspage.
- *		Free objects are linked together using in-place
- *		metadata.
- *	page->objects: maximum number of objects we can store in this
- *		zspage (class->zspage_order * PAGE_SIZE / class->size)
- *	page->lru: links together first pages of various zspages.
- *		Basically forming list of zspages in a fullness group.
- *	page->mapping: class index and fullness group of the zspage
+ *	page->private: points to the zspage
+ *	page->freelist (union with page->index): links together all
+ *		component pages of a zspage. For a huge class (one object
+ *		per single page zspage) there is no next page, so the first
+ *		page's page->index holds the header of the object (see
+ *		below) instead.
+ *	page->objects: size class index. Page migration uses it to find
+ *		the class lock without trusting page->private yet.
+ *	page->mapping: the pool's address_space, tagged with
+ *		PAGE_MAPPING_MOVABLE, which lets compaction migrate the page
+ *		through zsmalloc_aops.
  *
  * Usage of struct page flags:
  *	PG_private: identifies the first component page
  *	PG_private2: identifies the last component page
  *
+ * The handle returned by zs_malloc does not encode the location of an
+ * object. It is the address of a small slab allocated word which holds
+ * the encoded location, and the first word of every allocated object
+ * holds the handle back (tagged with OBJ_ALLOCATED_TAG). This lets
+ * compaction find the live objects of a zspage, move them to another
+ * zspage of the same class and update their location without the
+ * callers noticing. Bit HANDLE_PIN_BIT of the handle word is a lock
+ * that keeps the object in place while it is mapped or being freed.
+ *
+ * A pool created with an evict callback can be shrunk by its user with
+ * zs_reclaim_page(), which hands every object of a victim zspage to the
+ * callback. Objects freed meanwhile are only tagged OBJ_FREED_TAG, the
+ * reclaimer frees them and their handles once the callbacks are done, so
+ * that no handle it is about to pass on can go away under it.
+ *
  */
 
 #ifdef CONFIG_ZSMALLOC_DEBUG
@@ -78,6 +86,15 @@
 #include <linux/hardirq.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/bit_spinlock.h>
+#include <linux/shrinker.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/migrate.h>
+#include <linux/pagemap.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/zpool.h>
 
 #include "zsmalloc.h"
 
@@ -98,11 +115,13 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * as single (unsigned long) obj value, shifted left by
+ * OBJ_TAG_BITS so that the lowest bit of a free object's link is
+ * always clear and cannot be mistaken for OBJ_ALLOCATED_TAG.
  *
- * Note that object index <obj_idx> is relative to system
- * page <PFN> it is stored in, so for each sub-page belonging
- * to a zspage, obj_idx starts with 0.
+ * <PFN> is the page the object starts in, <obj_idx> the index of
+ * the object within the whole zspage, so that moving a component page
+ * only changes the location of the objects starting in it.
  *
  * This is made more complicated by various memory models and PAE.
  */
@@ -119,9 +138,20 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS	1
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+/* Set in the first word of an allocated object, next to its handle */
+#define OBJ_ALLOCATED_TAG	1
+/* Object freed while its zspage was under reclaim, see zs_free() */
+#define OBJ_FREED_TAG		2
+#define OBJ_HEADER_TAGS		(OBJ_ALLOCATED_TAG | OBJ_FREED_TAG)
+/* Lock bit in the word a handle points to */
+#define HANDLE_PIN_BIT		0
+/* Room taken from each object of a non-huge class for its handle */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -183,40 +213,82 @@ struct size_class {
 
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int pages_per_zspage;
+	int objs_per_zspage;
+	/* one object per zspage, its handle is kept in first_page->index */
+	bool huge;
 
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
-
-	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
+	unsigned long objs_allocated;	/* object slots in all zspages */
+	unsigned long objs_inuse;
+
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+	/* all zspages, most recently allocated from first */
+	struct list_head lru;
+	/* empty zspages whose pages could not be locked, see free_zspage() */
+	struct list_head free_list;
 };
 
 /*
  * Placed within free objects to form a singly linked list.
- * For every zspage, first_page->freelist gives head of this list.
+ * For every zspage, zspage->freeobj gives head of this list.
  *
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	/* Index of next free object, shifted left by OBJ_TAG_BITS */
+	unsigned long next;
 };
 
 struct zs_pool {
 	struct size_class size_class[ZS_SIZE_CLASSES];
 
 	gfp_t flags;	/* allocation flags used when growing pool */
+	atomic_long_t pages_allocated;	/* sum over all size classes */
+	atomic_long_t pages_compacted;	/* freed by compaction so far */
+
+	struct shrinker shrinker;
+	/* page->mapping of all zspage pages, for page migration */
+	struct address_space mapping;
+	/* pages the migration code holds, zs_destroy_pool() waits for them */
+	atomic_long_t isolated_pages;
+	wait_queue_head_t migration_wait;
+	struct work_struct free_work;	/* frees class->free_list */
+
+	struct zs_ops *ops;
+	unsigned int reclaim_class;	/* where zs_reclaim_page() goes next */
+#ifdef CONFIG_ZPOOL
+	struct zpool *zpool;
+	struct zpool_ops *zpool_ops;
+#endif
 };
 
-/*
- * A zspage's class index and fullness group
- * are encoded in its (first)page->mapping
- */
 #define CLASS_IDX_BITS	28
 #define FULLNESS_BITS	4
-#define CLASS_IDX_MASK	((1 << CLASS_IDX_BITS) - 1)
-#define FULLNESS_MASK	((1 << FULLNESS_BITS) - 1)
+
+struct zspage {
+	unsigned int fullness:FULLNESS_BITS;
+	unsigned int class:CLASS_IDX_BITS;
+	unsigned int under_reclaim:1;
+	unsigned int inuse;		/* objects allocated */
+	unsigned int freeobj;		/* index of the first free object */
+	struct page *first_page;
+	struct list_head list;		/* fullness list */
+	struct list_head lru;		/* class lru */
+};
+
+/* Where compaction is in the zspage being emptied, and where it copies to */
+struct zs_compact_control {
+	struct zspage *s_zspage;	/* zspage being emptied */
+	int index;			/* next object index to look at */
+	struct zspage *d_zspage;	/* destination zspage */
+};
+
+/* Slab caches for handles and zspages, shared by all pools */
+static struct kmem_cache *zs_handle_cache;
+static struct kmem_cache *zspage_cache;
 
 /*
  * By default, zsmalloc uses a copy-based object mapping method to access
@@ -253,26 +325,31 @@ static int is_last_page(struct page *page)
 	return PagePrivate2(page);
 }
 
-static void get_zspage_mapping(struct page *page, unsigned int *class_idx,
-				enum fullness_group *fullness)
+static struct zspage *get_zspage(struct page *page)
+{
+	return (struct zspage *)page_private(page);
+}
+
+static struct page *get_next_page(struct page *page)
 {
-	unsigned long m;
-	BUG_ON(!is_first_page(page));
+	if (is_last_page(page))
+		return NULL;
 
-	m = (unsigned long)page->mapping;
-	*fullness = m & FULLNESS_MASK;
-	*class_idx = (m >> FULLNESS_BITS) & CLASS_IDX_MASK;
+	return page->freelist;
 }
 
-static void set_zspage_mapping(struct page *page, unsigned int class_idx,
-				enum fullness_group fullness)
+/*
+ * Size class of a zspage page. Only valid while the page belongs to a
+ * zspage, reset_page_mapcount() turns it into an out of range value.
+ */
+static unsigned int get_page_class_idx(struct page *page)
 {
-	unsigned long m;
-	BUG_ON(!is_first_page(page));
+	return page->objects;
+}
 
-	m = ((class_idx & CLASS_IDX_MASK) << FULLNESS_BITS) |
-			(fullness & FULLNESS_MASK);
-	page->mapping = (struct address_space *)m;
+static void set_page_class_idx(struct page *page, unsigned int class_idx)
+{
+	page->objects = class_idx;
 }
 
 static int get_size_class_index(int size)
@@ -283,17 +360,18 @@ static int get_size_class_index(int size)
 		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
 				ZS_SIZE_CLASS_DELTA);
 
-	return idx;
+	/* size may include ZS_HANDLE_SIZE, the last class takes any size */
+	return min_t(int, idx, ZS_SIZE_CLASSES - 1);
 }
 
-static enum fullness_group get_fullness_group(struct page *page)
+static enum fullness_group get_fullness_group(struct size_class *class,
+						struct zspage *zspage)
 {
 	int inuse, max_objects;
 	enum fullness_group fg;
-	BUG_ON(!is_first_page(page));
 
-	inuse = page->inuse;
-	max_objects = page->objects;
+	inuse = zspage->inuse;
+	max_objects = class->objs_per_zspage;
 
 	if (inuse == 0)
 		fg = ZS_EMPTY;
@@ -307,62 +385,38 @@ static enum fullness_group get_fullness_group(struct page *page)
 	return fg;
 }
 
-static void insert_zspage(struct page *page, struct size_class *class,
+static void insert_zspage(struct zspage *zspage, struct size_class *class,
 				enum fullness_group fullness)
 {
-	struct page **head;
-
-	BUG_ON(!is_first_page(page));
-
 	if (fullness >= _ZS_NR_FULLNESS_GROUPS)
 		return;
 
-	head = &class->fullness_list[fullness];
-	if (*head)
-		list_add_tail(&page->lru, &(*head)->lru);
-
-	*head = page;
+	list_add(&zspage->list, &class->fullness_list[fullness]);
 }
 
-static void remove_zspage(struct page *page, struct size_class *class,
+static void remove_zspage(struct zspage *zspage, struct size_class *class,
 				enum fullness_group fullness)
 {
-	struct page **head;
-
-	BUG_ON(!is_first_page(page));
-
 	if (fullness >= _ZS_NR_FULLNESS_GROUPS)
 		return;
 
-	head = &class->fullness_list[fullness];
-	BUG_ON(!*head);
-	if (list_empty(&(*head)->lru))
-		*head = NULL;
-	else if (*head == page)
-		*head = (struct page *)list_entry((*head)->lru.next,
-					struct page, lru);
-
-	list_del_init(&page->lru);
+	BUG_ON(list_empty(&class->fullness_list[fullness]));
+	list_del_init(&zspage->list);
 }
 
-static enum fullness_group fix_fullness_group(struct zs_pool *pool,
-						struct page *page)
+static enum fullness_group fix_fullness_group(struct size_class *class,
+						struct zspage *zspage)
 {
-	int class_idx;
-	struct size_class *class;
 	enum fullness_group currfg, newfg;
 
-	BUG_ON(!is_first_page(page));
-
-	get_zspage_mapping(page, &class_idx, &currfg);
-	newfg = get_fullness_group(page);
+	currfg = zspage->fullness;
+	newfg = get_fullness_group(class, zspage);
 	if (newfg == currfg)
 		goto out;
 
-	class = &pool->size_class[class_idx];
-	remove_zspage(page, class, currfg);
-	insert_zspage(page, class, newfg);
-	set_zspage_mapping(page, class_idx, newfg);
+	remove_zspage(zspage, class, currfg);
+	insert_zspage(zspage, class, newfg);
+	zspage->fullness = newfg;
 
 out:
 	return newfg;
@@ -403,134 +457,279 @@ static int get_pages_per_zspage(int class_size)
 	return max_usedpc_order;
 }
 
-/*
- * A single 'zspage' is composed of many system pages which are
- * linked together using fields in struct page. This function finds
- * the first/head page, given any component page of a zspage.
- */
-static struct page *get_first_page(struct page *page)
+/* Encode <page, obj_idx> as a single obj value */
+static unsigned long location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	if (is_first_page(page))
-		return page;
-	else
-		return page->first_page;
+	unsigned long obj;
+
+	if (!page) {
+		BUG_ON(obj_idx);
+		return 0;
+	}
+
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
+	obj <<= OBJ_TAG_BITS;
+
+	return obj;
 }
 
-static struct page *get_next_page(struct page *page)
+/* Decode <page, obj_idx> pair from the given obj value */
+static void obj_to_location(unsigned long obj, struct page **page,
+				unsigned long *obj_idx)
 {
-	struct page *next;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
 
-	if (is_last_page(page))
-		next = NULL;
-	else if (is_first_page(page))
-		next = (struct page *)page->private;
-	else
-		next = list_entry(page->lru.next, struct page, lru);
+static unsigned long alloc_handle(struct zs_pool *pool, gfp_t gfp)
+{
+	return (unsigned long)kmem_cache_alloc(zs_handle_cache,
+			gfp & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+}
 
-	return next;
+static void free_handle(unsigned long handle)
+{
+	kmem_cache_free(zs_handle_cache, (void *)handle);
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+static struct zspage *cache_alloc_zspage(struct zs_pool *pool, gfp_t gfp)
 {
-	unsigned long handle;
+	return kmem_cache_zalloc(zspage_cache,
+			gfp & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+}
 
-	if (!page) {
-		BUG_ON(obj_idx);
-		return NULL;
-	}
+static void cache_free_zspage(struct zspage *zspage)
+{
+	kmem_cache_free(zspage_cache, zspage);
+}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
 
-	return (void *)handle;
+/* The caller must have the handle pinned */
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~(1UL << HANDLE_PIN_BIT);
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(unsigned long handle, struct page **page,
-				unsigned long *obj_idx)
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+/* Offset of an object within the page it starts in */
+static unsigned long obj_idx_to_offset(unsigned long obj_idx, int class_size)
 {
-	*page = pfn_to_page(handle >> OBJ_INDEX_BITS);
-	*obj_idx = handle & OBJ_INDEX_MASK;
+	return (obj_idx * class_size) & ~PAGE_MASK;
 }
 
-static unsigned long obj_idx_to_offset(struct page *page,
+/* The component page object obj_idx starts in */
+static struct page *obj_idx_to_page(struct zspage *zspage,
 				unsigned long obj_idx, int class_size)
 {
-	unsigned long off = 0;
+	struct page *page = zspage->first_page;
+	unsigned long nr = (obj_idx * class_size) >> PAGE_SHIFT;
+
+	while (nr--)
+		page = get_next_page(page);
+
+	return page;
+}
+
+/* First word of object obj_idx. The caller holds the class lock. */
+static unsigned long obj_header(struct size_class *class,
+				struct zspage *zspage, unsigned long obj_idx)
+{
+	struct page *page;
+	unsigned long head;
+	void *vaddr;
+
+	if (class->huge)
+		return zspage->first_page->index;
+
+	page = obj_idx_to_page(zspage, obj_idx, class->size);
+	vaddr = kmap_atomic(page);
+	head = *(unsigned long *)(vaddr +
+			obj_idx_to_offset(obj_idx, class->size));
+	kunmap_atomic(vaddr);
+
+	return head;
+}
+
+/*
+ * Handle of object obj_idx, or 0 if the object is free. The caller
+ * holds the class lock.
+ */
+static unsigned long obj_to_handle(struct size_class *class,
+				struct zspage *zspage, unsigned long obj_idx)
+{
+	unsigned long head = obj_header(class, zspage, obj_idx);
 
-	if (!is_first_page(page))
-		off = page->index;
+	if (!(head & OBJ_ALLOCATED_TAG))
+		return 0;
 
-	return off + obj_idx * class_size;
+	return head & ~OBJ_HEADER_TAGS;
 }
 
 static void reset_page(struct page *page)
 {
+	__ClearPageMovable(page);
 	clear_bit(PG_private, &page->flags);
 	clear_bit(PG_private_2, &page->flags);
 	set_page_private(page, 0);
-	page->mapping = NULL;
-	page->freelist = NULL;
+	page->index = 0;
 	reset_page_mapcount(page);
 }
 
-static void free_zspage(struct page *first_page)
+static void zs_pool_dec_isolated(struct zs_pool *pool)
+{
+	if (atomic_long_dec_and_test(&pool->isolated_pages))
+		wake_up_all(&pool->migration_wait);
+}
+
+/* Lock all pages of a zspage or none of them */
+static int trylock_zspage(struct zspage *zspage)
 {
-	struct page *nextp, *tmp, *head_extra;
+	struct page *page, *fail;
 
-	BUG_ON(!is_first_page(first_page));
-	BUG_ON(first_page->inuse);
+	for (page = zspage->first_page; page; page = get_next_page(page)) {
+		if (!trylock_page(page)) {
+			fail = page;
+			goto unlock;
+		}
+	}
 
-	head_extra = (struct page *)page_private(first_page);
+	return 1;
 
-	reset_page(first_page);
-	__free_page(first_page);
+unlock:
+	for (page = zspage->first_page; page != fail;
+					page = get_next_page(page))
+		unlock_page(page);
 
-	/* zspage with only 1 system page */
-	if (!head_extra)
+	return 0;
+}
+
+/*
+ * Lock all pages of a zspage, sleeping on those the migration code
+ * holds. A page not locked yet may still be replaced by
+ * zs_page_migrate(), so the chain is only followed under the class
+ * lock. Returns with the class lock held.
+ */
+static void lock_zspage(struct size_class *class, struct zspage *zspage)
+{
+	struct page *page, *curr = NULL;
+
+	spin_lock(&class->lock);
+	while ((page = curr ? get_next_page(curr) : zspage->first_page)) {
+		if (trylock_page(page)) {
+			curr = page;
+			continue;
+		}
+		get_page(page);
+		spin_unlock(&class->lock);
+		wait_on_page_locked(page);
+		put_page(page);
+		spin_lock(&class->lock);
+	}
+}
+
+/*
+ * Give the pages of a locked, empty zspage back. __ClearPageMovable()
+ * in reset_page() tells the migration code the page is no longer ours,
+ * it won't call back into zsmalloc for a page it still holds, so such
+ * a page stops counting as isolated here.
+ */
+static void __free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	struct page *page, *next;
+
+	for (page = zspage->first_page; page; page = next) {
+		next = get_next_page(page);
+		if (__PageMovable(page) && PageIsolated(page))
+			zs_pool_dec_isolated(pool);
+		reset_page(page);
+		unlock_page(page);
+		__free_page(page);
+	}
+	cache_free_zspage(zspage);
+}
+
+/*
+ * Free an empty zspage, called with the class lock held. The migration
+ * code looks at a page and calls zs_page_isolate() or zs_page_migrate()
+ * with the page locked, so the pages are locked before they stop being
+ * movable. If one of them is locked right now the zspage is left to
+ * async_free_zspage(), which can sleep for it.
+ */
+static void free_zspage(struct zs_pool *pool, struct size_class *class,
+			struct zspage *zspage)
+{
+	BUG_ON(zspage->inuse);
+
+	list_del(&zspage->lru);
+	if (!trylock_zspage(zspage)) {
+		list_add(&zspage->list, &class->free_list);
+		schedule_work(&pool->free_work);
 		return;
+	}
+	__free_zspage(pool, zspage);
+}
+
+static void async_free_zspage(struct work_struct *work)
+{
+	struct zs_pool *pool = container_of(work, struct zs_pool, free_work);
+	struct zspage *zspage, *tmp;
+	LIST_HEAD(free_pages);
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		list_splice_init(&class->free_list, &free_pages);
+		spin_unlock(&class->lock);
 
-	list_for_each_entry_safe(nextp, tmp, &head_extra->lru, lru) {
-		list_del(&nextp->lru);
-		reset_page(nextp);
-		__free_page(nextp);
+		list_for_each_entry_safe(zspage, tmp, &free_pages, list) {
+			list_del(&zspage->list);
+			lock_zspage(class, zspage);
+			__free_zspage(pool, zspage);
+			spin_unlock(&class->lock);
+		}
 	}
-	reset_page(head_extra);
-	__free_page(head_extra);
 }
 
 /* Initialize a newly allocated zspage */
-static void init_zspage(struct page *first_page, struct size_class *class)
+static void init_zspage(struct size_class *class, struct zspage *zspage)
 {
+	unsigned int freeobj = 1;
 	unsigned long off = 0;
-	struct page *page = first_page;
+	struct page *page = zspage->first_page;
 
-	BUG_ON(!is_first_page(first_page));
 	while (page) {
 		struct page *next_page;
 		struct link_free *link;
-		unsigned int i, objs_on_page;
+		void *vaddr;
 
-		/*
-		 * page->index stores offset of first object starting
-		 * in the page. For the first page, this is always 0,
-		 * so we use first_page->index (aka ->freelist) to store
-		 * head of corresponding zspage's freelist.
-		 */
-		if (page != first_page)
-			page->index = off;
-
-		link = (struct link_free *)kmap_atomic(page) +
-						off / sizeof(*link);
-		objs_on_page = (PAGE_SIZE - off) / class->size;
-
-		for (i = 1; i <= objs_on_page; i++) {
-			off += class->size;
-			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
-				link += class->size / sizeof(*link);
-			}
+		vaddr = kmap_atomic(page);
+		link = (struct link_free *)vaddr + off / sizeof(*link);
+
+		while ((off += class->size) < PAGE_SIZE) {
+			link->next = freeobj++ << OBJ_TAG_BITS;
+			link += class->size / sizeof(*link);
 		}
 
 		/*
@@ -539,87 +738,180 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
-		kunmap_atomic(link);
+		if (next_page)
+			link->next = freeobj++ << OBJ_TAG_BITS;
+		else
+			link->next = -1UL << OBJ_TAG_BITS;
+		kunmap_atomic(vaddr);
 		page = next_page;
-		off = (off + class->size) % PAGE_SIZE;
+		off %= PAGE_SIZE;
 	}
+	zspage->freeobj = 0;
 }
 
 /*
  * Allocate a zspage for the given size class
  */
-static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+					struct size_class *class, gfp_t gfp)
 {
-	int i, error;
-	struct page *first_page = NULL, *uninitialized_var(prev_page);
+	int i;
+	struct page *page, *prev_page = NULL;
+	struct zspage *zspage;
+
+	zspage = cache_alloc_zspage(pool, gfp);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class->index;
+	zspage->fullness = ZS_EMPTY;
+	INIT_LIST_HEAD(&zspage->list);
+	INIT_LIST_HEAD(&zspage->lru);
 
 	/*
-	 * Allocate individual pages and link them together as:
-	 * 1. first page->private = first sub-page
-	 * 2. all sub-pages are linked together using page->lru
-	 * 3. each sub-page is linked to the first page using page->first_page
-	 *
-	 * For each size class, First/Head pages are linked together using
-	 * page->lru. Also, we set PG_private to identify the first page
+	 * Allocate individual pages and link them together through
+	 * page->freelist. We set PG_private to identify the first page
 	 * (i.e. no other sub-page has this flag set) and PG_private_2 to
 	 * identify the last page.
 	 */
-	error = -ENOMEM;
 	for (i = 0; i < class->pages_per_zspage; i++) {
-		struct page *page;
-
-		page = alloc_page(flags);
+		page = alloc_page(gfp);
 		if (!page)
 			goto cleanup;
 
-		INIT_LIST_HEAD(&page->lru);
+		set_page_private(page, (unsigned long)zspage);
+		set_page_class_idx(page, class->index);
+		page->freelist = NULL;
 		if (i == 0) {	/* first page */
 			SetPagePrivate(page);
-			set_page_private(page, 0);
-			first_page = page;
-			first_page->inuse = 0;
+			zspage->first_page = page;
+		} else {
+			prev_page->freelist = page;
 		}
-		if (i == 1)
-			first_page->private = (unsigned long)page;
-		if (i >= 1)
-			page->first_page = first_page;
-		if (i >= 2)
-			list_add(&page->lru, &prev_page->lru);
 		if (i == class->pages_per_zspage - 1)	/* last page */
 			SetPagePrivate2(page);
 		prev_page = page;
 	}
 
-	init_zspage(first_page, class);
+	init_zspage(class, zspage);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
-	/* Maximum number of objects we can store in this zspage */
-	first_page->objects = class->pages_per_zspage * PAGE_SIZE / class->size;
-
-	error = 0; /* Success */
+	return zspage;
 
 cleanup:
-	if (unlikely(error) && first_page) {
-		free_zspage(first_page);
-		first_page = NULL;
+	/* the pages were never movable, nobody else can be looking at them */
+	if (prev_page) {
+		struct page *next;
+
+		/* end the chain where the allocation failed */
+		SetPagePrivate2(prev_page);
+		for (page = zspage->first_page; page; page = next) {
+			next = get_next_page(page);
+			reset_page(page);
+			__free_page(page);
+		}
 	}
+	cache_free_zspage(zspage);
 
-	return first_page;
+	return NULL;
 }
 
-static struct page *find_get_zspage(struct size_class *class)
+/* Let compaction find the pages, see zs_page_migrate() */
+static void set_zspage_movable(struct zs_pool *pool, struct zspage *zspage)
 {
-	int i;
 	struct page *page;
 
+	for (page = zspage->first_page; page; page = get_next_page(page))
+		__SetPageMovable(page, &pool->mapping);
+}
+
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	int i;
+
 	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
-		page = class->fullness_list[i];
-		if (page)
-			break;
+		if (!list_empty(&class->fullness_list[i]))
+			return list_first_entry(&class->fullness_list[i],
+						struct zspage, list);
 	}
 
-	return page;
+	return NULL;
+}
+
+/*
+ * Take the first free object of a zspage and store the handle in it.
+ * Moving the zspage to its new fullness group is left to the caller.
+ */
+static unsigned long obj_malloc(struct size_class *class,
+				struct zspage *zspage, unsigned long handle)
+{
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+	void *vaddr;
+
+	m_objidx = zspage->freeobj;
+	m_page = obj_idx_to_page(zspage, m_objidx, class->size);
+	m_offset = obj_idx_to_offset(m_objidx, class->size);
+
+	vaddr = kmap_atomic(m_page);
+	link = (struct link_free *)vaddr + m_offset / sizeof(*link);
+	zspage->freeobj = link->next >> OBJ_TAG_BITS;
+	if (!class->huge)
+		link->next = handle | OBJ_ALLOCATED_TAG;
+	else
+		zspage->first_page->index = handle | OBJ_ALLOCATED_TAG;
+	kunmap_atomic(vaddr);
+
+	zspage->inuse++;
+	class->objs_inuse++;
+
+	return location_to_obj(m_page, m_objidx);
+}
+
+/* Put an object back on its zspage's freelist, fullness as above */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct zspage *zspage;
+	struct page *f_page;
+	unsigned long f_objidx, f_offset;
+	void *vaddr;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	f_offset = obj_idx_to_offset(f_objidx, class->size);
+	zspage = get_zspage(f_page);
+
+	/* the link overwrites the handle, clearing OBJ_ALLOCATED_TAG */
+	vaddr = kmap_atomic(f_page);
+	link = (struct link_free *)(vaddr + f_offset);
+	link->next = zspage->freeobj << OBJ_TAG_BITS;
+	kunmap_atomic(vaddr);
+	if (class->huge)
+		zspage->first_page->index = 0;
+
+	zspage->freeobj = f_objidx;
+	zspage->inuse--;
+	class->objs_inuse--;
+}
+
+/* Leave a freed object to the reclaimer, see zs_reclaim_page() */
+static void obj_mark_freed(struct size_class *class, unsigned long obj)
+{
+	struct page *f_page;
+	unsigned long f_objidx;
+	unsigned long *head;
+	void *vaddr;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	if (class->huge) {
+		get_zspage(f_page)->first_page->index |= OBJ_FREED_TAG;
+		return;
+	}
+
+	vaddr = kmap_atomic(f_page);
+	head = vaddr + obj_idx_to_offset(f_objidx, class->size);
+	*head |= OBJ_FREED_TAG;
+	kunmap_atomic(vaddr);
 }
 
 #ifdef USE_PGTABLE_MAPPING
@@ -767,19 +1059,165 @@ static struct notifier_block zs_cpu_nb = {
 	.notifier_call = zs_cpu_notifier
 };
 
+#ifdef CONFIG_ZPOOL
+
+static unsigned long __zs_malloc(struct zs_pool *pool, size_t size,
+				 gfp_t gfp);
+
+static int zs_zpool_evict(struct zs_pool *pool, unsigned long handle)
+{
+	if (pool->zpool && pool->zpool_ops && pool->zpool_ops->evict)
+		return pool->zpool_ops->evict(pool->zpool, handle);
+	else
+		return -ENOENT;
+}
+
+static struct zs_ops zs_zpool_ops = {
+	.evict =	zs_zpool_evict
+};
+
+static void *zs_zpool_create(gfp_t gfp, struct zpool_ops *zpool_ops,
+			struct zpool *zpool)
+{
+	struct zs_pool *pool;
+
+	pool = zs_create_pool(gfp | __GFP_HIGHMEM | __GFP_MOVABLE,
+				zpool_ops ? &zs_zpool_ops : NULL);
+	if (pool) {
+		pool->zpool = zpool;
+		pool->zpool_ops = zpool_ops;
+	}
+	return pool;
+}
+
+static void zs_zpool_destroy(void *pool)
+{
+	zs_destroy_pool(pool);
+}
+
+static int zs_zpool_malloc(void *pool, size_t size, gfp_t gfp,
+			unsigned long *handle)
+{
+	if (size > ZS_MAX_ALLOC_SIZE)
+		return -ENOSPC;
+
+	/* zswap allocates with preemption off and asks us not to sleep */
+	*handle = __zs_malloc(pool, size,
+			      gfp | __GFP_HIGHMEM | __GFP_MOVABLE);
+	return *handle ? 0 : -ENOMEM;
+}
+
+static void zs_zpool_free(void *pool, unsigned long handle)
+{
+	zs_free(pool, handle);
+}
+
+static int zs_zpool_shrink(void *pool, unsigned int pages,
+			unsigned int *reclaimed)
+{
+	unsigned int total = 0;
+	int ret = -EINVAL;
+
+	while (total < pages) {
+		ret = zs_reclaim_page(pool, 8);
+		if (ret < 0)
+			break;
+		total++;
+	}
+
+	if (reclaimed)
+		*reclaimed = total;
+
+	return ret;
+}
+
+static void *zs_zpool_map(void *pool, unsigned long handle,
+			enum zpool_mapmode mm)
+{
+	enum zs_mapmode zs_mm;
+
+	switch (mm) {
+	case ZPOOL_MM_RO:
+		zs_mm = ZS_MM_RO;
+		break;
+	case ZPOOL_MM_WO:
+		zs_mm = ZS_MM_WO;
+		break;
+	case ZPOOL_MM_RW: /* fallthru */
+	default:
+		zs_mm = ZS_MM_RW;
+		break;
+	}
+
+	return zs_map_object(pool, handle, zs_mm);
+}
+
+static void zs_zpool_unmap(void *pool, unsigned long handle)
+{
+	zs_unmap_object(pool, handle);
+}
+
+static u64 zs_zpool_total_size(void *pool)
+{
+	return zs_get_total_size_bytes(pool);
+}
+
+static struct zpool_driver zs_zpool_driver = {
+	.type =		"zsmalloc",
+	.owner =	THIS_MODULE,
+	.create =	zs_zpool_create,
+	.destroy =	zs_zpool_destroy,
+	.malloc =	zs_zpool_malloc,
+	.free =		zs_zpool_free,
+	.shrink =	zs_zpool_shrink,
+	.map =		zs_zpool_map,
+	.unmap =	zs_zpool_unmap,
+	.total_size =	zs_zpool_total_size,
+};
+
+MODULE_ALIAS("zpool-zsmalloc");
+#endif /* CONFIG_ZPOOL */
+
 static void zs_exit(void)
 {
 	int cpu;
 
+#ifdef CONFIG_ZPOOL
+	zpool_unregister_driver(&zs_zpool_driver);
+#endif
+
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+
+	if (zspage_cache)
+		kmem_cache_destroy(zspage_cache);
+	zspage_cache = NULL;
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
+	zs_handle_cache = NULL;
 }
 
 static int zs_init(void)
 {
 	int cpu, ret;
 
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					0, 0, NULL);
+	if (!zs_handle_cache)
+		return -ENOMEM;
+
+	zspage_cache = kmem_cache_create("zspage", sizeof(struct zspage),
+					0, 0, NULL);
+	if (!zspage_cache) {
+		kmem_cache_destroy(zs_handle_cache);
+		zs_handle_cache = NULL;
+		return -ENOMEM;
+	}
+
+#ifdef CONFIG_ZPOOL
+	zpool_register_driver(&zs_zpool_driver);
+#endif
 	register_cpu_notifier(&zs_cpu_nb);
 	for_each_online_cpu(cpu) {
 		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
@@ -792,17 +1230,460 @@ fail:
 	return notifier_to_errno(ret);
 }
 
+/* Copy a whole object, either of which may span two pages */
+static void zs_object_copy(struct size_class *class, unsigned long dst,
+				unsigned long src)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int size, written = 0;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+	s_off = obj_idx_to_offset(s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_objidx, class->size);
+
+	while (written < class->size) {
+		size = min3(class->size - written, (int)(PAGE_SIZE - s_off),
+				(int)(PAGE_SIZE - d_off));
+
+		s_addr = kmap_atomic(s_page);
+		d_addr = kmap_atomic(d_page);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		kunmap_atomic(d_addr);
+		kunmap_atomic(s_addr);
+
+		written += size;
+		s_off += size;
+		d_off += size;
+		if (s_off == PAGE_SIZE) {
+			s_page = get_next_page(s_page);
+			s_off = 0;
+		}
+		if (d_off == PAGE_SIZE) {
+			d_page = get_next_page(d_page);
+			d_off = 0;
+		}
+	}
+}
+
+/*
+ * Find the next allocated object of a zspage, starting at object
+ * *index, and return its handle pinned. Objects pinned by someone
+ * else are skipped. Returns 0 at the end of the zspage.
+ */
+static unsigned long find_alloced_obj(struct size_class *class,
+					struct zspage *zspage, int *index)
+{
+	unsigned long handle = 0;
+	int idx = *index;
+
+	for (; idx < class->objs_per_zspage; idx++) {
+		handle = obj_to_handle(class, zspage, idx);
+		if (handle && trypin_tag(handle))
+			break;
+		handle = 0;
+	}
+
+	*index = idx;
+	return handle;
+}
+
+/*
+ * Move objects from cc->s_zspage, starting at cc->index, into
+ * cc->d_zspage. Returns -ENOMEM if the destination filled up before
+ * the source was done.
+ */
+static int migrate_zspage(struct size_class *class,
+				struct zs_compact_control *cc)
+{
+	unsigned long used_obj, free_obj, handle;
+	struct zspage *s_zspage = cc->s_zspage;
+	struct zspage *d_zspage = cc->d_zspage;
+	int index = cc->index;
+	int ret = 0;
+
+	while (1) {
+		handle = find_alloced_obj(class, s_zspage, &index);
+		if (!handle)
+			break;
+
+		if (d_zspage->inuse == class->objs_per_zspage) {
+			unpin_tag(handle);
+			ret = -ENOMEM;
+			break;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(class, d_zspage, handle);
+		zs_object_copy(class, free_obj, used_obj);
+		index++;
+		/* keep the pin bit, unpin_tag() clears it */
+		record_obj(handle, free_obj | (1UL << HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+	}
+
+	cc->index = index;
+
+	return ret;
+}
+
+/* Take a zspage off a fullness list so nobody else allocates from it */
+static struct zspage *isolate_zspage(struct size_class *class,
+					enum fullness_group fg)
+{
+	struct zspage *zspage;
+
+	if (list_empty(&class->fullness_list[fg]))
+		return NULL;
+
+	zspage = list_first_entry(&class->fullness_list[fg],
+					struct zspage, list);
+	remove_zspage(zspage, class, fg);
+
+	return zspage;
+}
+
+/* Destination: the fullest zspage that still has room */
+static struct zspage *isolate_target_zspage(struct size_class *class)
+{
+	struct zspage *zspage;
+
+	zspage = isolate_zspage(class, ZS_ALMOST_FULL);
+	if (!zspage)
+		zspage = isolate_zspage(class, ZS_ALMOST_EMPTY);
+
+	return zspage;
+}
+
+/*
+ * Return an isolated zspage to the fullness list it now belongs to,
+ * or free it if compaction emptied it.
+ */
+static enum fullness_group putback_zspage(struct zs_pool *pool,
+				struct size_class *class, struct zspage *zspage)
+{
+	enum fullness_group fg;
+
+	fg = get_fullness_group(class, zspage);
+	zspage->fullness = fg;
+	if (fg == ZS_EMPTY) {
+		class->pages_allocated -= class->pages_per_zspage;
+		class->objs_allocated -= class->objs_per_zspage;
+		atomic_long_sub(class->pages_per_zspage,
+					&pool->pages_allocated);
+		free_zspage(pool, class, zspage);
+	} else {
+		insert_zspage(zspage, class, fg);
+	}
+
+	return fg;
+}
+
+/* Number of pages compacting this class could give back */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	obj_wasted = class->objs_allocated - class->objs_inuse;
+	obj_wasted /= class->objs_per_zspage;
+
+	return obj_wasted * class->pages_per_zspage;
+}
+
+/* Compact a class until it is done or nr_to_free pages were freed */
+static unsigned long __zs_compact(struct zs_pool *pool,
+			struct size_class *class, unsigned long nr_to_free)
+{
+	struct zs_compact_control cc;
+	struct zspage *src_zspage, *dst_zspage;
+	unsigned long pages_freed = 0;
+
+	spin_lock(&class->lock);
+	while (pages_freed < nr_to_free && zs_can_compact(class)) {
+		src_zspage = isolate_zspage(class, ZS_ALMOST_EMPTY);
+		if (!src_zspage)
+			break;
+
+		cc.s_zspage = src_zspage;
+		cc.index = 0;
+		while ((dst_zspage = isolate_target_zspage(class))) {
+			cc.d_zspage = dst_zspage;
+			if (!migrate_zspage(class, &cc))
+				break;
+			putback_zspage(pool, class, dst_zspage);
+		}
+
+		if (!dst_zspage) {
+			putback_zspage(pool, class, src_zspage);
+			break;
+		}
+		putback_zspage(pool, class, dst_zspage);
+
+		/*
+		 * Objects left behind are pinned, most likely mapped right
+		 * now. Retry on the next run rather than spin on them.
+		 */
+		if (putback_zspage(pool, class, src_zspage) != ZS_EMPTY)
+			break;
+		pages_freed += class->pages_per_zspage;
+
+		spin_unlock(&class->lock);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return pages_freed;
+}
+
+/* Compact the classes in turn until nr_to_free pages were freed */
+static unsigned long zs_compact_pages(struct zs_pool *pool,
+					unsigned long nr_to_free)
+{
+	int i;
+	unsigned long pages_freed = 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (pages_freed >= nr_to_free)
+			break;
+		if (class->huge)
+			continue;
+		pages_freed += __zs_compact(pool, class,
+						nr_to_free - pages_freed);
+	}
+	atomic_long_add(pages_freed, &pool->pages_compacted);
+
+	return pages_freed;
+}
+
+/**
+ * zs_compact - move objects to free sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Within each size class, objects of the emptiest zspages are moved
+ * into the fullest ones until no more zspages can be freed. Handles
+ * stay valid. May sleep.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	return zs_compact_pages(pool, ULONG_MAX);
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+static unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->huge)
+			continue;
+		spin_lock(&class->lock);
+		pages += zs_can_compact(class);
+		spin_unlock(&class->lock);
+	}
+
+	return pages;
+}
+
+/*
+ * Compact under memory pressure, reporting what fragmentation wastes.
+ * Each call frees about nr_to_scan pages, vmscan asks again in batches
+ * for as long as it wants more and the pool has some to give.
+ */
+static int zs_shrinker_scan(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+	unsigned long pages;
+
+	pages = zs_compactable_pages(pool);
+	if (!pages)
+		return 0;
+
+	if (sc->nr_to_scan) {
+		zs_compact_pages(pool, sc->nr_to_scan);
+		pages = zs_compactable_pages(pool);
+	}
+
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+#ifdef CONFIG_MIGRATION
+/*
+ * Page migration
+ *
+ * Component pages are tagged movable once their zspage is in use, so
+ * mm/compaction.c can move them out of the way of high order
+ * allocations. Everything that changes a zspage holds the class lock,
+ * and the objects overlapping the page are pinned while it is copied, so
+ * neither zs_map_object() users nor zs_compact() can see a half moved
+ * page. Freeing a zspage also locks its pages, see free_zspage(), so a
+ * page seen movable under the page lock stays ours until it is unlocked.
+ * Pages the migration code has isolated are counted in the pool.
+ */
+
+/* The class a page belongs to, or NULL if zsmalloc let go of it */
+static struct size_class *zs_page_class(struct page *page)
+{
+	struct zs_pool *pool;
+	unsigned int class_idx;
+
+	pool = container_of(page_mapping(page), struct zs_pool, mapping);
+	class_idx = get_page_class_idx(page);
+	if (class_idx >= ZS_SIZE_CLASSES)
+		return NULL;
+
+	return &pool->size_class[class_idx];
+}
+
+static bool zs_page_isolate(struct page *page, isolate_mode_t mode)
+{
+	struct size_class *class;
+	bool ret;
+
+	VM_BUG_ON(!PageMovable(page));
+	VM_BUG_ON(PageIsolated(page));
+
+	class = zs_page_class(page);
+	if (!class)
+		return false;
+
+	/* page->private is only cleared with the class lock held */
+	spin_lock(&class->lock);
+	ret = get_zspage(page) != NULL;
+	spin_unlock(&class->lock);
+	if (ret)
+		atomic_long_inc(&container_of(page_mapping(page),
+				struct zs_pool, mapping)->isolated_pages);
+
+	return ret;
+}
+
+static int zs_page_migrate(struct address_space *mapping,
+		struct page *newpage, struct page *page, enum migrate_mode mode)
+{
+	struct size_class *class;
+	struct zspage *zspage;
+	struct page *prev_page = NULL, *p;
+	unsigned long handle, start, first_idx, last_idx, i;
+	int nr = 0;
+
+	class = zs_page_class(page);
+	if (!class)
+		return -EAGAIN;
+
+	spin_lock(&class->lock);
+	zspage = get_zspage(page);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		return -EAGAIN;
+	}
+
+	for (p = zspage->first_page; p != page; p = get_next_page(p)) {
+		prev_page = p;
+		nr++;
+	}
+
+	/* every object overlapping the page, including one spanning into it */
+	start = nr * PAGE_SIZE;
+	first_idx = start / class->size;
+	last_idx = min_t(unsigned long, (start + PAGE_SIZE - 1) / class->size,
+				class->objs_per_zspage - 1);
+
+	for (i = first_idx; i <= last_idx; i++) {
+		handle = obj_to_handle(class, zspage, i);
+		if (handle && !trypin_tag(handle))
+			goto unpin_objects;
+	}
+
+	copy_highpage(newpage, page);
+	set_page_private(newpage, (unsigned long)zspage);
+	set_page_class_idx(newpage, class->index);
+	newpage->index = page->index;
+	if (is_first_page(page))
+		SetPagePrivate(newpage);
+	if (is_last_page(page))
+		SetPagePrivate2(newpage);
+
+	if (prev_page)
+		prev_page->freelist = newpage;
+	else
+		zspage->first_page = newpage;
+
+	for (i = first_idx; i <= last_idx; i++) {
+		handle = obj_to_handle(class, zspage, i);
+		if (!handle)
+			continue;
+		/* objects starting in an earlier page stay where they are */
+		if (i * class->size >= start)
+			record_obj(handle, location_to_obj(newpage, i) |
+						(1UL << HANDLE_PIN_BIT));
+		unpin_tag(handle);
+	}
+
+	get_page(newpage);
+	__SetPageMovable(newpage, mapping);
+	reset_page(page);
+	put_page(page);
+	spin_unlock(&class->lock);
+	zs_pool_dec_isolated(container_of(mapping, struct zs_pool, mapping));
+
+	return 0;
+
+unpin_objects:
+	while (i-- > first_idx) {
+		handle = obj_to_handle(class, zspage, i);
+		if (handle)
+			unpin_tag(handle);
+	}
+	spin_unlock(&class->lock);
+
+	return -EAGAIN;
+}
+
+/* Nothing was taken off any list at isolation time */
+static void zs_page_putback(struct page *page)
+{
+	VM_BUG_ON(!PageMovable(page));
+	VM_BUG_ON(!PageIsolated(page));
+
+	zs_pool_dec_isolated(container_of(page_mapping(page),
+				struct zs_pool, mapping));
+}
+
+static const struct address_space_operations zsmalloc_aops = {
+	.isolate_page = zs_page_isolate,
+	.migratepage = zs_page_migrate,
+	.putback_page = zs_page_putback,
+};
+#endif /* CONFIG_MIGRATION */
+
 /**
  * zs_create_pool - Creates an allocation pool to work from.
  * @flags: allocation flags used to allocate pool metadata
+ * @ops: optional evict callback, needed for zs_reclaim_page()
  *
  * This function must be called before anything when using
- * the zsmalloc allocator.
+ * the zsmalloc allocator. With __GFP_MOVABLE in @flags the pool's
+ * pages are taken from movable pageblocks, where compaction can
+ * migrate them.
  *
  * On success, a pointer to the newly created pool is returned,
  * otherwise NULL.
  */
-struct zs_pool *zs_create_pool(gfp_t flags)
+struct zs_pool *zs_create_pool(gfp_t flags, struct zs_ops *ops)
 {
 	int i, ovhd_size;
 	struct zs_pool *pool;
@@ -813,7 +1694,7 @@ struct zs_pool *zs_create_pool(gfp_t flags)
 		return NULL;
 
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
-		int size;
+		int size, fg;
 		struct size_class *class;
 
 		size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
@@ -825,10 +1706,26 @@ struct zs_pool *zs_create_pool(gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->pages_per_zspage = get_pages_per_zspage(size);
-
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / size;
+		class->huge = (class->objs_per_zspage == 1);
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+		INIT_LIST_HEAD(&class->lru);
+		INIT_LIST_HEAD(&class->free_list);
 	}
 
 	pool->flags = flags;
+	pool->ops = ops;
+#ifdef CONFIG_MIGRATION
+	pool->mapping.a_ops = &zsmalloc_aops;
+#endif
+	init_waitqueue_head(&pool->migration_wait);
+	INIT_WORK(&pool->free_work, async_free_zspage);
+
+	pool->shrinker.shrink = zs_shrinker_scan;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
 
 	return pool;
 }
@@ -838,12 +1735,18 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	unregister_shrinker(&pool->shrinker);
+	flush_work(&pool->free_work);
+	/* isolated pages lead back to the pool through page->mapping */
+	wait_event(pool->migration_wait,
+			atomic_long_read(&pool->isolated_pages) == 0);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
 
 		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
-			if (class->fullness_list[fg]) {
+			if (!list_empty(&class->fullness_list[fg])) {
 				pr_info("Freeing non-empty class with size "
 					"%db, fullness group %d\n",
 					class->size, fg);
@@ -854,107 +1757,213 @@ void zs_destroy_pool(struct zs_pool *pool)
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
 
-/**
- * zs_malloc - Allocate block of given size from pool.
- * @pool: pool to allocate from
- * @size: size of block to allocate
- *
- * On success, handle to the allocated object is returned,
- * otherwise 0.
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
- */
-unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+static unsigned long __zs_malloc(struct zs_pool *pool, size_t size,
+				 gfp_t gfp)
 {
-	unsigned long obj;
-	struct link_free *link;
-	int class_idx;
+	unsigned long handle, obj;
 	struct size_class *class;
-
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	struct zspage *zspage;
 
 	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
 		return 0;
 
-	class_idx = get_size_class_index(size);
-	class = &pool->size_class[class_idx];
-	BUG_ON(class_idx != class->index);
+	handle = alloc_handle(pool, gfp);
+	if (!handle)
+		return 0;
+
+	/* extra space in chunk to keep the handle */
+	class = &pool->size_class[get_size_class_index(size + ZS_HANDLE_SIZE)];
 
 	spin_lock(&class->lock);
-	first_page = find_get_zspage(class);
+	zspage = find_get_zspage(class);
 
-	if (!first_page) {
+	if (!zspage) {
 		spin_unlock(&class->lock);
-		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		zspage = alloc_zspage(pool, class, gfp);
+		if (unlikely(!zspage)) {
+			free_handle(handle);
 			return 0;
+		}
 
-		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
+		set_zspage_movable(pool, zspage);
 		class->pages_allocated += class->pages_per_zspage;
+		class->objs_allocated += class->objs_per_zspage;
+		atomic_long_add(class->pages_per_zspage,
+					&pool->pages_allocated);
 	}
 
-	obj = (unsigned long)first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
+	obj = obj_malloc(class, zspage, handle);
 	/* Now move the zspage to another fullness group, if required */
-	fix_fullness_group(pool, first_page);
+	fix_fullness_group(class, zspage);
+	list_move(&zspage->lru, &class->lru);
+	record_obj(handle, obj);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return handle;
 }
-EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, unsigned long obj)
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ *
+ * On success, handle to the allocated object is returned,
+ * otherwise 0.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
 {
-	struct link_free *link;
-	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
+	return __zs_malloc(pool, size, pool->flags);
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
 
-	int class_idx;
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct page *f_page;
+	unsigned long obj, f_objidx;
+	struct zspage *zspage;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
-	first_page = get_first_page(f_page);
-
-	get_zspage_mapping(first_page, &class_idx, &fullness);
-	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+	/* keep compaction and migration from moving the object */
+	pin_tag(handle);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &f_page, &f_objidx);
+	zspage = get_zspage(f_page);
+	class = &pool->size_class[zspage->class];
 
 	spin_lock(&class->lock);
+	if (unlikely(zspage->under_reclaim)) {
+		/* zs_reclaim_page() finishes the job */
+		obj_mark_freed(class, obj);
+		spin_unlock(&class->lock);
+		unpin_tag(handle);
+		return;
+	}
 
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = (void *)obj;
-
-	first_page->inuse--;
-	fullness = fix_fullness_group(pool, first_page);
+	obj_free(class, obj);
+	fullness = fix_fullness_group(class, zspage);
 
-	if (fullness == ZS_EMPTY)
+	if (fullness == ZS_EMPTY) {
 		class->pages_allocated -= class->pages_per_zspage;
+		class->objs_allocated -= class->objs_per_zspage;
+		atomic_long_sub(class->pages_per_zspage,
+					&pool->pages_allocated);
+		free_zspage(pool, class, zspage);
+	}
 
 	spin_unlock(&class->lock);
-
-	if (fullness == ZS_EMPTY)
-		free_zspage(first_page);
+	unpin_tag(handle);
+	free_handle(handle);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
+/* Next class with zspages to reclaim, returned locked */
+static struct size_class *zs_reclaim_class(struct zs_pool *pool)
+{
+	struct size_class *class;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = &pool->size_class[pool->reclaim_class];
+		pool->reclaim_class = (pool->reclaim_class + 1) %
+						ZS_SIZE_CLASSES;
+
+		spin_lock(&class->lock);
+		if (!list_empty(&class->lru))
+			return class;
+		spin_unlock(&class->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * zs_reclaim_page - evict the objects of a zspage and free it
+ * @pool: pool to reclaim from
+ * @retries: number of zspages to try before giving up
+ *
+ * Takes the least recently allocated from zspage of a class, the
+ * classes being visited in turn, and calls the evict callback the pool
+ * was created with for every object in it. The callback is expected to
+ * write the object back and zs_free() it; an error from it ends the
+ * attempt on this zspage, which goes back to the head of the lru.
+ *
+ * Returns 0 once a zspage was freed, -EINVAL if the pool has no evict
+ * callback or @retries is 0, -EAGAIN if no zspage could be emptied.
+ */
+int zs_reclaim_page(struct zs_pool *pool, unsigned int retries)
+{
+	struct size_class *class;
+	struct zspage *zspage;
+	enum fullness_group fg;
+	unsigned long handle, head;
+	int i, ret;
+
+	if (!pool->ops || !pool->ops->evict || retries == 0)
+		return -EINVAL;
+
+	while (retries--) {
+		class = zs_reclaim_class(pool);
+		if (!class)
+			break;
+
+		zspage = list_entry(class->lru.prev, struct zspage, lru);
+		list_del_init(&zspage->lru);
+		remove_zspage(zspage, class, zspage->fullness);
+		zspage->under_reclaim = 1;
+		spin_unlock(&class->lock);
+
+		for (i = 0; i < class->objs_per_zspage; i++) {
+			spin_lock(&class->lock);
+			head = obj_header(class, zspage, i);
+			spin_unlock(&class->lock);
+			if ((head & OBJ_HEADER_TAGS) != OBJ_ALLOCATED_TAG)
+				continue;
+
+			handle = head & ~OBJ_HEADER_TAGS;
+			ret = pool->ops->evict(pool, handle);
+			if (ret)
+				break;
+		}
+
+		spin_lock(&class->lock);
+		zspage->under_reclaim = 0;
+		for (i = 0; i < class->objs_per_zspage; i++) {
+			head = obj_header(class, zspage, i);
+			if ((head & OBJ_HEADER_TAGS) != OBJ_HEADER_TAGS)
+				continue;
+
+			handle = head & ~OBJ_HEADER_TAGS;
+			obj_free(class, handle_to_obj(handle));
+			free_handle(handle);
+		}
+
+		fg = get_fullness_group(class, zspage);
+		zspage->fullness = fg;
+		if (fg == ZS_EMPTY) {
+			class->pages_allocated -= class->pages_per_zspage;
+			class->objs_allocated -= class->objs_per_zspage;
+			atomic_long_sub(class->pages_per_zspage,
+						&pool->pages_allocated);
+			free_zspage(pool, class, zspage);
+			spin_unlock(&class->lock);
+			return 0;
+		}
+
+		insert_zspage(zspage, class, fg);
+		list_add(&zspage->lru, &class->lru);
+		spin_unlock(&class->lock);
+	}
+
+	return -EAGAIN;
+}
+EXPORT_SYMBOL_GPL(zs_reclaim_page);
+
 /**
  * zs_map_object - get address of allocated object from handle.
  * @pool: pool from which the object was allocated
@@ -967,19 +1976,19 @@ EXPORT_SYMBOL_GPL(zs_free);
  * Only one object can be mapped per cpu at a time. There is no protection
  * against nested mappings.
  *
- * This function returns with preemption and page faults disabled.
+ * This function returns with preemption and page faults disabled. The
+ * object is pinned, compaction leaves it alone until it is unmapped.
 */
 void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 			enum zs_mapmode mm)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
-	unsigned int class_idx;
-	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
 	struct page *pages[2];
+	int hsize;
 
 	BUG_ON(!handle);
 
@@ -990,17 +1999,20 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	 */
 	BUG_ON(in_interrupt());
 
-	obj_handle_to_location(handle, &page, &obj_idx);
-	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
-	class = &pool->size_class[class_idx];
-	off = obj_idx_to_offset(page, obj_idx, class->size);
+	pin_tag(handle);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
+	class = &pool->size_class[get_zspage(page)->class];
+	off = obj_idx_to_offset(obj_idx, class->size);
+	/* the caller only sees what follows the handle */
+	hsize = class->huge ? 0 : ZS_HANDLE_SIZE;
 
 	area = &get_cpu_var(zs_map_area);
 	area->vm_mm = mm;
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-		return area->vm_addr + off;
+		return area->vm_addr + off + hsize;
 	}
 
 	/* this object spans two pages */
@@ -1008,26 +2020,26 @@ void *zs_map_object(struct zs_pool *pool, unsigned long handle,
 	pages[1] = get_next_page(page);
 	BUG_ON(!pages[1]);
 
-	return __zs_map_object(area, pages, off, class->size);
+	return __zs_map_object(area, pages, off + hsize, class->size - hsize);
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
 void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 {
 	struct page *page;
-	unsigned long obj_idx, off;
+	unsigned long obj, obj_idx, off;
 
-	unsigned int class_idx;
-	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
+	int hsize;
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
-	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
-	class = &pool->size_class[class_idx];
-	off = obj_idx_to_offset(page, obj_idx, class->size);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &page, &obj_idx);
+	class = &pool->size_class[get_zspage(page)->class];
+	off = obj_idx_to_offset(obj_idx, class->size);
+	hsize = class->huge ? 0 : ZS_HANDLE_SIZE;
 
 	area = &__get_cpu_var(zs_map_area);
 	if (off + class->size <= PAGE_SIZE)
@@ -1039,24 +2051,39 @@ void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
 		pages[1] = get_next_page(page);
 		BUG_ON(!pages[1]);
 
-		__zs_unmap_object(area, pages, off, class->size);
+		__zs_unmap_object(area, pages, off + hsize,
+					class->size - hsize);
 	}
 	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
-u64 zs_get_total_size_bytes(struct zs_pool *pool)
+/**
+ * zs_get_total_pages - number of pages currently backing the pool
+ * @pool: pool to query
+ *
+ * Cheap enough to be called on every allocation.
+ */
+unsigned long zs_get_total_pages(struct zs_pool *pool)
 {
-	int i;
-	u64 npages = 0;
-
-	for (i = 0; i < ZS_SIZE_CLASSES; i++)
-		npages += pool->size_class[i].pages_allocated;
+	return atomic_long_read(&pool->pages_allocated);
+}
+EXPORT_SYMBOL_GPL(zs_get_total_pages);
 
-	return npages << PAGE_SHIFT;
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)zs_get_total_pages(pool) << PAGE_SHIFT;
 }
 EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
 
+/* Pages given back by zs_compact() over the lifetime of the pool */
+unsigned long zs_get_compacted_pages(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_compacted_pages);
+
 module_init(zs_init);
 module_exit(zs_exit);
 
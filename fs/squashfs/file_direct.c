@@ -0,0 +1,146 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2002, 2003, 2004, 2005, 2006, 2007, 2008, 2009
+ * Phillip Lougher <phillip@squashfs.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * file_direct.c
+ */
+
+/*
+ * This file implements decompression of file datablocks straight into the
+ * page cache.  The datablock is normally decompressed into the "data" cache
+ * and then copied into the page cache pages it covers; when all of these
+ * pages can be grabbed, and none of them is uptodate already, they are
+ * handed to the decompressor directly instead, through a page actor which
+ * maps them one at a time.
+ */
+
+#include <linux/fs.h>
+#include <linux/vfs.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "squashfs_fs_i.h"
+#include "squashfs.h"
+#include "page_actor.h"
+
+/*
+ * Read the datablock <block, bsize> that target_page belongs to straight
+ * into the page cache.  Returns -EAGAIN if this is not possible and the
+ * caller should go through the cache instead.  On any return other than 0
+ * target_page is left locked and not uptodate.
+ */
+int squashfs_readpage_block(struct page *target_page, u64 block, int bsize)
+{
+	struct inode *inode = target_page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int file_end = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target_page->index & ~mask;
+	int end_index = start_index | mask;
+	int i, n, pages, bytes, res = -EAGAIN;
+	struct squashfs_page_actor *actor;
+	struct page **page;
+	void *pageaddr;
+
+	if (end_index > file_end)
+		end_index = file_end;
+	pages = end_index - start_index + 1;
+
+	/*
+	 * An uncompressed block is copied as is, make sure a corrupted length
+	 * cannot take it past the pages of a short final block.
+	 */
+	if (!SQUASHFS_COMPRESSED_BLOCK(bsize) &&
+			SQUASHFS_COMPRESSED_SIZE_BLOCK(bsize) >
+			pages << PAGE_CACHE_SHIFT)
+		return -EAGAIN;
+
+	page = kmalloc(pages * sizeof(*page), GFP_KERNEL);
+	if (page == NULL)
+		return -EAGAIN;
+
+	actor = squashfs_page_actor_init_special(page, pages,
+						msblk->block_size);
+	if (actor == NULL)
+		goto free_page;
+
+	/*
+	 * Grab every page the datablock covers.  If one is missing or
+	 * already uptodate the block is not being read as a whole.
+	 */
+	for (i = 0, n = start_index; n <= end_index; i++, n++) {
+		page[i] = (n == target_page->index) ? target_page :
+			grab_cache_page_nowait(target_page->mapping, n);
+
+		if (page[i] == NULL)
+			goto release_pages;
+
+		if (PageUptodate(page[i])) {
+			i++;
+			goto release_pages;
+		}
+	}
+
+	res = squashfs_read_data(inode->i_sb, block, bsize, NULL, actor);
+
+	/* zero whatever the datablock did not fill */
+	for (i = res >> PAGE_CACHE_SHIFT, bytes = res & (PAGE_CACHE_SIZE - 1);
+			res >= 0 && i < pages; i++, bytes = 0) {
+		pageaddr = kmap_atomic(page[i]);
+		memset(pageaddr + bytes, 0, PAGE_CACHE_SIZE - bytes);
+		kunmap_atomic(pageaddr);
+	}
+
+	if (res < 0) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+		i = pages;
+		goto release_pages;
+	}
+
+	for (i = 0; i < pages; i++) {
+		flush_dcache_page(page[i]);
+		SetPageUptodate(page[i]);
+		unlock_page(page[i]);
+		if (page[i] != target_page)
+			page_cache_release(page[i]);
+	}
+
+	kfree(actor);
+	kfree(page);
+	return 0;
+
+release_pages:
+	/* pages 0 to i - 1 were grabbed */
+	while (i--) {
+		if (page[i] == target_page)
+			continue;
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+	}
+	kfree(actor);
+free_page:
+	kfree(page);
+	return res;
+}
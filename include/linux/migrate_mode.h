@@ -1,5 +1,8 @@
 #ifndef MIGRATE_MODE_H_INCLUDED
 #define MIGRATE_MODE_H_INCLUDED
+
+#include <linux/types.h>
+
 /*
  * MIGRATE_ASYNC means never block
  * MIGRATE_SYNC_LIGHT in the current implementation means to allow blocking
@@ -13,4 +16,7 @@ enum migrate_mode {
 	MIGRATE_SYNC,
 };
 
+/* LRU Isolation modes, also passed to ->isolate_page() of movable pages */
+typedef unsigned __bitwise__ isolate_mode_t;
+
 #endif		/* MIGRATE_MODE_H_INCLUDED */
@@ -775,7 +775,10 @@ void page_address_init(void);
  * and then page->mapping points, not to an anon_vma, but to a private
  * structure which KSM associates with that merged page.  See ksm.h.
  *
- * PAGE_MAPPING_KSM without PAGE_MAPPING_ANON is currently never used.
+ * PAGE_MAPPING_KSM without PAGE_MAPPING_ANON is used for non-lru movable
+ * pages (PAGE_MAPPING_MOVABLE): page->mapping points to an address_space
+ * whose a_ops know how to isolate and migrate the page. See
+ * __SetPageMovable().
  *
  * Please note that, confusingly, "page_mapping" refers to the inode
  * address_space which maps the page from disk; whereas "page_mapped"
@@ -783,6 +786,7 @@ void page_address_init(void);
  */
 #define PAGE_MAPPING_ANON	1
 #define PAGE_MAPPING_KSM	2
+#define PAGE_MAPPING_MOVABLE	2
 #define PAGE_MAPPING_FLAGS	(PAGE_MAPPING_ANON | PAGE_MAPPING_KSM)
 
 extern struct address_space *page_mapping(struct page *page);
@@ -809,6 +813,16 @@ static inline int PageAnon(struct page *page)
 	return ((unsigned long)page->mapping & PAGE_MAPPING_ANON) != 0;
 }
 
+/*
+ * Tagged as a non-lru movable page. The owner may already have let go of
+ * it, PageMovable() tells whether it still can be migrated.
+ */
+static inline int __PageMovable(struct page *page)
+{
+	return ((unsigned long)page->mapping & PAGE_MAPPING_FLAGS) ==
+				PAGE_MAPPING_MOVABLE;
+}
+
 /*
  * Return the pagecache index of the passed page.  Regular pagecache pages
  * use ->index whereas swapcache pages use ->private
@@ -17,6 +17,7 @@
 #include <linux/pageblock-flags.h>
 #include <generated/bounds.h>
 #include <linux/atomic.h>
+#include <linux/migrate_mode.h>
 #include <asm/page.h>
 
 /* Free memory management - zoned buddy allocator.  */
@@ -180,9 +181,6 @@ struct lruvec {
 /* Isolate for asynchronous migration */
 #define ISOLATE_ASYNC_MIGRATE	((__force isolate_mode_t)0x10)
 
-/* LRU Isolation modes. */
-typedef unsigned __bitwise__ isolate_mode_t;
-
 enum zone_watermarks {
 	WMARK_MIN,
 	WMARK_LOW,
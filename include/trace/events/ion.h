@@ -0,0 +1,101 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ion
+
+#if !defined(_TRACE_ION_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_ION_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+struct ion_buffer;
+struct ion_heap;
+
+TRACE_EVENT(ion_alloc_buffer,
+
+	TP_PROTO(struct ion_heap *heap, struct ion_buffer *buf,
+		 unsigned long len, unsigned long flags, s64 us, int ret),
+
+	TP_ARGS(heap, buf, len, flags, us, ret),
+
+	TP_STRUCT__entry(
+		__string(	heap_name,	heap->name ? heap->name : "")
+		__field(	void *,		buffer		)
+		__field(	unsigned long,	len		)
+		__field(	unsigned long,	flags		)
+		__field(	s64,		us		)
+		__field(	int,		ret		)
+	),
+
+	TP_fast_assign(
+		__assign_str(heap_name, heap->name ? heap->name : "");
+		__entry->buffer	= buf;
+		__entry->len	= len;
+		__entry->flags	= flags;
+		__entry->us	= us;
+		__entry->ret	= ret;
+	),
+
+	TP_printk("heap=%s buffer=%p len=%lu flags=0x%lx us=%lld ret=%d",
+		  __get_str(heap_name), __entry->buffer, __entry->len,
+		  __entry->flags, __entry->us, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(ion_buffer_class,
+
+	TP_PROTO(struct ion_heap *heap, struct ion_buffer *buf,
+		 size_t size),
+
+	TP_ARGS(heap, buf, size),
+
+	TP_STRUCT__entry(
+		__string(	heap_name,	heap->name ? heap->name : "")
+		__field(	void *,		buffer		)
+		__field(	size_t,		size		)
+	),
+
+	TP_fast_assign(
+		__assign_str(heap_name, heap->name ? heap->name : "");
+		__entry->buffer	= buf;
+		__entry->size	= size;
+	),
+
+	TP_printk("heap=%s buffer=%p size=%zu",
+		  __get_str(heap_name), __entry->buffer, __entry->size)
+);
+
+DEFINE_EVENT(ion_buffer_class, ion_free_buffer,
+
+	TP_PROTO(struct ion_heap *heap, struct ion_buffer *buf,
+		 size_t size),
+
+	TP_ARGS(heap, buf, size)
+);
+
+DEFINE_EVENT(ion_buffer_class, ion_map_kernel,
+
+	TP_PROTO(struct ion_heap *heap, struct ion_buffer *buf,
+		 size_t size),
+
+	TP_ARGS(heap, buf, size)
+);
+
+DEFINE_EVENT(ion_buffer_class, ion_map_user,
+
+	TP_PROTO(struct ion_heap *heap, struct ion_buffer *buf,
+		 size_t size),
+
+	TP_ARGS(heap, buf, size)
+);
+
+DEFINE_EVENT(ion_buffer_class, ion_map_dma,
+
+	TP_PROTO(struct ion_heap *heap, struct ion_buffer *buf,
+		 size_t size),
+
+	TP_ARGS(heap, buf, size)
+);
+
+#endif /* _TRACE_ION_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -221,8 +221,12 @@ static void acct_isolated(struct zone *zone, struct compact_control *cc)
 	struct page *page;
 	unsigned int count[2] = { 0, };
 
-	list_for_each_entry(page, &cc->migratepages, lru)
+	list_for_each_entry(page, &cc->migratepages, lru) {
+		/* non-lru movable pages are not accounted as isolated */
+		if (unlikely(__PageMovable(page)))
+			continue;
 		count[!!page_is_file_cache(page)]++;
+	}
 
 	__mod_zone_page_state(zone, NR_ISOLATED_ANON, count[0]);
 	__mod_zone_page_state(zone, NR_ISOLATED_FILE, count[1]);
@@ -358,8 +362,23 @@ static isolate_migrate_t isolate_migratepages(struct zone *zone,
 			continue;
 		}
 
-		if (!PageLRU(page))
-			continue;
+		if (!PageLRU(page)) {
+			bool isolated;
+
+			/*
+			 * Pages of drivers like zsmalloc are off the lru but
+			 * can still be migrated through their owner.
+			 */
+			if (!__PageMovable(page) || PageIsolated(page))
+				continue;
+
+			spin_unlock_irq(&zone->lru_lock);
+			isolated = !isolate_movable_page(page, mode);
+			spin_lock_irq(&zone->lru_lock);
+			if (!isolated)
+				continue;
+			goto isolate_success;
+		}
 
 		/*
 		 * PageLRU is set, and lru_lock excludes isolation,
@@ -382,6 +401,7 @@ static isolate_migrate_t isolate_migratepages(struct zone *zone,
 
 		/* Successfully isolated */
 		del_page_from_lru_list(zone, page, page_lru(page));
+isolate_success:
 		list_add(&page->lru, migratelist);
 		cc->nr_migratepages++;
 		nr_isolated++;
@@ -3494,6 +3494,13 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	if (unlikely(is_vm_hugetlb_page(vma)))
 		return hugetlb_fault(mm, vma, address, flags);
 
+	/*
+	 * The lowmemorykiller reaper has unmapped this killed process's
+	 * anonymous memory: fail rather than fault in zeroed pages.
+	 */
+	if (unlikely(test_bit(MMF_UNSTABLE, &mm->flags) && vma->anon_vma))
+		return VM_FAULT_SIGBUS;
+
 retry:
 	pgd = pgd_offset(mm, address);
 	pud = pud_alloc(mm, pgd, address);
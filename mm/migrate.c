@@ -68,6 +68,7 @@ int migrate_prep_local(void)
 /*
  * Add isolated pages on the list back to the LRU under page lock
  * to avoid leaking evictable pages back onto unevictable list.
+ * Non-lru movable pages are handed back to their owner instead.
  */
 void putback_lru_pages(struct list_head *l)
 {
@@ -76,12 +77,111 @@ void putback_lru_pages(struct list_head *l)
 
 	list_for_each_entry_safe(page, page2, l, lru) {
 		list_del(&page->lru);
+		if (unlikely(__PageMovable(page))) {
+			putback_movable_page(page);
+			put_page(page);
+			continue;
+		}
 		dec_zone_page_state(page, NR_ISOLATED_ANON +
 				page_is_file_cache(page));
 		putback_lru_page(page);
 	}
 }
 
+/*
+ * Non-lru movable pages
+ *
+ * A driver that wants its pages to be moved by compaction points
+ * page->mapping at an address_space providing ->isolate_page(),
+ * ->migratepage() and ->putback_page() and tags the page with
+ * __SetPageMovable(). Those callbacks are called with the page locked.
+ * On success ->migratepage() must set up the new page with
+ * __SetPageMovable(), keep a reference to it, and release the old one.
+ *
+ * The driver releases a page with __ClearPageMovable(), holding the page
+ * lock, before dropping its reference. The page stays tagged so that an isolated page can
+ * still be told apart from an lru page; the tag is cleared when the
+ * page is freed.
+ */
+int PageMovable(struct page *page)
+{
+	struct address_space *mapping;
+
+	if (!__PageMovable(page))
+		return 0;
+
+	mapping = page_mapping(page);
+	return mapping && mapping->a_ops && mapping->a_ops->isolate_page;
+}
+
+void __SetPageMovable(struct page *page, struct address_space *mapping)
+{
+	VM_BUG_ON((unsigned long)mapping & PAGE_MAPPING_MOVABLE);
+	page->mapping = (void *)((unsigned long)mapping |
+					PAGE_MAPPING_MOVABLE);
+}
+EXPORT_SYMBOL(__SetPageMovable);
+
+void __ClearPageMovable(struct page *page)
+{
+	/* keep the tag, see above */
+	page->mapping = (void *)PAGE_MAPPING_MOVABLE;
+}
+EXPORT_SYMBOL(__ClearPageMovable);
+
+/*
+ * Take a non-lru movable page for migration. The caller must not hold
+ * a reference to the page. Returns 0 with a reference held on success.
+ */
+int isolate_movable_page(struct page *page, isolate_mode_t mode)
+{
+	struct address_space *mapping;
+
+	/* The page may be freed under us, so check it with a reference */
+	if (unlikely(!get_page_unless_zero(page)))
+		goto out;
+
+	/* __PageMovable() may be a false positive until the page is locked */
+	if (unlikely(!__PageMovable(page)))
+		goto out_putpage;
+	if (unlikely(!trylock_page(page)))
+		goto out_putpage;
+
+	if (!PageMovable(page) || PageIsolated(page))
+		goto out_no_isolated;
+
+	mapping = page_mapping(page);
+	if (!mapping->a_ops->isolate_page(page, mode))
+		goto out_no_isolated;
+
+	SetPageIsolated(page);
+	unlock_page(page);
+
+	return 0;
+
+out_no_isolated:
+	unlock_page(page);
+out_putpage:
+	put_page(page);
+out:
+	return -EBUSY;
+}
+
+/* Give an isolated page back to its owner, if it still wants it */
+void putback_movable_page(struct page *page)
+{
+	struct address_space *mapping;
+
+	lock_page(page);
+	VM_BUG_ON(!PageIsolated(page));
+	if (PageMovable(page)) {
+		mapping = page_mapping(page);
+		mapping->a_ops->putback_page(page);
+	}
+	ClearPageIsolated(page);
+	unlock_page(page);
+}
+
 /*
  * Restore a potential migration pte to a working pte entry
  */
@@ -640,6 +740,22 @@ static int move_to_new_page(struct page *newpage, struct page *page,
 	if (!trylock_page(newpage))
 		BUG();
 
+	if (unlikely(__PageMovable(page))) {
+		VM_BUG_ON(!PageIsolated(page));
+		/* The owner let go of the page after it was isolated */
+		if (!PageMovable(page))
+			rc = 0;
+		else {
+			mapping = page_mapping(page);
+			rc = mapping->a_ops->migratepage(mapping,
+							newpage, page, mode);
+		}
+		if (!rc)
+			ClearPageIsolated(page);
+		unlock_page(newpage);
+		return rc;
+	}
+
 	/* Prepare mapping for the new page.*/
 	newpage->index = page->index;
 	newpage->mapping = page->mapping;
@@ -720,6 +836,12 @@ static int __unmap_and_move(struct page *page, struct page *newpage,
 		goto unlock;
 	}
 
+	/* Non-lru pages are not mapped, charged or written back */
+	if (unlikely(__PageMovable(page))) {
+		rc = move_to_new_page(newpage, page, 0, mode);
+		goto unlock;
+	}
+
 	/* charge against new page */
 	charge = mem_cgroup_prepare_migration(page, newpage, &mem, GFP_KERNEL);
 	if (charge == -ENOMEM) {
@@ -835,12 +957,15 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 	int rc = 0;
 	int *result = NULL;
 	struct page *newpage = get_new_page(page, private, &result);
+	bool is_lru = !__PageMovable(page);
 
 	if (!newpage)
 		return -ENOMEM;
 
 	if (page_count(page) == 1) {
 		/* page was freed from under us. So we are done. */
+		if (unlikely(!is_lru))
+			ClearPageIsolated(page);
 		goto out;
 	}
 
@@ -858,15 +983,25 @@ out:
 		 * restored.
 		 */
 		list_del(&page->lru);
-		dec_zone_page_state(page, NR_ISOLATED_ANON +
-				page_is_file_cache(page));
-		putback_lru_page(page);
+		if (likely(is_lru)) {
+			dec_zone_page_state(page, NR_ISOLATED_ANON +
+					page_is_file_cache(page));
+			putback_lru_page(page);
+		} else {
+			if (rc)
+				putback_movable_page(page);
+			put_page(page);
+		}
 	}
 	/*
 	 * Move the new page to the LRU. If migration was not successful
-	 * then this will free the page.
+	 * then this will free the page. The owner of a non-lru page took
+	 * its own reference.
 	 */
-	putback_lru_page(newpage);
+	if (likely(is_lru))
+		putback_lru_page(newpage);
+	else
+		put_page(newpage);
 	if (result) {
 		if (rc)
 			*result = rc;
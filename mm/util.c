@@ -358,6 +358,9 @@ struct address_space *page_mapping(struct page *page)
 #endif
 	if ((unsigned long)mapping & PAGE_MAPPING_ANON)
 		mapping = NULL;
+	else if ((unsigned long)mapping & PAGE_MAPPING_MOVABLE)
+		mapping = (void *)((unsigned long)mapping &
+					~PAGE_MAPPING_MOVABLE);
 	return mapping;
 }
 
@@ -0,0 +1,229 @@
+/*
+ * Global memory pressure from reclaim efficiency
+ *
+ * Reclaim reports how many pages it scanned and how many of those it
+ * managed to reclaim. Once a window's worth of pages has been scanned,
+ * the ratio is turned into a pressure value from 0 (everything scanned
+ * was reclaimed) to 100 (nothing was), which is passed to the registered
+ * notifiers and published in /sys/kernel/mm/vmpressure/. The 'level'
+ * file there can be poll()ed for POLLPRI, it is notified for every window
+ * at medium pressure or above and whenever the level changes.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/swap.h>
+#include <linux/log2.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/notifier.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/module.h>
+#include <linux/vmpressure.h>
+
+/*
+ * The window size is the number of scanned pages before we try to
+ * analyze the scanned/reclaimed ratio. Using SWAP_CLUSTER_MAX * 16
+ * (2MB with 4KB pages) keeps the notification rate sane while still
+ * reacting within a couple of reclaim passes.
+ */
+static const unsigned long vmpressure_win = SWAP_CLUSTER_MAX * 16;
+
+/* Pressure (in percent) at which the medium and critical levels start */
+static const unsigned int vmpressure_level_med = 60;
+static const unsigned int vmpressure_level_critical = 95;
+
+/*
+ * Reclaim getting down to this priority means it had to scan a large
+ * part of the LRUs without getting enough back: report the window as
+ * critical regardless of how much the last pass reclaimed.
+ */
+static const unsigned int vmpressure_level_critical_prio = ilog2(100 / 10);
+
+static DEFINE_SPINLOCK(vmpressure_lock);
+static unsigned long vmpressure_scanned;
+static unsigned long vmpressure_reclaimed;
+
+static unsigned int vmpressure_last;
+static enum vmpressure_levels vmpressure_last_level;
+
+static BLOCKING_NOTIFIER_HEAD(vmpressure_notifier);
+static struct kobject *vmpressure_kobj;
+
+static const char * const vmpressure_str_levels[] = {
+	[VMPRESSURE_LOW] = "low",
+	[VMPRESSURE_MEDIUM] = "medium",
+	[VMPRESSURE_CRITICAL] = "critical",
+};
+
+static enum vmpressure_levels vmpressure_level(unsigned int pressure)
+{
+	if (pressure >= vmpressure_level_critical)
+		return VMPRESSURE_CRITICAL;
+	else if (pressure >= vmpressure_level_med)
+		return VMPRESSURE_MEDIUM;
+	return VMPRESSURE_LOW;
+}
+
+static unsigned int vmpressure_calc(unsigned long scanned,
+				    unsigned long reclaimed)
+{
+	/* slab and soft reclaim can hand back more than was scanned */
+	if (reclaimed >= scanned)
+		return 0;
+
+	return 100 - reclaimed * 100 / scanned;
+}
+
+static void vmpressure_work_fn(struct work_struct *work)
+{
+	unsigned long scanned, reclaimed;
+	unsigned int pressure;
+	enum vmpressure_levels level;
+
+	spin_lock(&vmpressure_lock);
+	scanned = vmpressure_scanned;
+	reclaimed = vmpressure_reclaimed;
+	vmpressure_scanned = 0;
+	vmpressure_reclaimed = 0;
+	spin_unlock(&vmpressure_lock);
+
+	if (!scanned)
+		return;
+
+	pressure = vmpressure_calc(scanned, reclaimed);
+	level = vmpressure_level(pressure);
+
+	vmpressure_last = pressure;
+	blocking_notifier_call_chain(&vmpressure_notifier, pressure, NULL);
+
+	if (vmpressure_kobj && (level != VMPRESSURE_LOW ||
+				level != vmpressure_last_level))
+		sysfs_notify(vmpressure_kobj, NULL, "level");
+	vmpressure_last_level = level;
+}
+
+static DECLARE_WORK(vmpressure_work, vmpressure_work_fn);
+
+/**
+ * vmpressure() - Account memory pressure through scanned/reclaimed ratio
+ * @gfp:	reclaimer's gfp mask
+ * @scanned:	number of pages scanned
+ * @reclaimed:	number of pages reclaimed
+ *
+ * This function should be called from the vmscan reclaim path to account
+ * "instantaneous" memory pressure (scanned/reclaimed ratio). Pressure
+ * is computed and reported once a whole window has been accumulated.
+ *
+ * This function does not return any value.
+ */
+void vmpressure(gfp_t gfp, unsigned long scanned, unsigned long reclaimed)
+{
+	unsigned long s;
+
+	/*
+	 * Only account reclaim that could have used any kind of page:
+	 * an allocation restricted to, say, lowmem or non-IO pages
+	 * failing to reclaim says little about the overall state.
+	 */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&vmpressure_lock);
+	vmpressure_scanned += scanned;
+	vmpressure_reclaimed += reclaimed;
+	s = vmpressure_scanned;
+	spin_unlock(&vmpressure_lock);
+
+	if (s < vmpressure_win)
+		return;
+	schedule_work(&vmpressure_work);
+}
+
+/**
+ * vmpressure_prio() - Account memory pressure through reclaimer priority level
+ * @gfp:	reclaimer's gfp mask
+ * @prio:	reclaimer's priority
+ *
+ * This function should be called from the reclaim path every time when
+ * the vmscan's reclaiming priority (scanning depth) changes.
+ *
+ * This function does not return any value.
+ */
+void vmpressure_prio(gfp_t gfp, int prio)
+{
+	if (prio > vmpressure_level_critical_prio)
+		return;
+
+	/* a full window with nothing reclaimed reads as critical */
+	vmpressure(gfp, vmpressure_win, 0);
+}
+
+int vmpressure_notifier_register(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_register(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_register);
+
+int vmpressure_notifier_unregister(struct notifier_block *nb)
+{
+	return blocking_notifier_chain_unregister(&vmpressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(vmpressure_notifier_unregister);
+
+static ssize_t pressure_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", vmpressure_last);
+}
+static struct kobj_attribute pressure_attr = __ATTR_RO(pressure);
+
+static ssize_t level_show(struct kobject *kobj,
+			  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n",
+		       vmpressure_str_levels[vmpressure_last_level]);
+}
+static struct kobj_attribute level_attr = __ATTR_RO(level);
+
+static struct attribute *vmpressure_attrs[] = {
+	&pressure_attr.attr,
+	&level_attr.attr,
+	NULL,
+};
+
+static struct attribute_group vmpressure_attr_group = {
+	.attrs = vmpressure_attrs,
+};
+
+static int __init vmpressure_init(void)
+{
+	struct kobject *kobj;
+	int err;
+
+	kobj = kobject_create_and_add("vmpressure", mm_kobj);
+	if (!kobj) {
+		printk(KERN_ERR "vmpressure: failed to create sysfs kobject\n");
+		return -ENOMEM;
+	}
+
+	err = sysfs_create_group(kobj, &vmpressure_attr_group);
+	if (err) {
+		printk(KERN_ERR "vmpressure: failed to register sysfs group\n");
+		kobject_put(kobj);
+		return err;
+	}
+
+	vmpressure_kobj = kobj;
+	return 0;
+}
+late_initcall(vmpressure_init);
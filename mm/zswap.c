@@ -34,7 +34,8 @@
 #include <linux/swap.h>
 #include <linux/crypto.h>
 #include <linux/mempool.h>
-#include <linux/zbud.h>
+#include <linux/zpool.h>
+#include <linux/blkdev.h>
 
 #include <linux/mm_types.h>
 #include <linux/page-flags.h>
@@ -49,6 +50,8 @@
 static u64 zswap_pool_pages;
 /* The number of compressed pages currently stored in zswap */
 static atomic_t zswap_stored_pages = ATOMIC_INIT(0);
+/* The number of same-value filled pages currently stored in zswap */
+static atomic_t zswap_same_filled_pages = ATOMIC_INIT(0);
 
 /*
  * The statistics below are not protected from concurrent access for
@@ -84,11 +87,57 @@ module_param_named(enabled, zswap_enabled, bool, 0);
 static char *zswap_compressor = ZSWAP_COMPRESSOR_DEFAULT;
 module_param_named(compressor, zswap_compressor, charp, 0);
 
+/*
+ * Allocator backing the compressed pool. A change is checked against the
+ * registered zpool drivers and applies to swap areas enabled afterwards.
+ */
+#define ZSWAP_ZPOOL_DEFAULT "zbud"
+static char zswap_zpool_type[32] = ZSWAP_ZPOOL_DEFAULT;
+static bool zswap_init_started;
+
+static int zswap_zpool_param_set(const char *val,
+				const struct kernel_param *kp)
+{
+	char buf[sizeof(zswap_zpool_type)];
+	char *type;
+
+	strlcpy(buf, val, sizeof(buf));
+	type = strim(buf);
+
+	/* no drivers are registered yet while the command line is parsed */
+	if (zswap_init_started && !zpool_has_pool(type)) {
+		pr_err("zpool %s not available\n", type);
+		return -ENOENT;
+	}
+
+	return param_set_copystring(type, kp);
+}
+
+static struct kernel_param_ops zswap_zpool_param_ops = {
+	.set = zswap_zpool_param_set,
+	.get = param_get_string,
+};
+
+static struct kparam_string zswap_zpool_kparam = {
+	.maxlen = sizeof(zswap_zpool_type),
+	.string = zswap_zpool_type,
+};
+module_param_cb(zpool, &zswap_zpool_param_ops, &zswap_zpool_kparam, 0644);
+
 /* The maximum percentage of memory that the compressed pool can occupy */
 static unsigned int zswap_max_pool_percent = 20;
 module_param_named(max_pool_percent,
 			zswap_max_pool_percent, uint, 0644);
 
+/* Store pages filled with one repeated word as that word, uncompressed */
+static bool zswap_same_filled_pages_enabled = true;
+module_param_named(same_filled_pages_enabled,
+			zswap_same_filled_pages_enabled, bool, 0644);
+
+/* Pool pages written back per pass once the pool limit is hit */
+static unsigned int zswap_writeback_batch = SWAP_CLUSTER_MAX;
+module_param_named(writeback_batch, zswap_writeback_batch, uint, 0644);
+
 /*********************************
 * compression functions
 **********************************/
@@ -165,16 +214,21 @@ static void zswap_comp_exit(void)
  *            be held while changing the refcount.  Since the lock must
  *            be held, there is no reason to also make refcount atomic.
  * offset - the swap offset for the entry.  Index into the red-black tree.
- * handle - zsmalloc allocation handle that stores the compressed page data
+ * handle - zpool allocation handle that stores the compressed page data
+ * value - the word a same-value filled page is made of
  * length - the length in bytes of the compressed page data.  Needed during
- *           decompression
+ *           decompression.  0 for a same-value filled page, which has no
+ *           zpool allocation.
  */
 struct zswap_entry {
 	struct rb_node rbnode;
 	pgoff_t offset;
 	int refcount;
 	unsigned int length;
-	unsigned long handle;
+	union {
+		unsigned long handle;
+		unsigned long value;
+	};
 };
 
 struct zswap_header {
@@ -189,7 +243,7 @@ struct zswap_header {
 struct zswap_tree {
 	struct rb_root rbroot;
 	spinlock_t lock;
-	struct zbud_pool *pool;
+	struct zpool *pool;
 };
 
 static struct zswap_tree *zswap_trees[MAX_SWAPFILES];
@@ -362,22 +416,76 @@ cleanup:
 /*********************************
 * helpers
 **********************************/
+/*
+ * Write back up to zswap_writeback_batch pool pages to make room.  The
+ * swap writes are plugged, so the bios of one pass get merged before
+ * they reach the swap device.  Succeeds if anything was freed.
+ */
+static int zswap_shrink(struct zswap_tree *tree)
+{
+	struct blk_plug plug;
+	unsigned int reclaimed = 0;
+	int ret;
+
+	blk_start_plug(&plug);
+	ret = zpool_shrink(tree->pool, max(zswap_writeback_batch, 1U),
+				&reclaimed);
+	blk_finish_plug(&plug);
+
+	return reclaimed ? 0 : ret;
+}
+
 static bool zswap_is_full(void)
 {
 	return (totalram_pages * zswap_max_pool_percent / 100 <
 		zswap_pool_pages);
 }
 
+/*
+ * Check whether the page is filled with a single repeated word, e.g.
+ * all zeroes, and return that word in value.
+ */
+static bool zswap_is_page_same_filled(void *ptr, unsigned long *value)
+{
+	unsigned long *page = ptr;
+	unsigned int pos;
+
+	for (pos = 1; pos < PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
+			return false;
+	}
+
+	*value = page[0];
+	return true;
+}
+
+static void zswap_fill_page(void *ptr, unsigned long value)
+{
+	unsigned long *page = ptr;
+	unsigned int pos;
+
+	if (!value) {
+		memset(ptr, 0, PAGE_SIZE);
+		return;
+	}
+
+	for (pos = 0; pos < PAGE_SIZE / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
 /*
  * Carries out the common pattern of freeing and entry's zsmalloc allocation,
  * freeing the entry itself, and decrementing the number of stored pages.
  */
 static void zswap_free_entry(struct zswap_tree *tree, struct zswap_entry *entry)
 {
-	zbud_free(tree->pool, entry->handle);
+	if (!entry->length)
+		atomic_dec(&zswap_same_filled_pages);
+	else
+		zpool_free(tree->pool, entry->handle);
 	zswap_entry_cache_free(entry);
 	atomic_dec(&zswap_stored_pages);
-	zswap_pool_pages = zbud_get_pool_size(tree->pool);
+	zswap_pool_pages = zpool_get_total_size(tree->pool) >> PAGE_SHIFT;
 }
 
 /*********************************
@@ -492,7 +600,7 @@ static int zswap_get_swap_cache_page(swp_entry_t entry,
  * the swap cache, the compressed version stored by zswap can be
  * freed.
  */
-static int zswap_writeback_entry(struct zbud_pool *pool, unsigned long handle)
+static int zswap_writeback_entry(struct zpool *pool, unsigned long handle)
 {
 	struct zswap_header *zhdr;
 	swp_entry_t swpentry;
@@ -508,9 +616,9 @@ static int zswap_writeback_entry(struct zbud_pool *pool, unsigned long handle)
 	};
 
 	/* extract swpentry from data */
-	zhdr = zbud_map(pool, handle);
+	zhdr = zpool_map_handle(pool, handle, ZPOOL_MM_RO);
 	swpentry = zhdr->swpentry; /* here */
-	zbud_unmap(pool, handle);
+	zpool_unmap_handle(pool, handle);
 	tree = zswap_trees[swp_type(swpentry)];
 	offset = swp_offset(swpentry);
 	BUG_ON(pool != tree->pool);
@@ -518,8 +626,8 @@ static int zswap_writeback_entry(struct zbud_pool *pool, unsigned long handle)
 	/* find and ref zswap entry */
 	spin_lock(&tree->lock);
 	entry = zswap_rb_search(&tree->rbroot, offset);
-	if (!entry) {
-		/* entry was invalidated */
+	if (!entry || !entry->length || entry->handle != handle) {
+		/* entry was invalidated, possibly stored again since */
 		spin_unlock(&tree->lock);
 		return 0;
 	}
@@ -542,13 +650,13 @@ static int zswap_writeback_entry(struct zbud_pool *pool, unsigned long handle)
 	case ZSWAP_SWAPCACHE_NEW: /* page is locked */
 		/* decompress */
 		dlen = PAGE_SIZE;
-		src = (u8 *)zbud_map(tree->pool, entry->handle) +
-			sizeof(struct zswap_header);
+		src = (u8 *)zpool_map_handle(tree->pool, entry->handle,
+				ZPOOL_MM_RO) + sizeof(struct zswap_header);
 		dst = kmap_atomic(page);
 		ret = zswap_comp_op(ZSWAP_COMPOP_DECOMPRESS, src,
 				entry->length, dst, &dlen);
 		kunmap_atomic(dst);
-		zbud_unmap(tree->pool, entry->handle);
+		zpool_unmap_handle(tree->pool, entry->handle);
 		BUG_ON(ret);
 		BUG_ON(dlen != PAGE_SIZE);
 
@@ -611,16 +719,24 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 	char *buf;
 	u8 *src, *dst;
 	struct zswap_header *zhdr;
+	unsigned long value;
+	bool same_filled = false;
 
 	if (!tree) {
 		ret = -ENODEV;
 		goto reject;
 	}
 
-	/* reclaim space if needed */
-	if (zswap_is_full()) {
+	if (zswap_same_filled_pages_enabled) {
+		src = kmap_atomic(page);
+		same_filled = zswap_is_page_same_filled(src, &value);
+		kunmap_atomic(src);
+	}
+
+	/* reclaim space if needed, same-value filled pages need none */
+	if (!same_filled && zswap_is_full()) {
 		zswap_pool_limit_hit++;
-		if (zbud_reclaim_page(tree->pool, 8)) {
+		if (zswap_shrink(tree)) {
 			zswap_reject_reclaim_fail++;
 			ret = -ENOMEM;
 			goto reject;
@@ -635,6 +751,14 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 		goto reject;
 	}
 
+	if (same_filled) {
+		entry->offset = offset;
+		entry->length = 0;
+		entry->value = value;
+		atomic_inc(&zswap_same_filled_pages);
+		goto insert;
+	}
+
 	/* compress */
 	dst = get_cpu_var(zswap_dstmem);
 	src = kmap_atomic(page);
@@ -647,7 +771,7 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 
 	/* store */
 	len = dlen + sizeof(struct zswap_header);
-	ret = zbud_alloc(tree->pool, len, __GFP_NORETRY | __GFP_NOWARN,
+	ret = zpool_malloc(tree->pool, len, __GFP_NORETRY | __GFP_NOWARN,
 		&handle);
 	if (ret == -ENOSPC) {
 		zswap_reject_compress_poor++;
@@ -657,11 +781,11 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 		zswap_reject_alloc_fail++;
 		goto freepage;
 	}
-	zhdr = zbud_map(tree->pool, handle);
+	zhdr = zpool_map_handle(tree->pool, handle, ZPOOL_MM_WO);
 	zhdr->swpentry = swp_entry(type, offset);
 	buf = (u8 *)(zhdr + 1);
 	memcpy(buf, dst, dlen);
-	zbud_unmap(tree->pool, handle);
+	zpool_unmap_handle(tree->pool, handle);
 	put_cpu_var(zswap_dstmem);
 
 	/* populate entry */
@@ -669,6 +793,7 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 	entry->handle = handle;
 	entry->length = dlen;
 
+insert:
 	/* map */
 	spin_lock(&tree->lock);
 	do {
@@ -687,7 +812,7 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 
 	/* update stats */
 	atomic_inc(&zswap_stored_pages);
-	zswap_pool_pages = zbud_get_pool_size(tree->pool);
+	zswap_pool_pages = zpool_get_total_size(tree->pool) >> PAGE_SHIFT;
 
 	return 0;
 
@@ -722,17 +847,25 @@ static int zswap_frontswap_load(unsigned type, pgoff_t offset,
 	zswap_entry_get(entry);
 	spin_unlock(&tree->lock);
 
+	if (!entry->length) {
+		dst = kmap_atomic(page);
+		zswap_fill_page(dst, entry->value);
+		kunmap_atomic(dst);
+		goto put;
+	}
+
 	/* decompress */
 	dlen = PAGE_SIZE;
-	src = (u8 *)zbud_map(tree->pool, entry->handle) +
+	src = (u8 *)zpool_map_handle(tree->pool, entry->handle, ZPOOL_MM_RO) +
 			sizeof(struct zswap_header);
 	dst = kmap_atomic(page);
 	ret = zswap_comp_op(ZSWAP_COMPOP_DECOMPRESS, src, entry->length,
 		dst, &dlen);
 	kunmap_atomic(dst);
-	zbud_unmap(tree->pool, entry->handle);
+	zpool_unmap_handle(tree->pool, entry->handle);
 	BUG_ON(ret);
 
+put:
 	spin_lock(&tree->lock);
 	refcount = zswap_entry_put(entry);
 	if (likely(refcount)) {
@@ -810,7 +943,10 @@ static void zswap_frontswap_invalidate_area(unsigned type)
 	while ((node = rb_first(&tree->rbroot))) {
 		entry = rb_entry(node, struct zswap_entry, rbnode);
 		rb_erase(&entry->rbnode, &tree->rbroot);
-		zbud_free(tree->pool, entry->handle);
+		if (!entry->length)
+			atomic_dec(&zswap_same_filled_pages);
+		else
+			zpool_free(tree->pool, entry->handle);
 		zswap_entry_cache_free(entry);
 		atomic_dec(&zswap_stored_pages);
 	}
@@ -818,7 +954,7 @@ static void zswap_frontswap_invalidate_area(unsigned type)
 	spin_unlock(&tree->lock);
 }
 
-static struct zbud_ops zswap_zbud_ops = {
+static struct zpool_ops zswap_zpool_ops = {
 	.evict = zswap_writeback_entry
 };
 
@@ -829,9 +965,14 @@ static void zswap_frontswap_init(unsigned type)
 	tree = kzalloc(sizeof(struct zswap_tree), GFP_KERNEL);
 	if (!tree)
 		goto err;
-	tree->pool = zbud_create_pool(GFP_KERNEL, &zswap_zbud_ops);
+	kparam_block_sysfs_write(zpool);
+	tree->pool = zpool_create_pool(zswap_zpool_type, GFP_KERNEL,
+					&zswap_zpool_ops);
+	kparam_unblock_sysfs_write(zpool);
 	if (!tree->pool)
 		goto freetree;
+	pr_info("using %s pool for swap type %d\n",
+		zpool_get_type(tree->pool), type);
 	tree->rbroot = RB_ROOT;
 	spin_lock_init(&tree->lock);
 	zswap_trees[type] = tree;
@@ -886,6 +1027,8 @@ static int __init zswap_debugfs_init(void)
 			zswap_debugfs_root, &zswap_pool_pages);
 	debugfs_create_atomic_t("stored_pages", S_IRUGO,
 			zswap_debugfs_root, &zswap_stored_pages);
+	debugfs_create_atomic_t("same_filled_pages", S_IRUGO,
+			zswap_debugfs_root, &zswap_same_filled_pages);
 
 	return 0;
 }
@@ -908,10 +1051,17 @@ static void __exit zswap_debugfs_exit(void) { }
 **********************************/
 static int __init init_zswap(void)
 {
+	zswap_init_started = true;
 	if (!zswap_enabled)
 		return 0;
 
 	pr_info("loading zswap\n");
+	if (!zpool_has_pool(zswap_zpool_type)) {
+		pr_info("%s zpool not available, using %s\n",
+			zswap_zpool_type, ZSWAP_ZPOOL_DEFAULT);
+		strlcpy(zswap_zpool_type, ZSWAP_ZPOOL_DEFAULT,
+			sizeof(zswap_zpool_type));
+	}
 	if (zswap_entry_cache_create()) {
 		pr_err("entry cache creation failed\n");
 		goto error;
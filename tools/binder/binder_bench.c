@@ -0,0 +1,422 @@
+/*
+ * binder_bench - measure binder transaction throughput
+ *
+ * Forks a server that registers as the binder context manager and
+ * answers every transaction with an empty reply from a pool of looper
+ * threads.  The parent then runs 1..N client threads which send
+ * synchronous transactions to handle 0 for a fixed time and reports the
+ * number of round trips per second for each thread count.
+ *
+ * With -r the clients run SCHED_FIFO at the given priority and the
+ * worst-case round trip is reported too; -c adds that many busy looping
+ * SCHED_OTHER threads, so a server thread that does not inherit the
+ * caller's priority has to compete with them for the CPU.
+ *
+ * Only one context manager can exist at a time, so this has to run on
+ * a system where servicemanager is not (yet) running.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binder.h"
+
+#define BINDER_DEV	"/dev/binder"
+#define MAP_SIZE	(128 * 1024)
+#define MAX_PAYLOAD	(16 * 1024)
+
+static int max_threads = 8;
+static int duration = 5;
+static size_t payload = 64;
+static int rt_prio;
+static int nr_hogs;
+static volatile int stop;
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static int binder_open(void)
+{
+	struct binder_version vers;
+	void *map;
+	int fd;
+
+	fd = open(BINDER_DEV, O_RDWR);
+	if (fd < 0)
+		die("open " BINDER_DEV);
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version,
+			BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	return fd;
+}
+
+static int binder_write_read(int fd, void *wbuf, size_t wsize,
+			     void *rbuf, size_t rsize, size_t *rconsumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.write_size = wsize;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rsize;
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (rconsumed)
+		*rconsumed = bwr.read_consumed;
+	return ret;
+}
+
+/* Queues BC_FREE_BUFFER for @data into @cmd, returns the bytes used. */
+static size_t put_free_buffer(void *cmd, const void *data)
+{
+	uint32_t *c = cmd;
+
+	c[0] = BC_FREE_BUFFER;
+	memcpy(&c[1], &data, sizeof(data));
+	return sizeof(uint32_t) + sizeof(data);
+}
+
+/*
+ * Skips over one return command, returns its size or 0 if @cmd is not
+ * one the benchmark expects.
+ */
+static size_t br_size(uint32_t cmd)
+{
+	switch (cmd) {
+	case BR_NOOP:
+	case BR_TRANSACTION_COMPLETE:
+	case BR_SPAWN_LOOPER:
+	case BR_DEAD_REPLY:
+	case BR_FAILED_REPLY:
+		return sizeof(uint32_t);
+	case BR_INCREFS:
+	case BR_ACQUIRE:
+	case BR_RELEASE:
+	case BR_DECREFS:
+		return sizeof(uint32_t) + 2 * sizeof(void *);
+	case BR_TRANSACTION:
+	case BR_REPLY:
+		return sizeof(uint32_t) +
+			sizeof(struct binder_transaction_data);
+	default:
+		return 0;
+	}
+}
+
+static void *server_thread(void *arg)
+{
+	int fd = (long)arg;
+	char rbuf[256];
+	char wbuf[64];
+	size_t wsize;
+	uint32_t cmd = BC_ENTER_LOOPER;
+
+	if (binder_write_read(fd, &cmd, sizeof(cmd), NULL, 0, NULL) < 0)
+		die("BC_ENTER_LOOPER");
+
+	wsize = 0;
+	for (;;) {
+		size_t consumed, pos;
+
+		if (binder_write_read(fd, wbuf, wsize, rbuf, sizeof(rbuf),
+				      &consumed) < 0)
+			die("server BINDER_WRITE_READ");
+		wsize = 0;
+		for (pos = 0; pos < consumed; ) {
+			struct binder_transaction_data *tr;
+			struct binder_transaction_data reply;
+			size_t size;
+
+			memcpy(&cmd, rbuf + pos, sizeof(cmd));
+			size = br_size(cmd);
+			if (!size) {
+				fprintf(stderr, "server: unexpected 0x%x\n",
+					cmd);
+				exit(1);
+			}
+			if (cmd == BR_TRANSACTION) {
+				tr = (void *)(rbuf + pos + sizeof(cmd));
+				wsize += put_free_buffer(wbuf + wsize,
+						tr->data.ptr.buffer);
+				memset(&reply, 0, sizeof(reply));
+				cmd = BC_REPLY;
+				memcpy(wbuf + wsize, &cmd, sizeof(cmd));
+				wsize += sizeof(cmd);
+				memcpy(wbuf + wsize, &reply, sizeof(reply));
+				wsize += sizeof(reply);
+			}
+			pos += size;
+		}
+	}
+	return NULL;
+}
+
+static void server(int ready_fd)
+{
+	pthread_t tid;
+	int fd, i;
+	char c = 0;
+
+	fd = binder_open();
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	for (i = 0; i < max_threads; i++)
+		if (pthread_create(&tid, NULL, server_thread, (void *)(long)fd))
+			die("pthread_create");
+	if (write(ready_fd, &c, 1) != 1)
+		die("write");
+	for (;;)
+		pause();
+}
+
+struct client {
+	pthread_t tid;
+	int fd;
+	unsigned long count;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+};
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *hog_thread(void *arg)
+{
+	(void)arg;
+	while (!stop)
+		;
+	return NULL;
+}
+
+static void *client_thread(void *arg)
+{
+	struct client *cl = arg;
+	static char data[MAX_PAYLOAD];
+	char wbuf[sizeof(uint32_t) + sizeof(struct binder_transaction_data)
+		  + sizeof(uint32_t) + sizeof(void *)];
+	char rbuf[256];
+	struct binder_transaction_data tr;
+	const void *reply_buffer = NULL;
+	uint32_t cmd;
+
+	if (rt_prio) {
+		struct sched_param param = { .sched_priority = rt_prio };
+
+		if (sched_setscheduler(0, SCHED_FIFO, &param))
+			die("sched_setscheduler");
+	}
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = 0;
+	tr.code = 1;
+	tr.data_size = payload;
+	tr.data.ptr.buffer = data;
+
+	while (!stop) {
+		size_t wsize = 0;
+		int done = 0;
+		unsigned long long start, delta;
+
+		if (reply_buffer)
+			wsize += put_free_buffer(wbuf, reply_buffer);
+		reply_buffer = NULL;
+		cmd = BC_TRANSACTION;
+		memcpy(wbuf + wsize, &cmd, sizeof(cmd));
+		wsize += sizeof(cmd);
+		memcpy(wbuf + wsize, &tr, sizeof(tr));
+		wsize += sizeof(tr);
+
+		start = now_ns();
+		while (!done) {
+			size_t consumed, pos;
+
+			if (binder_write_read(cl->fd, wbuf, wsize, rbuf,
+					      sizeof(rbuf), &consumed) < 0)
+				die("client BINDER_WRITE_READ");
+			wsize = 0;
+			for (pos = 0; pos < consumed; ) {
+				size_t size;
+
+				memcpy(&cmd, rbuf + pos, sizeof(cmd));
+				size = br_size(cmd);
+				if (!size || cmd == BR_DEAD_REPLY ||
+				    cmd == BR_FAILED_REPLY) {
+					fprintf(stderr,
+						"client: unexpected 0x%x\n",
+						cmd);
+					exit(1);
+				}
+				if (cmd == BR_REPLY) {
+					struct binder_transaction_data *r;
+
+					r = (void *)(rbuf + pos + sizeof(cmd));
+					reply_buffer = r->data.ptr.buffer;
+					done = 1;
+				}
+				pos += size;
+			}
+		}
+		delta = now_ns() - start;
+		cl->total_ns += delta;
+		if (delta > cl->max_ns)
+			cl->max_ns = delta;
+		cl->count++;
+	}
+	if (reply_buffer) {
+		size_t wsize = put_free_buffer(wbuf, reply_buffer);
+
+		binder_write_read(cl->fd, wbuf, wsize, NULL, 0, NULL);
+	}
+	return NULL;
+}
+
+static void run(int fd, int nthreads)
+{
+	struct client *clients;
+	pthread_t *hogs;
+	struct timeval start, end;
+	unsigned long total = 0;
+	unsigned long long total_ns = 0, max_ns = 0;
+	double secs;
+	int i;
+
+	clients = calloc(nthreads, sizeof(*clients));
+	hogs = calloc(nr_hogs + 1, sizeof(*hogs));
+	if (!clients || !hogs)
+		die("calloc");
+	stop = 0;
+	for (i = 0; i < nr_hogs; i++)
+		if (pthread_create(&hogs[i], NULL, hog_thread, NULL))
+			die("pthread_create");
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nthreads; i++) {
+		clients[i].fd = fd;
+		if (pthread_create(&clients[i].tid, NULL, client_thread,
+				   &clients[i]))
+			die("pthread_create");
+	}
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(clients[i].tid, NULL);
+		total += clients[i].count;
+		total_ns += clients[i].total_ns;
+		if (clients[i].max_ns > max_ns)
+			max_ns = clients[i].max_ns;
+	}
+	gettimeofday(&end, NULL);
+	for (i = 0; i < nr_hogs; i++)
+		pthread_join(hogs[i], NULL);
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("threads %2d: %10lu transactions, %10.0f/s, "
+	       "latency avg %6llu us max %8llu us\n",
+	       nthreads, total, total / secs,
+	       total ? total_ns / total / 1000 : 0, max_ns / 1000);
+	free(hogs);
+	free(clients);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t max_threads] [-d seconds] "
+		"[-s payload_bytes] [-r fifo_prio] [-c hog_threads]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int pipefd[2];
+	pid_t pid;
+	int fd, opt, i;
+	char c;
+
+	while ((opt = getopt(argc, argv, "t:d:s:r:c:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		case 'r':
+			rt_prio = atoi(optarg);
+			break;
+		case 'c':
+			nr_hogs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || duration < 1 || payload > MAX_PAYLOAD ||
+	    rt_prio < 0 || rt_prio > 99 || nr_hogs < 0)
+		usage(argv[0]);
+
+	if (pipe(pipefd))
+		die("pipe");
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		close(pipefd[0]);
+		server(pipefd[1]);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1) {
+		fprintf(stderr, "server failed to start\n");
+		return 1;
+	}
+
+	fd = binder_open();
+	printf("binder_bench: %zu byte payload, %d s per run, "
+	       "client prio %s%d, %d hogs\n", payload, duration,
+	       rt_prio ? "fifo " : "nice ", rt_prio, nr_hogs);
+	for (i = 1; i <= max_threads; i++)
+		run(fd, i);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * zram_bench - measure how zram scales with concurrent swap-like I/O
+ *
+ * Fills a zram device with half compressible pages, then runs 1..N
+ * threads which each issue page sized O_DIRECT reads and writes at
+ * random page offsets for a fixed time, the way swap-in and swap-out
+ * storms hit the device.  For each thread count the number of reads
+ * and writes per second and the average and worst latency are
+ * reported, so the per-slot locking can be compared against a kernel
+ * that serializes the device on one lock.
+ *
+ * Run it on a device that is not in use as swap:
+ *
+ *	echo 256M > /sys/block/zram1/disksize
+ *	zram_bench -f /dev/block/zram1 -t 8 -w 30
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#define PAGE_SZ		4096
+
+static const char *dev = "/dev/block/zram0";
+static int max_threads = 8;
+static int duration = 5;
+static int write_pct = 30;
+static unsigned long long dev_pages;
+static volatile int stop;
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/*
+ * Random first half, zero second half: compresses about 2:1 like
+ * typical anonymous memory, and is never a same-filled page.
+ */
+static void fill_page(char *buf, uint64_t *seed)
+{
+	uint64_t *p = (uint64_t *)buf;
+	size_t i;
+
+	for (i = 0; i < PAGE_SZ / 2 / sizeof(*p); i++)
+		p[i] = xorshift(seed);
+	memset(buf + PAGE_SZ / 2, 0, PAGE_SZ / 2);
+}
+
+static int dev_open(void)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(dev, O_RDWR | O_DIRECT);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(dev, O_RDWR);
+	if (fd < 0)
+		die(dev);
+	if (fstat(fd, &st))
+		die("fstat");
+	if (S_ISBLK(st.st_mode)) {
+		unsigned long long bytes;
+
+		if (ioctl(fd, BLKGETSIZE64, &bytes))
+			die("BLKGETSIZE64");
+		dev_pages = bytes / PAGE_SZ;
+	} else {
+		dev_pages = st.st_size / PAGE_SZ;
+	}
+	if (!dev_pages) {
+		fprintf(stderr, "%s: no disksize set\n", dev);
+		exit(1);
+	}
+	return fd;
+}
+
+struct worker {
+	pthread_t tid;
+	int fd;
+	int nr, nthreads;
+	uint64_t seed;
+	unsigned long reads, writes;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+};
+
+static void *alloc_page_buf(void)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, PAGE_SZ, PAGE_SZ))
+		die("posix_memalign");
+	return buf;
+}
+
+/* Each worker writes its share of the device once. */
+static void *prefill_thread(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = alloc_page_buf();
+	unsigned long long page;
+
+	for (page = w->nr; page < dev_pages; page += w->nthreads) {
+		fill_page(buf, &w->seed);
+		if (pwrite(w->fd, buf, PAGE_SZ, page * PAGE_SZ) != PAGE_SZ)
+			die("prefill pwrite");
+	}
+	free(buf);
+	return NULL;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct worker *w = arg;
+	char *buf = alloc_page_buf();
+
+	while (!stop) {
+		unsigned long long page, start, delta;
+		int write = (int)(xorshift(&w->seed) % 100) < write_pct;
+		ssize_t ret;
+
+		page = xorshift(&w->seed) % dev_pages;
+		start = now_ns();
+		if (write) {
+			fill_page(buf, &w->seed);
+			ret = pwrite(w->fd, buf, PAGE_SZ, page * PAGE_SZ);
+			w->writes++;
+		} else {
+			ret = pread(w->fd, buf, PAGE_SZ, page * PAGE_SZ);
+			w->reads++;
+		}
+		delta = now_ns() - start;
+		if (ret != PAGE_SZ)
+			die(write ? "pwrite" : "pread");
+		w->total_ns += delta;
+		if (delta > w->max_ns)
+			w->max_ns = delta;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void prefill(int fd, int nthreads)
+{
+	struct worker *workers;
+	int i;
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		die("calloc");
+	for (i = 0; i < nthreads; i++) {
+		workers[i].fd = fd;
+		workers[i].nr = i;
+		workers[i].nthreads = nthreads;
+		workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		if (pthread_create(&workers[i].tid, NULL, prefill_thread,
+				   &workers[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].tid, NULL);
+	free(workers);
+}
+
+static void run(int fd, int nthreads)
+{
+	struct worker *workers;
+	struct timeval start, end;
+	unsigned long reads = 0, writes = 0;
+	unsigned long long total_ns = 0, max_ns = 0;
+	double secs;
+	int i;
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers)
+		die("calloc");
+	stop = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nthreads; i++) {
+		workers[i].fd = fd;
+		workers[i].seed = now_ns() ^ (0x9e3779b97f4a7c15ULL * (i + 1));
+		if (pthread_create(&workers[i].tid, NULL, bench_thread,
+				   &workers[i]))
+			die("pthread_create");
+	}
+	sleep(duration);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		reads += workers[i].reads;
+		writes += workers[i].writes;
+		total_ns += workers[i].total_ns;
+		if (workers[i].max_ns > max_ns)
+			max_ns = workers[i].max_ns;
+	}
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("threads %2d: %9.0f reads/s %9.0f writes/s %8.1f MB/s, "
+	       "latency avg %5llu us max %7llu us\n",
+	       nthreads, reads / secs, writes / secs,
+	       (reads + writes) * (double)PAGE_SZ / secs / (1 << 20),
+	       reads + writes ? total_ns / (reads + writes) / 1000 : 0,
+	       max_ns / 1000);
+	free(workers);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-f device] [-t max_threads] "
+		"[-d seconds] [-w write_percent]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int fd, opt, i;
+
+	while ((opt = getopt(argc, argv, "f:t:d:w:")) != -1) {
+		switch (opt) {
+		case 'f':
+			dev = optarg;
+			break;
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'w':
+			write_pct = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (max_threads < 1 || duration < 1 || write_pct < 0 ||
+	    write_pct > 100)
+		usage(argv[0]);
+
+	fd = dev_open();
+	printf("zram_bench: %s, %llu pages, %d%% writes, %d s per run\n",
+	       dev, dev_pages, write_pct, duration);
+	prefill(fd, max_threads);
+	for (i = 1; i <= max_threads; i++)
+		run(fd, i);
+
+	close(fd);
+	return 0;
+}